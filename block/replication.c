@@ -0,0 +1,436 @@
+/*
+ * Replication Block filter
+ *
+ * On the primary, a replication node sits on top of the NBD connection to
+ * the secondary (usually as a quorum child next to the local disk) and
+ * forwards the guest's I/O to it.
+ *
+ * On the secondary, it sits on top of the chain
+ *
+ *     active disk -> hidden disk -> secondary disk
+ *
+ * The secondary disk is exported over NBD and receives the primary's
+ * writes.  A sync=none backup job copies the old content of every cluster
+ * the primary overwrites into the hidden disk, and the secondary guest
+ * writes to the active disk, so the secondary disk always tracks the
+ * primary while the guest sees a consistent image.  At a checkpoint the
+ * guest has just taken over the primary's state, so the active and hidden
+ * disks are simply emptied: the cost is independent of how much either
+ * side wrote.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/blockjob.h"
+#include "block/replication.h"
+#include "qapi/qmp/qerror.h"
+#include "trace.h"
+
+typedef enum {
+    BLOCK_REPLICATION_NONE,             /* not started */
+    BLOCK_REPLICATION_RUNNING,          /* replicating */
+    BLOCK_REPLICATION_DONE,             /* stopped, the other side is gone */
+} ReplicationStage;
+
+typedef struct BDRVReplicationState {
+    BlockDriverState *bs;
+    ReplicationMode mode;
+    ReplicationStage replication_state;
+    /* Secondary only, valid while running */
+    BlockDriverState *active_disk;
+    BlockDriverState *hidden_disk;
+    BlockDriverState *secondary_disk;
+    int orig_hidden_flags;
+    QLIST_ENTRY(BDRVReplicationState) next;
+} BDRVReplicationState;
+
+static QLIST_HEAD(, BDRVReplicationState) replication_states =
+    QLIST_HEAD_INITIALIZER(replication_states);
+
+#define REPLICATION_MODE        "mode"
+
+static QemuOptsList replication_runtime_opts = {
+    .name = "replication",
+    .head = QTAILQ_HEAD_INITIALIZER(replication_runtime_opts.head),
+    .desc = {
+        {
+            .name = REPLICATION_MODE,
+            .type = QEMU_OPT_STRING,
+            .help = "Replication mode (primary or secondary)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int parse_replication_mode(const char *opt)
+{
+    int i;
+
+    if (!opt) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < REPLICATION_MODE_MAX; i++) {
+        if (!strcmp(opt, ReplicationMode_lookup[i])) {
+            return i;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static int replication_open(BlockDriverState *bs, QDict *options,
+                            int flags, Error **errp)
+{
+    BDRVReplicationState *s = bs->opaque;
+    Error *local_err = NULL;
+    QemuOpts *opts;
+    int ret;
+
+    opts = qemu_opts_create(&replication_runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = parse_replication_mode(qemu_opt_get(opts, REPLICATION_MODE));
+    if (ret < 0) {
+        error_setg(errp, "The option mode's value should be primary or "
+                   "secondary");
+        goto fail;
+    }
+
+    s->bs = bs;
+    s->mode = ret;
+    s->replication_state = BLOCK_REPLICATION_NONE;
+    QLIST_INSERT_HEAD(&replication_states, s, next);
+    ret = 0;
+
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void replication_stop(BDRVReplicationState *s, bool failover,
+                             Error **errp);
+
+static void replication_close(BlockDriverState *bs)
+{
+    BDRVReplicationState *s = bs->opaque;
+
+    if (s->replication_state == BLOCK_REPLICATION_RUNNING) {
+        replication_stop(s, false, NULL);
+    }
+    QLIST_REMOVE(s, next);
+}
+
+static int64_t replication_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int replication_get_io_status(BDRVReplicationState *s)
+{
+    if (s->mode == REPLICATION_MODE_PRIMARY &&
+        s->replication_state == BLOCK_REPLICATION_DONE) {
+        /* The secondary is gone, there is no point in talking to it */
+        return -EIO;
+    }
+    return 0;
+}
+
+static int coroutine_fn replication_co_readv(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             int nb_sectors,
+                                             QEMUIOVector *qiov)
+{
+    BDRVReplicationState *s = bs->opaque;
+    int ret;
+
+    ret = replication_get_io_status(s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+}
+
+static int coroutine_fn replication_co_writev(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors,
+                                              QEMUIOVector *qiov)
+{
+    BDRVReplicationState *s = bs->opaque;
+    int ret;
+
+    ret = replication_get_io_status(s);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_writev(bs->file->bs, sector_num, nb_sectors, qiov);
+}
+
+static bool replication_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                    BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static void secondary_do_checkpoint(BDRVReplicationState *s, Error **errp)
+{
+    Error *local_err = NULL;
+
+    if (!s->secondary_disk->job) {
+        error_setg(errp, "Backup job was cancelled unexpectedly");
+        return;
+    }
+
+    /* The guest is stopped, but the primary may still be writing */
+    bdrv_drain_all();
+
+    backup_do_checkpoint(s->secondary_disk->job, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (bdrv_make_empty(s->active_disk, errp) < 0) {
+        return;
+    }
+    bdrv_make_empty(s->hidden_disk, errp);
+}
+
+static void backup_job_completed(void *opaque, int ret)
+{
+    BDRVReplicationState *s = opaque;
+
+    trace_replication_backup_job_completed(s, ret);
+}
+
+static void secondary_start(BDRVReplicationState *s, Error **errp)
+{
+    Error *local_err = NULL;
+    int64_t active_length, hidden_length, secondary_length;
+
+    s->active_disk = s->bs->file->bs;
+    if (!s->active_disk->backing || !s->active_disk->backing->bs->backing) {
+        error_setg(errp, "Active disk must have a hidden disk and a "
+                   "secondary disk behind it");
+        return;
+    }
+    s->hidden_disk = s->active_disk->backing->bs;
+    s->secondary_disk = s->hidden_disk->backing->bs;
+
+    active_length = bdrv_getlength(s->active_disk);
+    hidden_length = bdrv_getlength(s->hidden_disk);
+    secondary_length = bdrv_getlength(s->secondary_disk);
+    if (active_length < 0 || hidden_length < 0 || secondary_length < 0 ||
+        active_length != hidden_length || hidden_length != secondary_length) {
+        error_setg(errp, "Active disk, hidden disk, secondary disk's length"
+                   " are not the same");
+        return;
+    }
+
+    /* The hidden disk is a read-only backing file, the backup job writes it */
+    s->orig_hidden_flags = bdrv_get_flags(s->hidden_disk);
+    if (!(s->orig_hidden_flags & BDRV_O_RDWR)) {
+        bdrv_reopen(s->hidden_disk, s->orig_hidden_flags | BDRV_O_RDWR,
+                    &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    /* Start from empty overlays on top of the freshly migrated disk */
+    if (bdrv_make_empty(s->active_disk, &local_err) < 0 ||
+        bdrv_make_empty(s->hidden_disk, &local_err) < 0) {
+        goto fail;
+    }
+
+    bdrv_op_unblock(s->hidden_disk, BLOCK_OP_TYPE_BACKUP_TARGET,
+                    s->active_disk->backing_blocker);
+    bdrv_op_unblock(s->secondary_disk, BLOCK_OP_TYPE_BACKUP_SOURCE,
+                    s->hidden_disk->backing_blocker);
+
+    backup_start(s->secondary_disk, s->hidden_disk, 0,
+                 MIRROR_SYNC_MODE_NONE, NULL, BLOCKDEV_ON_ERROR_REPORT,
+                 BLOCKDEV_ON_ERROR_REPORT, backup_job_completed,
+                 s, &local_err);
+    if (local_err) {
+        bdrv_op_block(s->hidden_disk, BLOCK_OP_TYPE_BACKUP_TARGET,
+                      s->active_disk->backing_blocker);
+        bdrv_op_block(s->secondary_disk, BLOCK_OP_TYPE_BACKUP_SOURCE,
+                      s->hidden_disk->backing_blocker);
+        goto fail;
+    }
+    return;
+
+fail:
+    error_propagate(errp, local_err);
+    if (!(s->orig_hidden_flags & BDRV_O_RDWR)) {
+        bdrv_reopen(s->hidden_disk, s->orig_hidden_flags, NULL);
+    }
+}
+
+static void secondary_stop(BDRVReplicationState *s)
+{
+    if (s->secondary_disk->job) {
+        block_job_cancel_sync(s->secondary_disk->job);
+    }
+
+    bdrv_op_block(s->hidden_disk, BLOCK_OP_TYPE_BACKUP_TARGET,
+                  s->active_disk->backing_blocker);
+    bdrv_op_block(s->secondary_disk, BLOCK_OP_TYPE_BACKUP_SOURCE,
+                  s->hidden_disk->backing_blocker);
+
+    /*
+     * The guest goes on with the chain as it is: the hidden disk still
+     * holds what the primary overwrote since the last checkpoint, it is
+     * only read from now on.
+     */
+    if (!(s->orig_hidden_flags & BDRV_O_RDWR)) {
+        bdrv_reopen(s->hidden_disk, s->orig_hidden_flags, NULL);
+    }
+}
+
+static void replication_start(BDRVReplicationState *s, Error **errp)
+{
+    Error *local_err = NULL;
+
+    if (s->replication_state != BLOCK_REPLICATION_NONE) {
+        error_setg(errp, "Block replication is running or done");
+        return;
+    }
+
+    if (s->mode == REPLICATION_MODE_SECONDARY) {
+        secondary_start(s, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    s->replication_state = BLOCK_REPLICATION_RUNNING;
+    trace_replication_start(s, s->mode);
+}
+
+static void replication_do_checkpoint(BDRVReplicationState *s, Error **errp)
+{
+    if (s->replication_state != BLOCK_REPLICATION_RUNNING) {
+        error_setg(errp, "Block replication is not running");
+        return;
+    }
+
+    if (s->mode == REPLICATION_MODE_SECONDARY) {
+        secondary_do_checkpoint(s, errp);
+    }
+}
+
+static void replication_stop(BDRVReplicationState *s, bool failover,
+                             Error **errp)
+{
+    if (s->replication_state != BLOCK_REPLICATION_RUNNING) {
+        error_setg(errp, "Block replication is not running");
+        return;
+    }
+
+    if (s->mode == REPLICATION_MODE_SECONDARY) {
+        secondary_stop(s);
+    }
+
+    s->replication_state = BLOCK_REPLICATION_DONE;
+    trace_replication_stop(s, failover);
+}
+
+void replication_start_all(Error **errp)
+{
+    BDRVReplicationState *s, *t;
+    Error *local_err = NULL;
+
+    QLIST_FOREACH(s, &replication_states, next) {
+        aio_context_acquire(bdrv_get_aio_context(s->bs));
+        replication_start(s, &local_err);
+        aio_context_release(bdrv_get_aio_context(s->bs));
+        if (local_err) {
+            error_propagate(errp, local_err);
+            goto fail;
+        }
+    }
+    return;
+
+fail:
+    /* Roll back the nodes that did start */
+    QLIST_FOREACH(t, &replication_states, next) {
+        if (t == s) {
+            break;
+        }
+        aio_context_acquire(bdrv_get_aio_context(t->bs));
+        replication_stop(t, false, NULL);
+        t->replication_state = BLOCK_REPLICATION_NONE;
+        aio_context_release(bdrv_get_aio_context(t->bs));
+    }
+}
+
+void replication_do_checkpoint_all(Error **errp)
+{
+    BDRVReplicationState *s;
+    Error *local_err = NULL;
+
+    QLIST_FOREACH(s, &replication_states, next) {
+        aio_context_acquire(bdrv_get_aio_context(s->bs));
+        replication_do_checkpoint(s, &local_err);
+        aio_context_release(bdrv_get_aio_context(s->bs));
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+}
+
+void replication_stop_all(bool failover, Error **errp)
+{
+    BDRVReplicationState *s;
+    Error *local_err = NULL;
+
+    QLIST_FOREACH(s, &replication_states, next) {
+        if (s->replication_state != BLOCK_REPLICATION_RUNNING) {
+            continue;
+        }
+        aio_context_acquire(bdrv_get_aio_context(s->bs));
+        replication_stop(s, failover, &local_err);
+        aio_context_release(bdrv_get_aio_context(s->bs));
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+}
+
+static BlockDriver bdrv_replication = {
+    .format_name                = "replication",
+    .instance_size              = sizeof(BDRVReplicationState),
+
+    .bdrv_open                  = replication_open,
+    .bdrv_close                 = replication_close,
+
+    .bdrv_getlength             = replication_getlength,
+    .bdrv_co_readv              = replication_co_readv,
+    .bdrv_co_writev             = replication_co_writev,
+
+    .is_filter                  = true,
+    .bdrv_recurse_is_first_non_filter = replication_recurse_is_first_non_filter,
+};
+
+static void bdrv_replication_init(void)
+{
+    bdrv_register(&bdrv_replication);
+}
+
+block_init(bdrv_replication_init);
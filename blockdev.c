@@ -3202,6 +3202,61 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_x_blockdev_change(const char *parent, bool has_child,
+                           const char *child, bool has_node,
+                           const char *node, Error **errp)
+{
+    BlockDriverState *parent_bs, *new_bs = NULL;
+    BdrvChild *p_child;
+    AioContext *aio_context;
+
+    parent_bs = bdrv_lookup_bs(parent, parent, errp);
+    if (!parent_bs) {
+        return;
+    }
+
+    if (has_child == has_node) {
+        if (has_child) {
+            error_setg(errp, "The parameters child and node are in conflict");
+        } else {
+            error_setg(errp, "Either child or node must be specified");
+        }
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(parent_bs);
+    aio_context_acquire(aio_context);
+
+    if (has_child) {
+        QLIST_FOREACH(p_child, &parent_bs->children, next) {
+            if (!strcmp(p_child->bs->node_name, child)) {
+                break;
+            }
+        }
+
+        if (!p_child) {
+            error_setg(errp, "Node '%s' is not a child of '%s'", child,
+                       parent);
+            goto out;
+        }
+
+        bdrv_del_child(parent_bs, p_child, errp);
+    }
+
+    if (has_node) {
+        new_bs = bdrv_find_node(node);
+        if (!new_bs) {
+            error_setg(errp, "Node '%s' not found", node);
+            goto out;
+        }
+
+        bdrv_add_child(parent_bs, new_bs, errp);
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_blockdev_add(BlockdevOptions *options, Error **errp)
 {
     QmpOutputVisitor *ov = qmp_output_visitor_new();
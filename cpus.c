@@ -518,7 +518,7 @@ static void cpu_throttle_thread(void *opaque)
     CPUState *cpu = opaque;
     double pct;
     double throttle_ratio;
-    long sleeptime_ns;
+    int64_t sleeptime_ns, endtime_ns;
 
     if (!cpu_throttle_get_percentage()) {
         return;
@@ -526,11 +526,20 @@ static void cpu_throttle_thread(void *opaque)
 
     pct = (double)cpu_throttle_get_percentage()/100;
     throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+    endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
 
     qemu_mutex_unlock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
-    g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
+    /* At 99% this is a second: sleep in slices, so that stopping the VM
+     * (e.g. at the end of migration) or the throttle doesn't wait for all
+     * of it.  Oversleeping a slice is made up for by sleeping less.
+     */
+    while (sleeptime_ns > 0 && !atomic_read(&cpu->stop) &&
+           cpu_throttle_active()) {
+        g_usleep(MIN(sleeptime_ns, CPU_THROTTLE_TIMESLICE_NS) / SCALE_US);
+        sleeptime_ns = endtime_ns - qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
     qemu_mutex_lock_iothread();
 }
 
@@ -1219,6 +1219,7 @@ static void *file_ram_alloc(RAMBlock *block,
         goto error;
     }
     block->mr->align = hpagesize;
+    block->page_size = hpagesize;
 
     if (memory < hpagesize) {
         error_setg(errp, "memory size 0x" RAM_ADDR_FMT " must be equal to "
@@ -1629,6 +1630,7 @@ ram_addr_t qemu_ram_alloc_internal(ram_addr_t size, ram_addr_t max_size,
     new_block->used_length = size;
     new_block->max_length = max_size;
     assert(max_size >= size);
+    new_block->page_size = getpagesize();
     new_block->fd = -1;
     new_block->host = host;
     if (host) {
@@ -911,6 +911,38 @@ STEXI
 @findex migrate_cancel
 Cancel the current VM migration.
 
+ETEXI
+
+    {
+        .name       = "migrate_start_postcopy",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Followup to a migration command to switch the migration"
+                      " to postcopy mode. The x-postcopy-ram capability must "
+                      "be set before the original migration command.",
+        .mhandler.cmd = hmp_migrate_start_postcopy,
+    },
+
+STEXI
+@item migrate_start_postcopy
+@findex migrate_start_postcopy
+Switch in-progress migration to postcopy mode. Ignored after the end of
+migration (or once already in postcopy).
+ETEXI
+
+    {
+        .name       = "x_colo_lost_heartbeat",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Tell COLO that the peer is gone and fail over",
+        .mhandler.cmd = hmp_x_colo_lost_heartbeat,
+    },
+
+STEXI
+@item x_colo_lost_heartbeat
+@findex x_colo_lost_heartbeat
+Tell COLO that the peer is gone and fail over right away: the primary goes
+on without protection, the secondary takes over from the last checkpoint.
 ETEXI
 
     {
@@ -946,6 +978,24 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "dirty_bitmap:-b,seconds:i,sample_pages:i?",
+        .params     = "[-b] seconds [sample_pages]",
+        .help       = "start measuring the rate at which the guest dirties "
+                      "its memory for 'seconds' (1 to 60); -b uses dirty "
+                      "logging instead of sampling 'sample_pages' per GiB",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate [-b] @var{seconds} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties its memory during
+@var{seconds}, by hashing @var{sample_pages} pages per GiB of RAM or,
+with @option{-b}, with dirty logging.  See @code{info dirty_rate}.
 ETEXI
 
     {
@@ -994,7 +1044,7 @@ ETEXI
 
     {
         .name       = "migrate_set_parameter",
-        .args_type  = "parameter:s,value:i",
+        .args_type  = "parameter:s,value:s",
         .params     = "parameter value",
         .help       = "Set the parameter for migration",
         .mhandler.cmd = hmp_migrate_set_parameter,
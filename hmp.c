@@ -27,6 +27,7 @@
 #include "qapi/opts-visitor.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/string-output-visitor.h"
+#include "qapi/util.h"
 #include "qapi-visit.h"
 #include "ui/console.h"
 #include "block/qapi.h"
@@ -145,6 +146,17 @@ void hmp_info_mice(Monitor *mon, const QDict *qdict)
     qapi_free_MouseInfoList(mice_list);
 }
 
+static void hmp_print_checkpoint_histogram(Monitor *mon, const char *name,
+                                           CheckpointHistogram *h)
+{
+    if (!h->count) {
+        return;
+    }
+    monitor_printf(mon, "  %s: last %" PRId64 " min %" PRId64
+                   " avg %" PRId64 " max %" PRId64 "\n", name,
+                   h->last, h->min, h->total / h->count, h->max);
+}
+
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
 {
     MigrationInfo *info;
@@ -202,6 +214,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        if (info->ram->postcopy_requests) {
+            monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
+                           info->ram->postcopy_requests);
+        }
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -237,6 +253,32 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->x_cpu_throttle_percentage);
     }
 
+    if (info->has_x_colo) {
+        monitor_printf(mon, "colo checkpoints: periodic %" PRId64
+                       " dirty %" PRId64 " requested %" PRId64 "\n",
+                       info->x_colo->periodic, info->x_colo->dirty,
+                       info->x_colo->requested);
+        monitor_printf(mon, "colo dirty pages: %" PRId64 " pages\n",
+                       info->x_colo->dirty_pages);
+    }
+
+    if (info->has_x_checkpoint_stats) {
+        CheckpointStats *cs = info->x_checkpoint_stats;
+
+        monitor_printf(mon, "checkpoints: %" PRId64 "\n", cs->pause->count);
+        hmp_print_checkpoint_histogram(mon, "pause (us)", cs->pause);
+        hmp_print_checkpoint_histogram(mon, "bitmap sync (us)",
+                                       cs->bitmap_sync);
+        hmp_print_checkpoint_histogram(mon, "ram send (us)", cs->ram_send);
+        hmp_print_checkpoint_histogram(mon, "device save (us)",
+                                       cs->device_save);
+        hmp_print_checkpoint_histogram(mon, "flush (us)", cs->flush);
+        hmp_print_checkpoint_histogram(mon, "secondary load (us)",
+                                       cs->secondary_load);
+        hmp_print_checkpoint_histogram(mon, "bytes", cs->bytes);
+        hmp_print_checkpoint_histogram(mon, "pages", cs->pages);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -283,6 +325,24 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY],
+            params->x_checkpoint_delay);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_CHECKPOINT_DIRTY_PAGES],
+            params->x_checkpoint_dirty_pages);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_HEARTBEAT_INTERVAL],
+            params->x_heartbeat_interval);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT],
+            params->x_heartbeat_timeout);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->x_compress_method]);
         monitor_printf(mon, "\n");
     }
 
@@ -295,6 +355,37 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateRAMBlockList *block;
+
+    monitor_printf(mon, "Status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->status != DIRTY_RATE_STATUS_UNSTARTED) {
+        monitor_printf(mon, "Mode: %s",
+                       DirtyRateMeasureMode_lookup[info->mode]);
+        if (info->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+            monitor_printf(mon, " (%" PRId64 " pages per GiB)",
+                           info->sample_pages);
+        }
+        monitor_printf(mon, "\nStart time: %" PRId64 " s\n",
+                       info->start_time);
+        monitor_printf(mon, "Period: %" PRId64 " s\n", info->calc_time);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+    }
+    for (block = info->ramblocks; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRId64 " MB/s (%" PRId64 " MB)\n",
+                       block->value->id, block->value->dirty_rate,
+                       block->value->size >> 20);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1157,6 +1248,22 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_x_colo_lost_heartbeat(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_x_colo_lost_heartbeat(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -1186,6 +1293,27 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    int64_t seconds = qdict_get_int(qdict, "seconds");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(seconds, true,
+                        dirty_bitmap ? DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP :
+                                       DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING,
+                        has_sample_pages, sample_pages, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    monitor_printf(mon, "Measuring for %" PRId64 " seconds, see "
+                   "'info dirty_rate'\n", seconds);
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1227,13 +1355,21 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    long value = 0;
+    MigrationCompressMethod compress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_checkpoint_delay = false;
+    bool has_x_checkpoint_dirty_pages = false;
+    bool has_x_heartbeat_interval = false;
+    bool has_x_heartbeat_timeout = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_compress_method = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
@@ -1254,12 +1390,48 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_CHECKPOINT_DELAY:
+                has_x_checkpoint_delay = true;
+                break;
+            case MIGRATION_PARAMETER_X_CHECKPOINT_DIRTY_PAGES:
+                has_x_checkpoint_dirty_pages = true;
+                break;
+            case MIGRATION_PARAMETER_X_HEARTBEAT_INTERVAL:
+                has_x_heartbeat_interval = true;
+                break;
+            case MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT:
+                has_x_heartbeat_timeout = true;
+                break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_X_COMPRESS_METHOD:
+                has_x_compress_method = true;
+                compress_method = qapi_enum_parse(
+                    MigrationCompressMethod_lookup, valuestr,
+                    MIGRATION_COMPRESS_METHOD_MAX, -1, &err);
+                break;
+            }
+            if (!has_x_compress_method &&
+                qemu_strtol(valuestr, NULL, 10, &value)) {
+                error_setg(&err, "Value '%s' for parameter '%s' is not a "
+                           "number", valuestr, param);
+            }
+            if (err) {
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_checkpoint_delay, value,
+                                       has_x_checkpoint_dirty_pages, value,
+                                       has_x_heartbeat_interval, value,
+                                       has_x_heartbeat_timeout, value,
+                                       has_x_multifd_channels, value,
+                                       has_x_compress_method,
+                                       compress_method,
                                        &err);
             break;
         }
@@ -1467,6 +1639,7 @@ static void hmp_migrate_status_cb(void *opaque)
 
     info = qmp_query_migrate(NULL);
     if (!info->has_status || info->status == MIGRATION_STATUS_ACTIVE ||
+        info->status == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
         info->status == MIGRATION_STATUS_SETUP) {
         if (info->has_disk) {
             int progress;
@@ -288,6 +288,16 @@ struct BlockDriver {
      */
     int (*bdrv_probe_geometry)(BlockDriverState *bs, HDGeometry *geo);
 
+    /**
+     * Hot add/remove a child of a node whose driver manages a variable
+     * set of children, such as quorum.  @child_bs has no parent yet;
+     * @child is one of @parent's children.
+     */
+    void (*bdrv_add_child)(BlockDriverState *parent,
+                           BlockDriverState *child_bs, Error **errp);
+    void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
+                           Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -335,6 +345,10 @@ struct BdrvChildRole {
 extern const BdrvChildRole child_file;
 extern const BdrvChildRole child_format;
 
+BdrvChild *bdrv_attach_child(BlockDriverState *parent_bs,
+                             BlockDriverState *child_bs,
+                             const BdrvChildRole *child_role);
+
 struct BdrvChild {
     BlockDriverState *bs;
     const BdrvChildRole *role;
@@ -663,6 +677,16 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   BlockCompletionFunc *cb, void *opaque,
                   Error **errp);
 
+/*
+ * backup_do_checkpoint:
+ * @job: A sync=none backup job started by backup_start().
+ *
+ * Forget which clusters have already been copied, so that the next write
+ * to any of them is copied to the target again.  The caller must make sure
+ * the target has been emptied and no request is in flight.
+ */
+void backup_do_checkpoint(BlockJob *job, Error **errp);
+
 void blk_set_bs(BlockBackend *blk, BlockDriverState *bs);
 
 void blk_dev_change_media_cb(BlockBackend *blk, bool load);
@@ -0,0 +1,38 @@
+/*
+ * Replication Block filter
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef BLOCK_REPLICATION_H
+#define BLOCK_REPLICATION_H
+
+#include "qemu-common.h"
+
+/*
+ * replication_start_all:
+ *
+ * Start replicating on every "replication" node.  On the secondary, this
+ * empties the active and hidden disks and starts copying what the primary
+ * overwrites on the secondary disk into the hidden disk.
+ */
+void replication_start_all(Error **errp);
+
+/*
+ * replication_do_checkpoint_all:
+ *
+ * Called with the guest stopped once a checkpoint has been applied:
+ * drop what the secondary guest wrote since the previous checkpoint.
+ */
+void replication_do_checkpoint_all(Error **errp);
+
+/*
+ * replication_stop_all:
+ *
+ * Stop replicating.  With @failover, the other side is gone: the primary
+ * stops forwarding I/O and the secondary guest goes on from its active
+ * disk.
+ */
+void replication_stop_all(bool failover, Error **errp);
+
+#endif
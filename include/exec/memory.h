@@ -212,6 +212,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -744,6 +745,24 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty logging for a range of a
+ *                                   region in external TLBs (e.g. kvm)
+ *
+ * Accelerators that leave the dirty log set after it has been synchronized
+ * (KVM with manual dirty log protection) only start tracking the pages
+ * again once they are cleared here.  Users of %DIRTY_MEMORY_MIGRATION call
+ * this before they read the memory they found dirty.
+ *
+ * Must be called with the iothread lock held.
+ *
+ * @mr: the region being cleared.
+ * @start: start of the range, relative to the start of the region.
+ * @len: length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -1114,11 +1133,15 @@ void memory_listener_unregister(MemoryListener *listener);
 
 /**
  * memory_global_dirty_log_start: begin dirty logging for all regions
+ *
+ * Calls nest: logging goes on until each of them was matched by a call
+ * to memory_global_dirty_log_stop().
  */
 void memory_global_dirty_log_start(void);
 
 /**
- * memory_global_dirty_log_stop: end dirty logging for all regions
+ * memory_global_dirty_log_stop: end dirty logging for all regions, if
+ * this was the last user
  */
 void memory_global_dirty_log_stop(void);
 
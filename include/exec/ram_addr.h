@@ -33,11 +33,15 @@ struct RAMBlock {
     ram_addr_t max_length;
     void (*resized)(const char*, uint64_t length, void *host);
     uint32_t flags;
+    /* Size of the host pages backing the block, e.g. hugetlbfs pages */
+    size_t page_size;
     /* Protected by iothread lock.  */
     char idstr[256];
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* Staging copy of the block on the COLO secondary, see migration/ram.c */
+    uint8_t *colo_cache;
 };
 
 static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
@@ -247,46 +251,23 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/*
+ * Move the migration dirty bits of [start, start + length) into @dest.
+ * If @summary is not NULL, it gets a bit set for each word of @dest that
+ * received dirty bits.
+ */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+                                               unsigned long *summary,
                                                ram_addr_t start,
                                                ram_addr_t length)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-    uint64_t num_dirty = 0;
-
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
-
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long bits = atomic_xchg(&src[k], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
-        }
-    } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_test_and_clear_dirty(
-                        start + addr,
-                        TARGET_PAGE_SIZE,
-                        DIRTY_MEMORY_MIGRATION)) {
-                long k = (start + addr) >> TARGET_PAGE_BITS;
-                if (!test_and_set_bit(k, dest)) {
-                    num_dirty++;
-                }
-            }
-        }
-    }
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
 
-    return num_dirty;
+    /* @dest is indexed like dirty_memory[], so any @start works by words */
+    return bitmap_merge_and_clear_atomic(dest, src, summary,
+                                         start >> TARGET_PAGE_BITS,
+                                         length >> TARGET_PAGE_BITS);
 }
 
 void migration_bitmap_extend(ram_addr_t old, ram_addr_t new);
@@ -0,0 +1,40 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_COLO_H
+#define QEMU_COLO_H
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "qemu/coroutine.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+
+void colo_info_init(void);
+
+/* save */
+bool migrate_colo_enabled(void);
+void migrate_start_colo_process(MigrationState *s);
+bool migration_in_colo_state(void);
+void colo_checkpoint_notify(void);
+void colo_add_checkpoint_notifier(Notifier *notify);
+void colo_remove_checkpoint_notifier(Notifier *notify);
+
+/* restore */
+bool migration_incoming_enable_colo(void);
+void migration_incoming_exit_colo(void);
+void *colo_process_incoming_thread(void *opaque);
+bool migration_incoming_in_colo_state(void);
+
+/* ram cache */
+int colo_init_ram_cache(void);
+void colo_release_ram_cache(void);
+void colo_flush_ram_cache(void);
+bool colo_ram_cache_enabled(void);
+
+#endif
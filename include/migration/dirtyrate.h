@@ -0,0 +1,19 @@
+/*
+ * Dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+#include "qemu-common.h"
+
+/*
+ * Whether a measurement owns the migration dirty log; migration can't
+ * start until it is done.  Called with the iothread lock held.
+ */
+bool dirtyrate_uses_dirty_log(void);
+
+#endif
@@ -18,6 +18,7 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/coroutine.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
@@ -35,6 +36,7 @@
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_VMDESCRIPTION        0x06
 #define QEMU_VM_CONFIGURATION        0x07
+#define QEMU_VM_COMMAND              0x08
 #define QEMU_VM_SECTION_FOOTER       0x7e
 
 struct MigrationParams {
@@ -46,17 +48,96 @@ typedef struct MigrationState MigrationState;
 
 typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
 
+/* Messages sent on the return path from the destination to the source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES,    /* be64 start, be32 len, counted RAMBlock name */
+    MIG_RP_MSG_PONG,         /* be32 value echoed from a MIG_CMD_PING */
+    MIG_RP_MSG_LOADED,       /* the whole device state has been loaded */
+
+    MIG_RP_MSG_MAX
+};
+
+/* Where the destination is in the postcopy sequence, see savevm.c */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,  /* Initial state - no postcopy */
+    POSTCOPY_INCOMING_ADVISE,
+    POSTCOPY_INCOMING_LISTENING,
+    POSTCOPY_INCOMING_RUNNING,
+    POSTCOPY_INCOMING_END
+} PostcopyState;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *file;
 
+    /*
+     * The return path towards the source, opened by COLO and when the
+     * source advises postcopy; writes are serialized by rp_mutex.
+     */
+    QEMUFile *to_src_file;
+    QemuMutex rp_mutex;
+
     /* See savevm.c */
     LoadStateEntry_Head loadvm_handlers;
+
+    /* COLO: the coroutine of the incoming migration waits for the COLO
+     * incoming thread to finish before cleaning up
+     */
+    QemuThread colo_incoming_thread;
+    Coroutine *migration_incoming_co;
+    QEMUBH *colo_exit_bh;
+
+    /*
+     * Postcopy: once the guest runs here, the listen thread reads the rest
+     * of the stream while the fault thread asks the source for the pages
+     * the guest touches before they arrive.
+     */
+    bool have_fault_thread;
+    QemuThread fault_thread;
+    QemuSemaphore fault_thread_sem;
+    int userfault_fd;
+    /* Written to make the fault thread exit */
+    int userfault_quit_fd;
+    bool have_listen_thread;
+    QemuThread listen_thread;
+    QemuSemaphore listen_thread_sem;
+    int listen_thread_ret;
+    QEMUBH *listen_exit_bh;
+    /* Pages are received here before being placed into guest memory */
+    void *postcopy_tmp_page;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
 MigrationIncomingState *migration_incoming_state_new(QEMUFile *f);
 void migration_incoming_state_destroy(void);
+void migration_incoming_resume_vm(void);
+
+/* Number of power-of-two buckets of a MigrationHistogram */
+#define MIGRATION_HISTOGRAM_BUCKETS 32
+
+typedef struct MigrationHistogram {
+    int64_t count;
+    int64_t last;
+    int64_t min;
+    int64_t max;
+    int64_t total;
+    int64_t buckets[MIGRATION_HISTOGRAM_BUCKETS];
+} MigrationHistogram;
+
+/* What is measured at each checkpoint, see CheckpointStats */
+typedef enum MigrationCheckpointStat {
+    MIGRATION_CHECKPOINT_PAUSE,
+    MIGRATION_CHECKPOINT_BITMAP_SYNC,
+    MIGRATION_CHECKPOINT_RAM_SEND,
+    MIGRATION_CHECKPOINT_DEVICE_SAVE,
+    MIGRATION_CHECKPOINT_FLUSH,
+    MIGRATION_CHECKPOINT_SECONDARY_LOAD,
+    MIGRATION_CHECKPOINT_BYTES,
+    MIGRATION_CHECKPOINT_PAGES,
+    MIGRATION_CHECKPOINT__MAX,
+} MigrationCheckpointStat;
 
 struct MigrationState
 {
@@ -66,6 +147,21 @@ struct MigrationState
     QemuThread thread;
     QEMUBH *cleanup_bh;
     QEMUFile *file;
+    /* The URI given to migrate, multifd connects its channels to it too */
+    char *uri;
+    /*
+     * The return path from the destination, opened by COLO, postcopy and
+     * the return-path capability
+     */
+    QEMUFile *from_dst_file;
+    /* Outside of COLO, from_dst_file is read in its own thread */
+    struct {
+        QemuThread thread;
+        bool thread_created;
+        bool error;
+        /* QEMU_CLOCK_REALTIME ms at which MIG_RP_MSG_LOADED arrived, or 0 */
+        int64_t loaded_time;
+    } rp_state;
     int parameters[MIGRATION_PARAMETER_MAX];
 
     int state;
@@ -80,8 +176,27 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+
+    /* Set by migrate-start-postcopy, read by the migration thread */
+    bool start_postcopy;
+
+    /* COLO checkpoints taken so far, by reason */
+    int64_t colo_checkpoints_periodic;
+    int64_t colo_checkpoints_dirty;
+    int64_t colo_checkpoints_requested;
+    /* Pages dirtied since the last checkpoint, as of the last sync */
+    int64_t colo_dirty_pages;
+
+    /*
+     * Breakdown of each COLO checkpoint, or of the completion of a live
+     * migration; times are in microseconds.
+     */
+    MigrationHistogram checkpoint_stats[MIGRATION_CHECKPOINT__MAX];
 };
 
+void migration_checkpoint_record(MigrationCheckpointStat stat,
+                                 int64_t value);
+
 void process_incoming_migration(QEMUFile *f);
 
 void qemu_start_incoming_migration(const char *uri, Error **errp);
@@ -111,6 +226,7 @@ void rdma_start_incoming_migration(const char *host_port, Error **errp);
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
+void migrate_set_state(MigrationState *s, int old_state, int new_state);
 
 int migrate_fd_close(MigrationState *s);
 
@@ -119,6 +235,8 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
+bool migration_is_running(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 void migrate_compress_threads_create(void);
@@ -126,8 +244,10 @@ void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
 uint64_t ram_bytes_remaining(void);
+uint64_t ram_dirty_pages_sync(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_postcopy_requests(void);
 void free_xbzrle_decoded_buf(void);
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero);
@@ -163,6 +283,12 @@ void migrate_del_blocker(Error *reason);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
+bool migrate_use_return_path(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_use_host_pages(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
@@ -175,10 +301,29 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_pong(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_loaded(MigrationIncomingState *mis);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
+
+PostcopyState postcopy_state_get(void);
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(PostcopyState new_state);
+
+bool ram_postcopy_can_start(void);
+int ram_postcopy_send_discard_bitmap(QEMUFile *f);
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length);
+int ram_save_queue_pages(const char *rbname, ram_addr_t start,
+                         ram_addr_t len);
+struct RAMBlock *ram_block_by_name(const char *name);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags, void *data);
@@ -0,0 +1,64 @@
+/*
+ * Multiple channel RAM migration (multifd)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_MULTIFD_H
+#define QEMU_MIGRATION_MULTIFD_H
+
+#include "migration/migration.h"
+
+/*
+ * Connect the x-multifd-channels extra connections to the destination and
+ * start a sending thread on each; called by the migration thread.
+ */
+int multifd_save_setup(MigrationState *s);
+
+/*
+ * Stop the sending threads and close the channels.  Without @abort, what
+ * was queued is sent first.
+ */
+void multifd_save_cleanup(bool abort);
+
+/* True between multifd_save_setup() and multifd_save_cleanup() */
+bool multifd_save_active(void);
+
+/*
+ * Queue a page for one of the channels, which one depends on where the
+ * page is in its RAMBlock.  A packet holds a reference to the memory
+ * region of @block until it was sent.
+ * Returns 0 on success, -1 if a channel failed.
+ */
+int multifd_queue_page(struct RAMBlock *block, ram_addr_t offset);
+
+/*
+ * Send what was queued on every channel and wait until it was written.
+ * Returns 0 on success, -1 if a channel failed.
+ */
+int multifd_send_flush(void);
+
+/*
+ * Send what was queued, followed by a sync marker, on every channel.  The
+ * caller then puts RAM_SAVE_FLAG_MULTIFD_SYNC in the main stream.
+ * Returns 0 on success, -1 if a channel failed.
+ */
+int multifd_send_sync_main(void);
+
+/*
+ * Take over the listening socket once the main migration connection was
+ * accepted on it, and accept the multifd channels there.
+ */
+void multifd_recv_accept_channels(int listen_fd);
+
+/*
+ * Wait until every channel loaded the pages it got before its sync marker,
+ * then let them go on.  Returns 0 on success, negative on error.
+ */
+int multifd_recv_sync_main(void);
+
+/* Stop the receiving threads and close the channels */
+void multifd_recv_cleanup(void);
+
+#endif
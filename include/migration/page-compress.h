@@ -0,0 +1,40 @@
+/*
+ * Page compression for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_PAGE_COMPRESS_H
+#define QEMU_MIGRATION_PAGE_COMPRESS_H
+
+#include "qemu-common.h"
+#include "qapi-types.h"
+
+/* Per thread state of a compression library */
+typedef struct PageCompress PageCompress;
+
+/* Whether QEMU was built with @method */
+bool page_compress_available(MigrationCompressMethod method);
+
+/* @method must be available; it is only used for compression */
+PageCompress *page_compress_new(MigrationCompressMethod method);
+void page_compress_free(PageCompress *pc);
+
+/*
+ * Compress @size bytes at @src into @dst at @level.  Returns the compressed
+ * size, or -1 if it doesn't fit in @dlen bytes (or compression failed).
+ */
+ssize_t page_compress(PageCompress *pc, int level, uint8_t *dst, size_t dlen,
+                      const uint8_t *src, size_t size);
+
+/*
+ * Decompress @slen bytes at @src, compressed with @method, into @dst.
+ * Returns the decompressed size, or -1 if the data is invalid or doesn't
+ * fit in @dlen bytes.
+ */
+ssize_t page_decompress(PageCompress *pc, MigrationCompressMethod method,
+                        uint8_t *dst, size_t dlen,
+                        const uint8_t *src, size_t slen);
+
+#endif
@@ -15,7 +15,15 @@
 #ifndef PAGE_CACHE_H
 #define PAGE_CACHE_H
 
-/* Page cache for storing guest pages */
+/*
+ * Page cache for storing guest pages
+ *
+ * A page can be cached in any of the ways of the set its address maps to;
+ * the least recently used page of a full set is replaced, unless it was
+ * used in the last two bitmap generations.  There is no locking inside:
+ * the cache is only changed by one thread at a time, users that replace
+ * it protect it with RCU.
+ */
 typedef struct PageCache PageCache;
 
 /**
@@ -36,6 +44,13 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_fini_rcu: free all cache resources once the RCU readers that may
+ * still use the cache are done
+ * @cache pointer to the PageCache struct
+ */
+void cache_fini_rcu(PageCache *cache);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -60,6 +60,13 @@ typedef int (QEMUFileGetFD)(void *opaque);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Turn zero-copy transmission on for the file, or wait until every buffer
+ * handed to writev_buffer_zero_copy was released by the transport.
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileZeroCopyFunc)(void *opaque);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -96,6 +103,11 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Return a QEMUFile for comms in the opposite direction
+ */
+typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -107,6 +119,10 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
     QEMUFileShutdownFunc *shut_down;
+    QEMURetPathFunc *get_return_path;
+    QEMUFileZeroCopyFunc *enable_zero_copy;
+    QEMUFileWritevBufferFunc *writev_buffer_zero_copy;
+    QEMUFileZeroCopyFunc *flush_zero_copy;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -126,6 +142,7 @@ int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
+int64_t qemu_file_progress(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, size_t size);
 void qemu_put_byte(QEMUFile *f, int v);
 /*
@@ -133,6 +150,14 @@ void qemu_put_byte(QEMUFile *f, int v);
  * The buffer should be available till it is sent asynchronously.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size);
+/*
+ * Send what qemu_put_buffer_async() is given without copying it into the
+ * kernel either; the buffers then stay in use past qemu_fflush(), until
+ * qemu_file_flush_zero_copy() returns.  Returns 0 or -err if the transport
+ * can't do it.
+ */
+int qemu_file_enable_zero_copy(QEMUFile *f);
+int qemu_file_flush_zero_copy(QEMUFile *f);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
 
@@ -144,6 +169,8 @@ ssize_t qsb_get_buffer(const QEMUSizedBuffer *, off_t start, size_t count,
                        uint8_t *buf);
 ssize_t qsb_write_at(QEMUSizedBuffer *qsb, const uint8_t *buf,
                      off_t pos, size_t count);
+void qsb_put_buffer(QEMUFile *f, const QEMUSizedBuffer *qsb, size_t size);
+size_t qsb_fill_buffer(QEMUSizedBuffer *qsb, QEMUFile *f, size_t size);
 
 
 /*
@@ -175,6 +202,7 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -194,6 +222,7 @@ int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int ret);
 int qemu_file_shutdown(QEMUFile *f);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
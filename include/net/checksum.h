@@ -26,6 +26,7 @@ uint16_t net_checksum_finish(uint32_t sum);
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
 void net_checksum_calculate(uint8_t *data, int length);
+uint16_t net_checksum_update32(uint16_t csum, uint32_t from, uint32_t to);
 
 static inline uint32_t
 net_checksum_add(int len, uint8_t *buf)
@@ -93,6 +93,9 @@ struct NetClientState {
     unsigned int queue_index;
     unsigned rxfilter_notify_enabled:1;
     QTAILQ_HEAD(, NetFilterState) filters;
+    /* Whether packets to and from the peer start with a virtio-net header */
+    bool using_vnet_hdr;
+    int vnet_hdr_len;
 };
 
 typedef struct NICState {
@@ -144,6 +147,7 @@ void qemu_using_vnet_hdr(NetClientState *nc, bool enable);
 void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
                       int ecn, int ufo);
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
+int qemu_get_using_vnet_hdr_len(NetClientState *nc);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
@@ -158,6 +162,25 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                             int iovcnt,
                             void *opaque);
 
+/*
+ * Reassembly of the packets carried over a byte stream, each one
+ * preceded by its length as a 32-bit big-endian integer.
+ */
+typedef struct SocketReadState SocketReadState;
+typedef void (SocketReadStateFinalize)(SocketReadState *rs);
+
+struct SocketReadState {
+    int state; /* 0 = getting length, 1 = getting data */
+    uint32_t index;
+    uint32_t packet_len;
+    uint8_t buf[NET_BUFSIZE];
+    SocketReadStateFinalize *finalize;
+};
+
+void net_socket_rs_init(SocketReadState *rs,
+                        SocketReadStateFinalize *finalize);
+int net_fill_rstate(SocketReadState *rs, const uint8_t *buf, int size);
+
 void print_net_client(Monitor *mon, NetClientState *nc);
 void hmp_info_network(Monitor *mon, const QDict *qdict);
 
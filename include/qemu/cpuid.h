@@ -0,0 +1,53 @@
+/*
+ * Host CPU feature checks for code selected at runtime
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_CPUID_H
+#define QEMU_CPUID_H
+
+#ifdef CONFIG_CPUID_H
+#include <cpuid.h>
+
+/* Older compilers don't have all of these */
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX     (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2    (1 << 5)
+#endif
+#endif
+
+/*
+ * Whether AVX2 code can run: the CPU has it and the OS saves the YMM
+ * registers on context switches.
+ */
+static inline bool host_cpu_has_avx2(void)
+{
+#ifdef CONFIG_CPUID_H
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    /* XCR0: SSE and AVX state enabled */
+    asm("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    if ((a & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+#else
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Bounded lock-free multi-producer multi-consumer ring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MPMC_RING_H
+#define QEMU_MPMC_RING_H
+
+#include "qemu-common.h"
+
+typedef struct MPMCRing {
+    /* All fields are private */
+    unsigned long *seq;
+    uint8_t *data;
+    size_t elem_size;
+    unsigned long mask;
+
+    /* Producers and consumers dirty different cache lines */
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+} MPMCRing;
+
+/**
+ * mpmc_ring_init:
+ * @ring: ring to initialise
+ * @capacity: number of elements, must be a power of 2
+ * @elem_size: size in bytes of each element
+ *
+ * Create an empty ring.  Elements are copied in and out of the ring, so
+ * small structures can be passed without allocating them.
+ */
+void mpmc_ring_init(MPMCRing *ring, unsigned long capacity, size_t elem_size);
+
+/**
+ * mpmc_ring_destroy:
+ * @ring: ring to free
+ *
+ * Free the memory of a ring created with mpmc_ring_init().  Elements
+ * still in the ring are dropped.
+ */
+void mpmc_ring_destroy(MPMCRing *ring);
+
+/**
+ * mpmc_ring_push:
+ * @ring: ring to push to
+ * @elem: element to copy into the ring
+ *
+ * Append an element; it can be called from any number of threads at
+ * the same time.  Returns false, without waiting, if the ring is full.
+ */
+bool mpmc_ring_push(MPMCRing *ring, const void *elem);
+
+/**
+ * mpmc_ring_pop:
+ * @ring: ring to pop from
+ * @elem: where to copy the element
+ *
+ * Remove the oldest element; it can be called from any number of threads
+ * at the same time.  Returns false, without waiting, if the ring is empty.
+ */
+bool mpmc_ring_pop(MPMCRing *ring, void *elem);
+
+/**
+ * mpmc_ring_is_empty:
+ * @ring: ring to check
+ *
+ * Whether the ring was empty at some point during the call.  Elements
+ * that are being pushed count as present.
+ */
+bool mpmc_ring_is_empty(MPMCRing *ring);
+
+#endif
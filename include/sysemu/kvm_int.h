@@ -18,8 +18,11 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    ram_addr_t ram_start_offset;
     int slot;
     int flags;
+    /* Dirty log returned by the last KVM_GET_DIRTY_LOG, not yet cleared */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
@@ -79,6 +79,13 @@ struct KVMState
 #endif
     int many_ioeventfds;
     int intx_set_mask;
+    bool manual_dirty_log_protect;
+    /* Entries of each vCPU's dirty ring, 0 if dirty bitmaps are used */
+    uint32_t kvm_dirty_ring_size;
+    QemuThread reaper_thread;
+    /* Memory listener of each KVM address space, to find dirty ring slots */
+    int nr_as;
+    KVMMemoryListener **as_kml;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -272,6 +279,20 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -372,12 +393,181 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/*
+ * Dirty rings
+ *
+ * Instead of a bitmap per memslot, KVM can push the pages that a vCPU
+ * writes into a ring per vCPU.  They are collected from there into
+ * ram_list.dirty_memory[], by a dedicated thread every second, when the
+ * memory API syncs the dirty log, and by a vCPU whose ring is full.  All
+ * of them hold the iothread lock, which also serializes them.
+ *
+ * A page that was collected is only write protected again by
+ * KVM_RESET_DIRTY_RINGS; that is done before the lock is dropped, so that
+ * nobody can read the page for a sync in between and miss a write.
+ */
+
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+
+    if (as_id >= s->nr_as || slot_id >= s->nr_slots || !s->as_kml[as_id]) {
+        return;
+    }
+    kml = s->as_kml[as_id];
+    mem = &kml->slots[slot_id];
+
+    /* the slot can be gone, or reused, by the time the page is collected */
+    if (offset >= (mem->memory_size >> TARGET_PAGE_BITS)) {
+        return;
+    }
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        (offset << TARGET_PAGE_BITS),
+                                        TARGET_PAGE_SIZE,
+                                        DIRTY_CLIENTS_NOCODE);
+}
+
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    uint32_t mask = s->kvm_dirty_ring_size - 1;
+    struct kvm_dirty_gfn *gfn;
+    uint32_t count = 0;
+
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index & mask];
+        if (!(atomic_read(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        /* read the entry after its flags... */
+        smp_rmb();
+        kvm_dirty_ring_mark_page(s, gfn->slot >> 16, gfn->slot & 0xffff,
+                                 gfn->offset);
+        /* ... and only hand it back to KVM once it has been read */
+        smp_mb();
+        atomic_set(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+
+    return count;
+}
+
+/* Called with the iothread lock held */
+static void kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t start = get_clock();
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (total && kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS) < 0) {
+        fprintf(stderr, "%s: KVM_RESET_DIRTY_RINGS failed: %s\n",
+                __func__, strerror(errno));
+        abort();
+    }
+    trace_kvm_dirty_ring_reap(total, (get_clock() - start) / 1000);
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+    for (;;) {
+        /* Keep the rings from filling up, which stops the vCPUs */
+        g_usleep(G_USEC_PER_SEC);
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s, uint32_t size)
+{
+    uint64_t bytes = (uint64_t)size * sizeof(struct kvm_dirty_gfn);
+    int ret;
+
+    ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (ret <= 0) {
+        error_report("KVM dirty rings are not supported by the host kernel");
+        return -EINVAL;
+    }
+    if (bytes > ret || bytes < getpagesize()) {
+        error_report("KVM dirty ring size must be between %zu and %d entries",
+                     getpagesize() / sizeof(struct kvm_dirty_gfn),
+                     ret / (int)sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, bytes);
+    if (ret) {
+        error_report("Enabling KVM dirty rings failed: %s", strerror(-ret));
+        return ret;
+    }
+
+    s->kvm_dirty_ring_size = size;
+    return 0;
+}
+
+/**
+ * kvm_slot_clear_dirty_log - Re-arm dirty logging for part of a slot
+ * Only the pages that the last KVM_GET_DIRTY_LOG reported are cleared,
+ * so that pages dirtied since then stay dirty for the next sync.  KVM
+ * wants the range aligned to 64 pages, which can only clear more pages
+ * earlier than their user asked for; they have been synced already.
+ *
+ * @first: first page of the range, relative to the slot.
+ * @nr: number of pages.
+ */
+static int kvm_slot_clear_dirty_log(KVMMemoryListener *kml, KVMSlot *mem,
+                                    uint64_t first, uint64_t nr)
+{
+    KVMState *s = kvm_state;
+    uint64_t pages = mem->memory_size >> TARGET_PAGE_BITS;
+    uint64_t end = MIN(ALIGN(first + nr, 64), pages);
+    struct kvm_clear_dirty_log d = {};
+    int ret;
+
+    first &= ~(uint64_t)63;
+    if (!mem->dirty_bmap || first >= end ||
+        find_next_bit(mem->dirty_bmap, end, first) >= end) {
+        return 0;
+    }
+
+    d.slot = mem->slot | (kml->as_id << 16);
+    d.first_page = first;
+    d.num_pages = end - first;
+    d.dirty_bitmap = mem->dirty_bmap + first / BITS_PER_LONG;
+    ret = kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d);
+    if (ret < 0) {
+        DPRINTF("ioctl failed %d\n", errno);
+        return ret;
+    }
+    bitmap_clear(mem->dirty_bmap, first, end - first);
+    return 0;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * With manual dirty log protection, the kernel leaves the log of
+ * migrated memory set and doesn't write protect it again until
+ * kvm_log_clear() is called for each part of it.  This is what makes
+ * the sync cheap for large guests; everything else is cleared here.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -385,14 +575,22 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
                                           MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
-    unsigned long size, allocated_size = 0;
+    unsigned long size;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
+    bool clear_now = !s->manual_dirty_log_protect ||
+        !(memory_region_get_dirty_log_mask(section->mr) &
+          (1 << DIRTY_MEMORY_MIGRATION));
+
+    if (s->kvm_dirty_ring_size) {
+        /* there is no bitmap, what was written is in the rings */
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -413,14 +611,11 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (!mem->dirty_bmap) {
+            mem->dirty_bmap = g_malloc0(size);
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
+        d.dirty_bitmap = mem->dirty_bmap;
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
             DPRINTF("ioctl failed %d\n", errno);
@@ -429,9 +624,16 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+        if (s->manual_dirty_log_protect && clear_now) {
+            ret = kvm_slot_clear_dirty_log(kml, mem, 0,
+                                           mem->memory_size >>
+                                           TARGET_PAGE_BITS);
+            if (ret < 0) {
+                break;
+            }
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
 
     return ret;
 }
@@ -635,6 +837,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     hwaddr start_addr = section->offset_within_address_space;
     ram_addr_t size = int128_get64(section->size);
     void *ram = NULL;
+    ram_addr_t ram_start_offset;
     unsigned delta;
 
     /* kvm works in page size chunks, but the function may be called
@@ -663,6 +866,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     }
 
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region + delta;
+    ram_start_offset = mr->ram_addr + section->offset_within_region + delta;
 
     while (1) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, start_addr + size);
@@ -686,6 +890,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         }
 
         /* unregister the overlapping slot */
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         mem->memory_size = 0;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
@@ -708,6 +914,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = old.memory_size;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -719,6 +926,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
             start_addr += old.memory_size;
             ram += old.memory_size;
+            ram_start_offset += old.memory_size;
             size -= old.memory_size;
             continue;
         }
@@ -729,6 +937,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             mem->memory_size = start_addr - old.start_addr;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->ram_start_offset = old.ram_start_offset;
             mem->flags =  kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -753,6 +962,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             size_delta = mem->start_addr - old.start_addr;
             mem->memory_size = old.memory_size - size_delta;
             mem->ram = old.ram + size_delta;
+            mem->ram_start_offset = old.ram_start_offset + size_delta;
             mem->flags = kvm_mem_flags(mr);
 
             err = kvm_set_user_memory_region(kml, mem);
@@ -775,6 +985,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = ram_start_offset;
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem);
@@ -815,6 +1026,39 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    hwaddr start_addr = section->offset_within_address_space;
+    hwaddr end_addr = start_addr + int128_get64(section->size);
+    hwaddr start, end;
+    KVMSlot *mem;
+
+    if (!s->manual_dirty_log_protect) {
+        return;
+    }
+
+    while (start_addr < end_addr) {
+        mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
+        if (mem == NULL) {
+            break;
+        }
+
+        start = MAX(start_addr, mem->start_addr);
+        end = MIN(end_addr, mem->start_addr + mem->memory_size);
+        if ((mem->flags & KVM_MEM_LOG_DIRTY_PAGES) &&
+            kvm_slot_clear_dirty_log(kml, mem,
+                                     (start - mem->start_addr) >>
+                                     TARGET_PAGE_BITS,
+                                     (end - start) >> TARGET_PAGE_BITS) < 0) {
+            abort();
+        }
+        start_addr = mem->start_addr + mem->memory_size;
+    }
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -891,6 +1135,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    if (as_id < s->nr_as) {
+        s->as_kml[as_id] = kml;
+    }
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -901,6 +1148,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1600,6 +1848,25 @@ static int kvm_init(MachineState *ms)
         (kvm_check_extension(s, KVM_CAP_READONLY_MEM) > 0);
 #endif
 
+    s->nr_as = kvm_check_extension(s, KVM_CAP_MULTI_ADDRESS_SPACE);
+    if (s->nr_as <= 1) {
+        s->nr_as = 1;
+    }
+    s->as_kml = g_new0(KVMMemoryListener *, s->nr_as);
+
+    if (machine_kvm_dirty_ring_size(ms)) {
+        ret = kvm_dirty_ring_init(s, machine_kvm_dirty_ring_size(ms));
+        if (ret < 0) {
+            goto err;
+        }
+    } else if (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) & 1) {
+        /* The capability returns the flags it supports; we want bit 0, which
+         * stops KVM_GET_DIRTY_LOG from write protecting the pages it
+         * reports.  It doesn't apply to dirty rings. */
+        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0, 1);
+        s->manual_dirty_log_protect = (ret == 0);
+    }
+
     kvm_eventfds_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD) > 0);
 
@@ -1623,6 +1890,12 @@ static int kvm_init(MachineState *ms)
 
     kvm_state = s;
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_thread_create(&s->reaper_thread, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     s->memory_listener.listener.eventfd_add = kvm_mem_ioeventfd_add;
     s->memory_listener.listener.eventfd_del = kvm_mem_ioeventfd_del;
     s->memory_listener.listener.coalesced_mmio_add = kvm_coalesce_mmio_region;
@@ -1648,6 +1921,7 @@ err:
         close(s->fd);
     }
     g_free(s->memory_listener.slots);
+    g_free(s->as_kml);
 
     return ret;
 }
@@ -1867,6 +2141,14 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* the vCPU can't run until its ring is collected */
+            DPRINTF("dirty ring full\n");
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
@@ -9,6 +9,8 @@
 #include <linux/types.h>
 #include <linux/ioctl.h>
 
+#define KVM_DIRTY_LOG_PAGE_OFFSET 64
+
 #define DE_VECTOR 0
 #define DB_VECTOR 1
 #define BP_VECTOR 3
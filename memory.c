@@ -33,7 +33,8 @@
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
-static bool global_dirty_log = false;
+/* Number of users of the dirty log, e.g. migration and dirty rate */
+static unsigned int global_dirty_log;
 
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
@@ -1508,6 +1509,45 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryRegionSection mrs;
+    AddressSpace *as;
+    FlatView *view;
+    FlatRange *fr;
+    Int128 s, e;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            if (fr->mr != mr) {
+                continue;
+            }
+            s = int128_max(int128_make64(start),
+                           int128_make64(fr->offset_in_region));
+            e = int128_min(int128_add(int128_make64(start),
+                                      int128_make64(len)),
+                           int128_add(int128_make64(fr->offset_in_region),
+                                      fr->addr.size));
+            if (int128_ge(s, e)) {
+                continue;
+            }
+            mrs = (MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = int128_get64(s),
+                .size = int128_sub(e, s),
+                .offset_within_address_space = int128_get64(fr->addr.start) +
+                    int128_get64(s) - fr->offset_in_region,
+                .readonly = fr->readonly,
+            };
+            MEMORY_LISTENER_CALL(log_clear, Forward, &mrs);
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -2003,7 +2043,9 @@ void address_space_sync_dirty_bitmap(AddressSpace *as)
 
 void memory_global_dirty_log_start(void)
 {
-    global_dirty_log = true;
+    if (global_dirty_log++) {
+        return;
+    }
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
 
@@ -2015,7 +2057,10 @@ void memory_global_dirty_log_start(void)
 
 void memory_global_dirty_log_stop(void)
 {
-    global_dirty_log = false;
+    assert(global_dirty_log);
+    if (--global_dirty_log) {
+        return;
+    }
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
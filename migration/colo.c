@@ -0,0 +1,925 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "sysemu/sysemu.h"
+#include "migration/colo.h"
+#include "migration/qemu-file.h"
+#include "block/block.h"
+#include "block/replication.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/rcu.h"
+#include "qemu/atomic.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+/*
+ * With x-checkpoint-dirty-pages set, how often the dirty log is synced to
+ * count the pages dirtied since the last checkpoint, in milliseconds.  Each
+ * check walks the dirty log of all of RAM, mostly under the iothread lock,
+ * so it must stay well above the time that takes.
+ */
+#define COLO_DIRTY_CHECK_INTERVAL 100
+
+/*
+ * Initial size of the buffer holding the device state of one checkpoint;
+ * it grows on demand and is reused by the following checkpoints.
+ */
+#define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
+
+/* How often the heartbeat thread checks the COLO channel, in milliseconds */
+#define COLO_HEARTBEAT_CHECK_INTERVAL 10
+
+typedef enum COLOCheckpointReason {
+    COLO_CHECKPOINT_NONE,
+    COLO_CHECKPOINT_PERIODIC,   /* x-checkpoint-delay elapsed */
+    COLO_CHECKPOINT_DIRTY,      /* x-checkpoint-dirty-pages were dirtied */
+    COLO_CHECKPOINT_REQUESTED,  /* colo_checkpoint_notify(), e.g. miscompare */
+} COLOCheckpointReason;
+
+/*
+ * Fails over as soon as nothing went through the COLO channel for the
+ * heartbeat timeout, instead of waiting for TCP to give up on the peer.
+ * Between checkpoints the primary sends a heartbeat every
+ * x-heartbeat-interval and waits for the secondary to answer, so the
+ * channel is only ever silent for long when one side is gone; during a
+ * checkpoint the stream itself shows progress, and while the secondary
+ * applies it, the secondary sends heartbeats on its own.
+ */
+typedef struct COLOHeartbeat {
+    QemuThread thread;
+    QemuSemaphore stop_sem;
+    bool running;
+    /* Both ends of the COLO channel, shut down to fail over */
+    QEMUFile *in;
+    QEMUFile *out;
+    /* Silence allowed before failing over, in milliseconds; 0 disables */
+    int64_t timeout;
+    /* Protects @out while @keepalive is set, see colo_keepalive_start() */
+    QemuMutex keepalive_lock;
+    bool keepalive;
+} COLOHeartbeat;
+
+static COLOHeartbeat colo_heartbeat;
+static bool colo_failover_requested;
+
+static QemuSemaphore colo_checkpoint_sem;
+static NotifierList colo_checkpoint_notifiers =
+    NOTIFIER_LIST_INITIALIZER(colo_checkpoint_notifiers);
+
+bool migration_in_colo_state(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->state == MIGRATION_STATUS_COLO;
+}
+
+bool migration_incoming_in_colo_state(void)
+{
+    return migration_incoming_get_current() &&
+           migration_incoming_enable_colo();
+}
+
+void colo_checkpoint_notify(void)
+{
+    if (migration_in_colo_state()) {
+        qemu_sem_post(&colo_checkpoint_sem);
+    }
+}
+
+/*
+ * Notifiers run with the iothread lock held each time a checkpoint is
+ * committed: on the primary once the secondary has received all of it,
+ * just before the primary resumes; on the secondary once it is loaded,
+ * just before the secondary resumes.
+ */
+void colo_add_checkpoint_notifier(Notifier *notify)
+{
+    notifier_list_add(&colo_checkpoint_notifiers, notify);
+}
+
+void colo_remove_checkpoint_notifier(Notifier *notify)
+{
+    notifier_remove(notify);
+}
+
+/*
+ * Break the COLO channel so that whatever the COLO thread is blocked on
+ * fails at once and the thread goes down its failover path.  May be
+ * called from any thread while the heartbeat is running.
+ */
+static void colo_failover(void)
+{
+    COLOHeartbeat *hb = &colo_heartbeat;
+
+    trace_colo_failover();
+    atomic_set(&colo_failover_requested, true);
+    qemu_file_shutdown(hb->out);
+    qemu_file_shutdown(hb->in);
+    /* The primary may be waiting for its next checkpoint */
+    colo_checkpoint_notify();
+}
+
+/* Send a heartbeat on behalf of the COLO thread, if it still wants us to */
+static void colo_heartbeat_keepalive(COLOHeartbeat *hb)
+{
+    qemu_mutex_lock(&hb->keepalive_lock);
+    if (hb->keepalive) {
+        qemu_put_be32(hb->out, COLO_MESSAGE_HEARTBEAT);
+        qemu_fflush(hb->out);
+        trace_colo_send_message(COLOMessage_lookup[COLO_MESSAGE_HEARTBEAT]);
+    }
+    qemu_mutex_unlock(&hb->keepalive_lock);
+}
+
+static void *colo_heartbeat_thread(void *opaque)
+{
+    COLOHeartbeat *hb = opaque;
+    int64_t alive_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t keepalive_time = alive_time;
+    int64_t progress = -1, current, now, timeout;
+
+    while (qemu_sem_timedwait(&hb->stop_sem,
+                              COLO_HEARTBEAT_CHECK_INTERVAL) < 0) {
+        now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        timeout = atomic_read(&hb->timeout);
+        if (atomic_read(&hb->keepalive) && timeout &&
+            now - keepalive_time >= timeout / 4) {
+            colo_heartbeat_keepalive(hb);
+            keepalive_time = now;
+        }
+        current = qemu_file_progress(hb->in) + qemu_file_progress(hb->out);
+
+        if (current != progress || !timeout) {
+            progress = current;
+            alive_time = now;
+        } else if (now - alive_time >= timeout) {
+            error_report("COLO: nothing heard from the peer for %" PRId64
+                         " ms, failing over", now - alive_time);
+            colo_failover();
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Called with the iothread lock held */
+static void colo_heartbeat_start(QEMUFile *in, QEMUFile *out, int64_t timeout)
+{
+    COLOHeartbeat *hb = &colo_heartbeat;
+
+    assert(!hb->running);
+    hb->in = in;
+    hb->out = out;
+    hb->timeout = timeout;
+    hb->keepalive = false;
+    atomic_set(&colo_failover_requested, false);
+    qemu_mutex_init(&hb->keepalive_lock);
+    qemu_sem_init(&hb->stop_sem, 0);
+    qemu_thread_create(&hb->thread, "COLO heartbeat", colo_heartbeat_thread,
+                       hb, QEMU_THREAD_JOINABLE);
+    hb->running = true;
+}
+
+/* Called with the iothread lock held, before the COLO files are closed */
+static void colo_heartbeat_stop(void)
+{
+    COLOHeartbeat *hb = &colo_heartbeat;
+
+    if (!hb->running) {
+        return;
+    }
+    qemu_sem_post(&hb->stop_sem);
+    qemu_thread_join(&hb->thread);
+    qemu_sem_destroy(&hb->stop_sem);
+    qemu_mutex_destroy(&hb->keepalive_lock);
+    hb->running = false;
+    hb->in = hb->out = NULL;
+}
+
+/*
+ * The secondary says nothing while it applies a checkpoint, which takes
+ * longer the more RAM was dirtied; until colo_keepalive_stop(), the
+ * heartbeat thread sends heartbeats in its place so that the primary's
+ * watchdog doesn't take it for dead.  The COLO thread must not use the
+ * channel meanwhile.
+ */
+static void colo_keepalive_start(void)
+{
+    COLOHeartbeat *hb = &colo_heartbeat;
+
+    qemu_mutex_lock(&hb->keepalive_lock);
+    atomic_set(&hb->keepalive, true);
+    qemu_mutex_unlock(&hb->keepalive_lock);
+}
+
+static void colo_keepalive_stop(void)
+{
+    COLOHeartbeat *hb = &colo_heartbeat;
+
+    qemu_mutex_lock(&hb->keepalive_lock);
+    atomic_set(&hb->keepalive, false);
+    qemu_mutex_unlock(&hb->keepalive_lock);
+}
+
+void qmp_x_colo_lost_heartbeat(Error **errp)
+{
+    if (!colo_heartbeat.running) {
+        error_setg(errp, "COLO is not running");
+        return;
+    }
+    colo_failover();
+}
+
+static void colo_send_message(QEMUFile *f, COLOMessage msg,
+                              Error **errp)
+{
+    int ret;
+
+    if (msg >= COLO_MESSAGE_MAX) {
+        error_setg(errp, "%s: Invalid message", __func__);
+        return;
+    }
+    qemu_put_be32(f, msg);
+    qemu_fflush(f);
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Can't send COLO message");
+    }
+    trace_colo_send_message(COLOMessage_lookup[msg]);
+}
+
+static void colo_send_message_value(QEMUFile *f, COLOMessage msg,
+                                    uint64_t value, Error **errp)
+{
+    Error *local_err = NULL;
+    int ret;
+
+    colo_send_message(f, msg, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    qemu_put_be64(f, value);
+    qemu_fflush(f);
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to send value for message:%s",
+                         COLOMessage_lookup[msg]);
+    }
+}
+
+static COLOMessage colo_receive_message(QEMUFile *f, Error **errp)
+{
+    COLOMessage msg;
+    int ret;
+
+    msg = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Can't receive COLO message");
+        return msg;
+    }
+    if (msg >= COLO_MESSAGE_MAX) {
+        error_setg(errp, "%s: Invalid message", __func__);
+        return msg;
+    }
+    trace_colo_receive_message(COLOMessage_lookup[msg]);
+    return msg;
+}
+
+static void colo_receive_check_message(QEMUFile *f, COLOMessage expect_msg,
+                                       Error **errp)
+{
+    COLOMessage msg;
+    Error *local_err = NULL;
+
+    msg = colo_receive_message(f, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (msg != expect_msg) {
+        error_setg(errp, "Unexpected COLO message %d, expected %d",
+                   msg, expect_msg);
+    }
+}
+
+static uint64_t colo_receive_message_value(QEMUFile *f, COLOMessage expect_msg,
+                                           Error **errp)
+{
+    Error *local_err = NULL;
+    uint64_t value;
+    int ret;
+
+    colo_receive_check_message(f, expect_msg, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return 0;
+    }
+
+    value = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to get value for COLO message: %s",
+                         COLOMessage_lookup[expect_msg]);
+    }
+    return value;
+}
+
+static int colo_do_checkpoint_transaction(MigrationState *s,
+                                          QEMUSizedBuffer *buffer)
+{
+    QEMUFile *trans = NULL;
+    COLOMessage msg;
+    size_t size;
+    int64_t pause_start, resume_time, flush_start, pos;
+    Error *local_err = NULL;
+    int ret = -1;
+
+    colo_send_message(s->file, COLO_MESSAGE_CHECKPOINT_REQUEST,
+                      &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    colo_receive_check_message(s->from_dst_file,
+                               COLO_MESSAGE_CHECKPOINT_REPLY, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    /* Reset the buffer, its memory is reused by every checkpoint */
+    qsb_set_length(buffer, 0);
+    trans = qemu_bufopen("w", buffer);
+    if (!trans) {
+        error_report("Open QEMUFile for the device state failed");
+        goto out;
+    }
+
+    pause_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    pos = qemu_ftell(s->file);
+    qemu_mutex_lock_iothread();
+    vm_stop_force_state(RUN_STATE_COLO);
+    qemu_mutex_unlock_iothread();
+    trace_colo_vm_state_change("run", "stop");
+
+    colo_send_message(s->file, COLO_MESSAGE_VMSTATE_SEND, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    qemu_mutex_lock_iothread();
+    /*
+     * Only the RAM dirtied since the previous checkpoint is sent here;
+     * it goes straight to the stream.  The device state is much smaller
+     * and is buffered so the secondary can load it in one go.
+     */
+    qemu_savevm_live_state(s->file);
+    ret = qemu_save_device_state(trans);
+    qemu_mutex_unlock_iothread();
+    if (ret < 0) {
+        error_report("Save device state error");
+        goto out;
+    }
+    qemu_fflush(trans);
+
+    size = qsb_get_length(buffer);
+    colo_send_message_value(s->file, COLO_MESSAGE_VMSTATE_SIZE,
+                            size, &local_err);
+    if (local_err) {
+        ret = -1;
+        goto out;
+    }
+
+    flush_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    qsb_put_buffer(s->file, buffer, size);
+    qemu_fflush(s->file);
+    ret = qemu_file_get_error(s->file);
+    if (ret < 0) {
+        goto out;
+    }
+    migration_checkpoint_record(MIGRATION_CHECKPOINT_FLUSH,
+                                qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                flush_start);
+    migration_checkpoint_record(MIGRATION_CHECKPOINT_BYTES,
+                                qemu_ftell(s->file) - pos);
+
+    colo_receive_check_message(s->from_dst_file,
+                               COLO_MESSAGE_VMSTATE_RECEIVED, &local_err);
+    if (local_err) {
+        ret = -1;
+        goto out;
+    }
+
+    /*
+     * The secondary holds the whole checkpoint now and has reset its disk
+     * to ours, so the primary can resume while the device state is being
+     * loaded on the other side.
+     */
+    qemu_mutex_lock_iothread();
+    notifier_list_notify(&colo_checkpoint_notifiers, s);
+    vm_start();
+    qemu_mutex_unlock_iothread();
+    trace_colo_vm_state_change("stop", "run");
+    resume_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    migration_checkpoint_record(MIGRATION_CHECKPOINT_PAUSE,
+                                resume_time - pause_start);
+
+    /* The secondary sends heartbeats while it applies the checkpoint */
+    do {
+        msg = colo_receive_message(s->from_dst_file, &local_err);
+    } while (!local_err && msg == COLO_MESSAGE_HEARTBEAT);
+    if (!local_err && msg != COLO_MESSAGE_VMSTATE_LOADED) {
+        error_setg(&local_err, "Unexpected COLO message %d, expected %d",
+                   msg, COLO_MESSAGE_VMSTATE_LOADED);
+    }
+    if (local_err) {
+        ret = -1;
+        goto out;
+    }
+    migration_checkpoint_record(MIGRATION_CHECKPOINT_SECONDARY_LOAD,
+                                qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                resume_time);
+
+    ret = 0;
+
+out:
+    if (local_err) {
+        error_report_err(local_err);
+    }
+    if (trans) {
+        qemu_fclose(trans);
+    }
+    return ret;
+}
+
+/* Check that the secondary is alive and pass it the failover timeout */
+static void colo_send_heartbeat(MigrationState *s, Error **errp)
+{
+    int64_t timeout = s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT];
+    Error *local_err = NULL;
+
+    atomic_set(&colo_heartbeat.timeout, timeout);
+    colo_send_message_value(s->file, COLO_MESSAGE_HEARTBEAT, timeout,
+                            &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    colo_receive_check_message(s->from_dst_file, COLO_MESSAGE_HEARTBEAT,
+                               errp);
+}
+
+/*
+ * Wait until the next checkpoint is due and return why it is, sending
+ * heartbeats meanwhile.  Returns COLO_CHECKPOINT_NONE if COLO stopped or
+ * failed in the meantime.
+ */
+static COLOCheckpointReason colo_wait_checkpoint(MigrationState *s,
+                                                 int64_t checkpoint_time,
+                                                 Error **errp)
+{
+    int64_t delay, max_dirty, interval, current_time, wait;
+    int64_t heartbeat_time = checkpoint_time;
+    Error *local_err = NULL;
+    uint64_t dirty;
+
+    while (s->state == MIGRATION_STATUS_COLO &&
+           !atomic_read(&colo_failover_requested)) {
+        /* These can change at any time through migrate-set-parameters */
+        delay = s->parameters[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY];
+        max_dirty = s->parameters[MIGRATION_PARAMETER_X_CHECKPOINT_DIRTY_PAGES];
+        interval = s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_INTERVAL];
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+        wait = delay - (current_time - checkpoint_time);
+        if (wait <= 0) {
+            return COLO_CHECKPOINT_PERIODIC;
+        }
+        if (current_time - heartbeat_time >= interval) {
+            colo_send_heartbeat(s, &local_err);
+            if (local_err) {
+                error_propagate(errp, local_err);
+                return COLO_CHECKPOINT_NONE;
+            }
+            heartbeat_time = current_time;
+            continue;
+        }
+        wait = MIN(wait, interval - (current_time - heartbeat_time));
+        if (max_dirty) {
+            wait = MIN(wait, COLO_DIRTY_CHECK_INTERVAL);
+        }
+        if (qemu_sem_timedwait(&colo_checkpoint_sem, wait) == 0) {
+            if (atomic_read(&colo_failover_requested)) {
+                break;
+            }
+            return COLO_CHECKPOINT_REQUESTED;
+        }
+
+        if (max_dirty && s->state == MIGRATION_STATUS_COLO) {
+            qemu_mutex_lock_iothread();
+            dirty = ram_dirty_pages_sync();
+            qemu_mutex_unlock_iothread();
+            s->colo_dirty_pages = dirty;
+            trace_colo_dirty_pages(dirty);
+            if (dirty >= max_dirty) {
+                return COLO_CHECKPOINT_DIRTY;
+            }
+        }
+    }
+
+    return COLO_CHECKPOINT_NONE;
+}
+
+static void colo_process_checkpoint(MigrationState *s)
+{
+    QEMUSizedBuffer *buffer = NULL;
+    COLOCheckpointReason reason;
+    int64_t checkpoint_time;
+    Error *local_err = NULL;
+    int ret;
+
+    s->from_dst_file = qemu_file_get_return_path(s->file);
+    if (!s->from_dst_file) {
+        error_report("Open QEMUFile from_dst_file failed");
+        goto out;
+    }
+
+    /*
+     * Wait for the secondary to finish loading the initial VM state
+     * and to enter COLO restore mode.
+     */
+    colo_receive_check_message(s->from_dst_file,
+                               COLO_MESSAGE_CHECKPOINT_READY, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    buffer = qsb_create(NULL, COLO_BUFFER_BASE_SIZE);
+    if (buffer == NULL) {
+        error_report("Failed to allocate COLO buffer!");
+        goto out;
+    }
+
+    qemu_mutex_lock_iothread();
+    colo_heartbeat_start(s->from_dst_file, s->file,
+                    s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT]);
+    replication_start_all(&local_err);
+    if (!local_err) {
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+    if (local_err) {
+        goto out;
+    }
+    trace_colo_vm_state_change("stop", "run");
+
+    /*
+     * The secondary needs the timeout before the first checkpoint, to know
+     * how often to send heartbeats while it applies one
+     */
+    colo_send_heartbeat(s, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    checkpoint_time = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    while (s->state == MIGRATION_STATUS_COLO) {
+        reason = colo_wait_checkpoint(s, checkpoint_time, &local_err);
+        if (reason == COLO_CHECKPOINT_NONE) {
+            break;
+        }
+        trace_colo_checkpoint(reason);
+
+        ret = colo_do_checkpoint_transaction(s, buffer);
+        if (ret < 0) {
+            goto out;
+        }
+        checkpoint_time = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+        s->colo_dirty_pages = 0;
+
+        switch (reason) {
+        case COLO_CHECKPOINT_PERIODIC:
+            s->colo_checkpoints_periodic++;
+            break;
+        case COLO_CHECKPOINT_DIRTY:
+            s->colo_checkpoints_dirty++;
+            break;
+        case COLO_CHECKPOINT_REQUESTED:
+            s->colo_checkpoints_requested++;
+            break;
+        default:
+            abort();
+        }
+
+        /* Requests raised before this checkpoint have been served by it */
+        while (qemu_sem_timedwait(&colo_checkpoint_sem, 0) == 0) {
+            /* nothing */
+        }
+    }
+
+out:
+    if (local_err) {
+        error_report_err(local_err);
+    }
+    /* The pair is broken, the primary carries on without protection */
+    qemu_mutex_lock_iothread();
+    colo_heartbeat_stop();
+    replication_stop_all(true, NULL);
+    qemu_mutex_unlock_iothread();
+    migrate_set_state(s, MIGRATION_STATUS_COLO, MIGRATION_STATUS_COMPLETED);
+
+    qsb_free(buffer);
+
+    if (s->from_dst_file) {
+        qemu_fclose(s->from_dst_file);
+        s->from_dst_file = NULL;
+    }
+}
+
+/*
+ * Called from the migration thread with the iothread lock held, once the
+ * initial migration has completed; returns when COLO is over.
+ */
+void migrate_start_colo_process(MigrationState *s)
+{
+    static bool colo_checkpoint_sem_inited;
+
+    if (!colo_checkpoint_sem_inited) {
+        qemu_sem_init(&colo_checkpoint_sem, 0);
+        colo_checkpoint_sem_inited = true;
+    }
+
+    qemu_mutex_unlock_iothread();
+    colo_process_checkpoint(s);
+    qemu_mutex_lock_iothread();
+
+    /* Drop the dirty page tracking that was kept for the checkpoints */
+    qemu_savevm_state_cancel();
+}
+
+/*
+ * Receive and apply one checkpoint.  @consistent is cleared if it failed
+ * half way through applying it, when the secondary can't run anymore.
+ */
+static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
+                                             QEMUSizedBuffer *buffer,
+                                             bool *consistent,
+                                             Error **errp)
+{
+    QEMUFile *fb;
+    uint64_t total_size, value;
+    Error *local_err = NULL;
+    int ret;
+
+    /*
+     * The secondary keeps running while the checkpoint streams in: RAM
+     * pages are staged in the RAM cache and the device state in @buffer.
+     */
+    colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_REPLY,
+                      &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    colo_receive_check_message(mis->file, COLO_MESSAGE_VMSTATE_SEND,
+                               &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Only RAM is in the live state, and it only lands in the cache */
+    ret = qemu_loadvm_state_main(mis->file, mis);
+    if (ret < 0) {
+        error_setg(errp, "Load VM's live state (ram) error");
+        return;
+    }
+
+    value = colo_receive_message_value(mis->file, COLO_MESSAGE_VMSTATE_SIZE,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Read the whole device state before touching any device */
+    total_size = qsb_fill_buffer(buffer, mis->file, value);
+    if (total_size != value) {
+        error_setg(errp, "Got %" PRIu64 " VMState data, less than expected"
+                   " %" PRIu64, total_size, value);
+        return;
+    }
+
+    fb = qemu_bufopen("r", buffer);
+    if (!fb) {
+        error_setg(errp, "Can't open COLO buffer for read");
+        return;
+    }
+
+    /*
+     * Drop the secondary's own disk writes, the primary's are already in.
+     * This must be done before the primary resumes on VMSTATE_RECEIVED,
+     * or its next disk writes would be dropped with them.
+     */
+    qemu_mutex_lock_iothread();
+    vm_stop_force_state(RUN_STATE_COLO);
+    trace_colo_vm_state_change("run", "stop");
+    replication_do_checkpoint_all(&local_err);
+    qemu_mutex_unlock_iothread();
+    if (local_err) {
+        /* Some disks may have been reset already, the guest can't run */
+        *consistent = false;
+    } else {
+        colo_send_message(mis->to_src_file, COLO_MESSAGE_VMSTATE_RECEIVED,
+                          &local_err);
+    }
+
+    /*
+     * Once the disks are being reset the checkpoint is committed: RAM and
+     * devices must follow whatever happens to the channel.  All of it is
+     * here already, errors are only acted on afterwards.
+     */
+    colo_keepalive_start();
+    qemu_mutex_lock_iothread();
+    colo_flush_ram_cache();
+    ret = qemu_load_device_state(fb);
+    if (ret < 0) {
+        *consistent = false;
+    } else if (*consistent) {
+        notifier_list_notify(&colo_checkpoint_notifiers, mis);
+        vm_start();
+        trace_colo_vm_state_change("stop", "run");
+    }
+    qemu_mutex_unlock_iothread();
+    colo_keepalive_stop();
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+    if (ret < 0) {
+        error_setg(errp, "COLO: load device state failed");
+        goto out;
+    }
+
+    colo_send_message(mis->to_src_file, COLO_MESSAGE_VMSTATE_LOADED,
+                      &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+    }
+
+out:
+    qemu_fclose(fb);
+}
+
+/* Answer a heartbeat, whose value is the failover timeout to use */
+static void colo_incoming_heartbeat(MigrationIncomingState *mis, Error **errp)
+{
+    uint64_t timeout;
+    int ret;
+
+    timeout = qemu_get_be64(mis->file);
+    ret = qemu_file_get_error(mis->file);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to get value for COLO message: %s",
+                         COLOMessage_lookup[COLO_MESSAGE_HEARTBEAT]);
+        return;
+    }
+    atomic_set(&colo_heartbeat.timeout, timeout);
+    colo_send_message(mis->to_src_file, COLO_MESSAGE_HEARTBEAT, errp);
+}
+
+static void colo_incoming_exit_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+
+    qemu_bh_delete(mis->colo_exit_bh);
+    mis->colo_exit_bh = NULL;
+    qemu_coroutine_enter(mis->migration_incoming_co, NULL);
+}
+
+void *colo_process_incoming_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUSizedBuffer *buffer = NULL;
+    COLOMessage msg;
+    bool consistent = true;
+    Error *local_err = NULL;
+
+    rcu_register_thread();
+
+    mis->to_src_file = qemu_file_get_return_path(mis->file);
+    if (!mis->to_src_file) {
+        error_report("COLO incoming thread: Open QEMUFile to_src_file failed");
+        goto out;
+    }
+    /*
+     * The incoming coroutine made the fd non-blocking; this thread talks
+     * to the primary in lock-step, so blocking I/O is what we want here.
+     */
+    qemu_set_block(qemu_get_fd(mis->file));
+
+    buffer = qsb_create(NULL, COLO_BUFFER_BASE_SIZE);
+    if (buffer == NULL) {
+        error_report("COLO incoming thread: Failed to allocate buffer");
+        goto out;
+    }
+
+    /* The secondary runs on its own copy of the disks between checkpoints */
+    qemu_mutex_lock_iothread();
+    bdrv_invalidate_cache_all(&local_err);
+    if (!local_err) {
+        replication_start_all(&local_err);
+    }
+    if (!local_err && colo_init_ram_cache() < 0) {
+        error_setg(&local_err, "Failed to initialize ram cache");
+    }
+    if (!local_err) {
+        /* The primary tells us the timeout with its first heartbeat */
+        colo_heartbeat_start(mis->file, mis->to_src_file, 0);
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+    if (local_err) {
+        goto out;
+    }
+    trace_colo_vm_state_change("stop", "run");
+
+    colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_READY,
+                      &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    while (true) {
+        msg = colo_receive_message(mis->file, &local_err);
+        if (local_err) {
+            goto out;
+        }
+
+        switch (msg) {
+        case COLO_MESSAGE_CHECKPOINT_REQUEST:
+            colo_incoming_process_checkpoint(mis, buffer, &consistent,
+                                             &local_err);
+            break;
+        case COLO_MESSAGE_HEARTBEAT:
+            colo_incoming_heartbeat(mis, &local_err);
+            break;
+        default:
+            error_setg(&local_err, "Got unknown COLO message: %d", msg);
+            break;
+        }
+        if (local_err) {
+            goto out;
+        }
+    }
+
+out:
+    if (local_err) {
+        error_report_err(local_err);
+    }
+
+    /*
+     * Failover: the secondary takes over from the last loaded checkpoint;
+     * a partially received one only ever reached the RAM cache.  One that
+     * failed while it was applied left a guest that must not run.
+     */
+    qemu_mutex_lock_iothread();
+    colo_heartbeat_stop();
+    replication_stop_all(true, NULL);
+    colo_release_ram_cache();
+    if (!consistent) {
+        error_report("COLO: the secondary is inconsistent, keeping it "
+                     "stopped");
+    } else if (!runstate_is_running()) {
+        vm_start();
+    }
+    qemu_mutex_unlock_iothread();
+
+    qsb_free(buffer);
+
+    if (mis->to_src_file) {
+        qemu_fclose(mis->to_src_file);
+        mis->to_src_file = NULL;
+    }
+    migration_incoming_exit_colo();
+
+    rcu_unregister_thread();
+
+    /* Hand control back to the incoming coroutine in the main loop */
+    mis->colo_exit_bh = qemu_bh_new(colo_incoming_exit_bh, mis);
+    qemu_bh_schedule(mis->colo_exit_bh);
+
+    return NULL;
+}
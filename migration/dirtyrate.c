@@ -0,0 +1,372 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Estimates how fast the guest dirties its RAM, per RAM block, without
+ * migrating it, to tell beforehand whether a VM will converge or can be
+ * protected with checkpoints.  Two modes are available:
+ *
+ * - page-sampling hashes a few random pages per GiB of each RAM block,
+ *   and hashes them again at the end of the period.  The guest isn't
+ *   slowed down at all, but pages rewritten with the same contents aren't
+ *   counted and small blocks are imprecise.
+ * - dirty-bitmap turns on dirty logging for the period, exactly like
+ *   migration does, and counts the pages in the migration bitmap.  It
+ *   can't overlap with a migration.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/crc32c.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "qapi/qmp/qerror.h"
+#include "sysemu/sysemu.h"
+#include "migration/migration.h"
+#include "migration/colo.h"
+#include "migration/dirtyrate.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define DIRTYRATE_MIN_CALC_TIME         1
+#define DIRTYRATE_MAX_CALC_TIME         60
+/* Sampled pages per GiB of RAM block */
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+#define DIRTYRATE_MIN_SAMPLE_PAGES      128
+#define DIRTYRATE_MAX_SAMPLE_PAGES      4096
+
+/* What is recorded about a RAM block at the start of a measurement */
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    ram_addr_t offset;
+    ram_addr_t size;
+    /* page-sampling: page numbers within the block and their hash */
+    uint64_t nr_samples;
+    uint64_t *samples;
+    uint32_t *hashes;
+    /* dirty pages or changed samples found at the end */
+    uint64_t dirty;
+    bool found;
+} DirtyRateBlock;
+
+typedef struct DirtyRateConfig {
+    int64_t calc_time;
+    DirtyRateMeasureMode mode;
+    int64_t sample_pages;
+} DirtyRateConfig;
+
+/* Results of the last measurement; protected by the iothread lock */
+static struct {
+    DirtyRateStatus status;
+    DirtyRateMeasureMode mode;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    int64_t dirty_rate;
+    DirtyRateRAMBlockList *ramblocks;
+    /* the measurement started dirty logging */
+    bool dirty_log;
+} dirtyrate_stat;
+
+bool dirtyrate_uses_dirty_log(void)
+{
+    return dirtyrate_stat.dirty_log;
+}
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, uint64_t page)
+{
+    return crc32c(0xffffffff, block->host + page * TARGET_PAGE_SIZE,
+                  TARGET_PAGE_SIZE);
+}
+
+/* Record the blocks, and hash their samples.  Must hold the RCU lock. */
+static DirtyRateBlock *dirtyrate_record_blocks(DirtyRateConfig *config,
+                                               int *nr_blocks)
+{
+    DirtyRateBlock *blocks, *b;
+    RAMBlock *block;
+    uint64_t i, pages;
+    int n = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        n++;
+    }
+    blocks = g_new0(DirtyRateBlock, n);
+
+    b = blocks;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        pstrcpy(b->idstr, sizeof(b->idstr), block->idstr);
+        b->offset = block->offset;
+        b->size = block->used_length;
+        pages = b->size >> TARGET_PAGE_BITS;
+        if (config->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING && pages) {
+            b->nr_samples = MIN(pages, DIV_ROUND_UP(b->size *
+                                                    config->sample_pages,
+                                                    1ULL << 30));
+            b->samples = g_new(uint64_t, b->nr_samples);
+            b->hashes = g_new(uint32_t, b->nr_samples);
+            for (i = 0; i < b->nr_samples; i++) {
+                b->samples[i] = g_random_int_range(0, MIN(pages, G_MAXINT32));
+                b->hashes[i] = dirtyrate_hash_page(block, b->samples[i]);
+            }
+        }
+        b++;
+    }
+
+    *nr_blocks = n;
+    return blocks;
+}
+
+/* The block recorded as @b, if it still exists.  Must hold the RCU lock. */
+static RAMBlock *dirtyrate_find_block(DirtyRateBlock *b)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, b->idstr)) {
+            /* resized or replaced blocks aren't comparable */
+            if (block->offset != b->offset ||
+                block->used_length != b->size) {
+                return NULL;
+            }
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void dirtyrate_compare_samples(DirtyRateBlock *blocks, int nr_blocks)
+{
+    RAMBlock *block;
+    uint64_t i;
+    int n;
+
+    rcu_read_lock();
+    for (n = 0; n < nr_blocks; n++) {
+        block = dirtyrate_find_block(&blocks[n]);
+        if (!block) {
+            continue;
+        }
+        blocks[n].found = true;
+        for (i = 0; i < blocks[n].nr_samples; i++) {
+            if (dirtyrate_hash_page(block, blocks[n].samples[i]) !=
+                blocks[n].hashes[i]) {
+                blocks[n].dirty++;
+            }
+        }
+        /* scale the changed samples to the whole block */
+        if (blocks[n].nr_samples) {
+            blocks[n].dirty = blocks[n].dirty * (blocks[n].size >>
+                                                 TARGET_PAGE_BITS) /
+                              blocks[n].nr_samples;
+        }
+    }
+    rcu_read_unlock();
+}
+
+/* Count and clear the dirty log of each block.  Needs the iothread lock. */
+static void dirtyrate_sync_dirty_log(DirtyRateBlock *blocks, int nr_blocks)
+{
+    unsigned long *bitmap;
+    RAMBlock *block;
+    int n;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    for (n = 0; n < nr_blocks; n++) {
+        block = dirtyrate_find_block(&blocks[n]);
+        if (!block) {
+            continue;
+        }
+        blocks[n].found = true;
+        blocks[n].dirty = cpu_physical_memory_sync_dirty_bitmap(
+                              bitmap, NULL, block->offset, block->used_length);
+        memory_region_clear_dirty_bitmap(block->mr, 0, block->used_length);
+    }
+    rcu_read_unlock();
+    g_free(bitmap);
+}
+
+static void dirtyrate_publish(DirtyRateBlock *blocks, int nr_blocks,
+                              int64_t elapsed_ms)
+{
+    DirtyRateRAMBlockList *list = NULL, *entry;
+    int64_t total = 0, rate;
+    int n;
+
+    /* rates in MiB/s; keep the order of ram_list */
+    for (n = nr_blocks - 1; n >= 0; n--) {
+        if (!blocks[n].found) {
+            continue;
+        }
+        rate = (blocks[n].dirty * TARGET_PAGE_SIZE * 1000 / elapsed_ms) >> 20;
+        trace_dirtyrate_block(blocks[n].idstr, blocks[n].dirty, rate);
+        total += rate;
+
+        entry = g_new0(DirtyRateRAMBlockList, 1);
+        entry->value = g_new0(DirtyRateRAMBlock, 1);
+        entry->value->id = g_strdup(blocks[n].idstr);
+        entry->value->size = blocks[n].size;
+        entry->value->dirty_rate = rate;
+        entry->next = list;
+        list = entry;
+    }
+    trace_dirtyrate_done(total, elapsed_ms);
+
+    qemu_mutex_lock_iothread();
+    qapi_free_DirtyRateRAMBlockList(dirtyrate_stat.ramblocks);
+    dirtyrate_stat.ramblocks = list;
+    dirtyrate_stat.dirty_rate = total;
+    dirtyrate_stat.status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock_iothread();
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateConfig *config = opaque;
+    DirtyRateBlock *blocks;
+    int64_t start_ms, elapsed_ms;
+    int n, nr_blocks;
+
+    rcu_register_thread();
+
+    if (config->mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        qemu_mutex_lock_iothread();
+        memory_global_dirty_log_start();
+        rcu_read_lock();
+        blocks = dirtyrate_record_blocks(config, &nr_blocks);
+        rcu_read_unlock();
+        dirtyrate_sync_dirty_log(blocks, nr_blocks);
+        qemu_mutex_unlock_iothread();
+    } else {
+        rcu_read_lock();
+        blocks = dirtyrate_record_blocks(config, &nr_blocks);
+        rcu_read_unlock();
+    }
+    for (n = 0; n < nr_blocks; n++) {
+        blocks[n].dirty = 0;
+        blocks[n].found = false;
+    }
+
+    start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    g_usleep(config->calc_time * G_USEC_PER_SEC);
+
+    if (config->mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        qemu_mutex_lock_iothread();
+        dirtyrate_sync_dirty_log(blocks, nr_blocks);
+        memory_global_dirty_log_stop();
+        dirtyrate_stat.dirty_log = false;
+        qemu_mutex_unlock_iothread();
+    } else {
+        dirtyrate_compare_samples(blocks, nr_blocks);
+    }
+    elapsed_ms = MAX(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms, 1);
+
+    dirtyrate_publish(blocks, nr_blocks, elapsed_ms);
+
+    for (n = 0; n < nr_blocks; n++) {
+        g_free(blocks[n].samples);
+        g_free(blocks[n].hashes);
+    }
+    g_free(blocks);
+    g_free(config);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_mode,
+                         DirtyRateMeasureMode mode, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    DirtyRateConfig *config;
+    QemuThread thread;
+
+    if (dirtyrate_stat.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        error_setg(errp, "sample-pages is only used by page-sampling");
+        return;
+    } else if (sample_pages < DIRTYRATE_MIN_SAMPLE_PAGES ||
+               sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "an integer in the range of 128 to 4096");
+        return;
+    }
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+        if (migration_is_running(migrate_get_current()) ||
+            runstate_check(RUN_STATE_INMIGRATE)) {
+            error_setg(errp, "dirty-bitmap can't be used during migration");
+            return;
+        }
+        /* The COLO secondary needs the migration bits for its RAM cache */
+        if (migration_incoming_in_colo_state() || colo_ram_cache_enabled()) {
+            error_setg(errp, "dirty-bitmap can't be used on a COLO secondary");
+            return;
+        }
+        dirtyrate_stat.dirty_log = true;
+    }
+
+    config = g_new0(DirtyRateConfig, 1);
+    config->calc_time = calc_time;
+    config->mode = mode;
+    config->sample_pages = sample_pages;
+
+    dirtyrate_stat.status = DIRTY_RATE_STATUS_MEASURING;
+    dirtyrate_stat.mode = mode;
+    dirtyrate_stat.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirtyrate_stat.calc_time = calc_time;
+    dirtyrate_stat.sample_pages = sample_pages;
+    trace_dirtyrate_start(DirtyRateMeasureMode_lookup[mode], calc_time);
+
+    qemu_thread_create(&thread, "dirtyrate", dirtyrate_thread, config,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateRAMBlockList *entry, **tail;
+
+    info->status = dirtyrate_stat.status;
+    info->start_time = dirtyrate_stat.start_time;
+    info->calc_time = dirtyrate_stat.calc_time;
+    info->mode = dirtyrate_stat.mode;
+    info->sample_pages = dirtyrate_stat.sample_pages;
+
+    if (dirtyrate_stat.status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirtyrate_stat.dirty_rate;
+        info->has_ramblocks = true;
+        tail = &info->ramblocks;
+        for (entry = dirtyrate_stat.ramblocks; entry; entry = entry->next) {
+            *tail = g_new0(DirtyRateRAMBlockList, 1);
+            (*tail)->value = g_new0(DirtyRateRAMBlock, 1);
+            (*tail)->value->id = g_strdup(entry->value->id);
+            (*tail)->value->size = entry->value->size;
+            (*tail)->value->dirty_rate = entry->value->dirty_rate;
+            tail = &(*tail)->next;
+        }
+    }
+
+    return info;
+}
@@ -17,6 +17,11 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/colo.h"
+#include "migration/dirtyrate.h"
+#include "migration/multifd.h"
+#include "migration/page-compress.h"
+#include "migration/postcopy-ram.h"
 #include "migration/qemu-file.h"
 #include "sysemu/sysemu.h"
 #include "block/block.h"
@@ -48,6 +53,15 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Maximum interval between two COLO checkpoints, in milliseconds */
+#define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
+/* COLO heartbeat period and failover timeout, in milliseconds */
+#define DEFAULT_MIGRATE_X_HEARTBEAT_INTERVAL 100
+#define DEFAULT_MIGRATE_X_HEARTBEAT_TIMEOUT 500
+/* Number of extra connections used for RAM by multifd */
+#define DEFAULT_MIGRATE_X_MULTIFD_CHANNELS 2
+/* Compression library used by the compression threads */
+#define DEFAULT_MIGRATE_X_COMPRESS_METHOD MIGRATION_COMPRESS_METHOD_ZLIB
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -79,6 +93,16 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY] =
+                DEFAULT_MIGRATE_X_CHECKPOINT_DELAY,
+        .parameters[MIGRATION_PARAMETER_X_HEARTBEAT_INTERVAL] =
+                DEFAULT_MIGRATE_X_HEARTBEAT_INTERVAL,
+        .parameters[MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT] =
+                DEFAULT_MIGRATE_X_HEARTBEAT_TIMEOUT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_X_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD] =
+                DEFAULT_MIGRATE_X_COMPRESS_METHOD,
     };
 
     return &current_migration;
@@ -86,6 +110,7 @@ MigrationState *migrate_get_current(void)
 
 /* For incoming */
 static MigrationIncomingState *mis_current;
+static PostcopyState incoming_postcopy_state;
 
 MigrationIncomingState *migration_incoming_get_current(void)
 {
@@ -97,6 +122,7 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
     mis_current = g_new0(MigrationIncomingState, 1);
     mis_current->file = f;
     QLIST_INIT(&mis_current->loadvm_handlers);
+    qemu_mutex_init(&mis_current->rp_mutex);
 
     return mis_current;
 }
@@ -104,6 +130,7 @@ MigrationIncomingState *migration_incoming_state_new(QEMUFile* f)
 void migration_incoming_state_destroy(void)
 {
     loadvm_free_handlers(mis_current);
+    qemu_mutex_destroy(&mis_current->rp_mutex);
     g_free(mis_current);
     mis_current = NULL;
 }
@@ -228,6 +255,28 @@ void register_global_state(void)
     vmstate_register(NULL, 0, &vmstate_globalstate, &global_state);
 }
 
+/*
+ * Start the guest on the destination once its state is loaded, or leave
+ * it in the state it had on the source.
+ */
+void migration_incoming_resume_vm(void)
+{
+    /* If global state section was not received or we are in running
+       state, we need to obey autostart. Any other state is set with
+       runstate_set. */
+
+    if (!global_state_received() ||
+        global_state_get_runstate() == RUN_STATE_RUNNING) {
+        if (autostart) {
+            vm_start();
+        } else {
+            runstate_set(RUN_STATE_PAUSED);
+        }
+    } else {
+        runstate_set(global_state_get_runstate());
+    }
+}
+
 static void migrate_generate_event(int new_state)
 {
     if (migrate_use_events()) {
@@ -235,6 +284,100 @@ static void migrate_generate_event(int new_state)
     }
 }
 
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type message_type,
+                                    uint16_t len, void *data)
+{
+    trace_migrate_send_rp_message((int)message_type, len);
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+    qemu_put_be16(mis->to_src_file, len);
+    qemu_put_buffer(mis->to_src_file, data, len);
+    qemu_fflush(mis->to_src_file);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/*
+ * Send a 'SHUT' message on the return channel with the given value
+ * to indicate that we've finished with the RP.  Non-0 value indicates
+ * error.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis,
+                          uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf), &buf);
+}
+
+/*
+ * Send a 'PONG' message on the return channel with the given value
+ * (normally in response to a 'PING')
+ */
+void migrate_send_rp_pong(MigrationIncomingState *mis,
+                          uint32_t value)
+{
+    uint32_t buf;
+
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_PONG, sizeof(buf), &buf);
+}
+
+/*
+ * Tell the source that the whole device state has been loaded, the source
+ * takes this as the end of the downtime.
+ */
+void migrate_send_rp_loaded(MigrationIncomingState *mis)
+{
+    migrate_send_rp_message(mis, MIG_RP_MSG_LOADED, 0, NULL);
+}
+
+/*
+ * Request a range of pages from the source VM at the given
+ * start address.
+ *   rbname: Name of the RAMBlock to request the page in, if NULL it's the same
+ *           as the last request (a name must have been given previously)
+ *   start:  Address offset within the RB
+ *   len:    Length in bytes required - must be a multiple of pagesize
+ */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
+    size_t msglen = 12; /* start + len */
+
+    *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
+    *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
+
+    if (rbname) {
+        int rbname_len = strlen(rbname);
+        assert(rbname_len < 256);
+
+        bufc[msglen++] = rbname_len;
+        memcpy(bufc + msglen, rbname, rbname_len);
+        msglen += rbname_len;
+    } else {
+        bufc[msglen++] = 0;
+    }
+    migrate_send_rp_message(mis, MIG_RP_MSG_REQ_PAGES, msglen, bufc);
+}
+
+PostcopyState postcopy_state_get(void)
+{
+    return atomic_mb_read(&incoming_postcopy_state);
+}
+
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(PostcopyState new_state)
+{
+    return atomic_xchg(&incoming_postcopy_state, new_state);
+}
+
 /*
  * Called on -incoming with a defer: uri.
  * The migration can be started later after any parameters have been
@@ -277,12 +420,59 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 static void process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
+    MigrationIncomingState *mis;
     Error *local_err = NULL;
+    bool colo_done = false;
+    PostcopyState ps;
     int ret;
 
-    migration_incoming_state_new(f);
+    mis = migration_incoming_state_new(f);
+    postcopy_state_set(POSTCOPY_INCOMING_NONE);
     migrate_generate_event(MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    multifd_recv_cleanup();
+
+    ps = postcopy_state_get();
+    trace_process_incoming_migration_co_end(ret, ps);
+    if (ps == POSTCOPY_INCOMING_ADVISE && ret >= 0) {
+        /* The source completed without switching to postcopy */
+        postcopy_ram_incoming_cleanup(mis);
+    } else if (mis->have_listen_thread && ret >= 0) {
+        /*
+         * The guest already runs here, the listen thread loads the pages
+         * still on the source and wakes us up at the end of the stream.
+         */
+        trace_process_incoming_migration_co_postcopy_end_main();
+        migrate_generate_event(MIGRATION_STATUS_POSTCOPY_ACTIVE);
+        mis->migration_incoming_co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+        qemu_thread_join(&mis->listen_thread);
+        mis->have_listen_thread = false;
+        ret = mis->listen_thread_ret;
+    }
+
+    if (mis->to_src_file) {
+        /* In postcopy, LOADED was sent when the guest started running */
+        if (!ret && ps < POSTCOPY_INCOMING_LISTENING) {
+            migrate_send_rp_loaded(mis);
+        }
+        /* Tell the source we are done with the return path */
+        migrate_send_rp_shut(mis, ret < 0);
+        qemu_fclose(mis->to_src_file);
+        mis->to_src_file = NULL;
+    }
+
+    /* The COLO state section tells us whether the source wants COLO */
+    if (!ret && ps == POSTCOPY_INCOMING_NONE &&
+        migration_incoming_enable_colo()) {
+        mis->migration_incoming_co = qemu_coroutine_self();
+        qemu_thread_create(&mis->colo_incoming_thread, "COLO incoming",
+             colo_process_incoming_thread, mis, QEMU_THREAD_JOINABLE);
+        /* Woken up by the COLO thread once it has failed over */
+        qemu_coroutine_yield();
+        qemu_thread_join(&mis->colo_incoming_thread);
+        colo_done = true;
+    }
 
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
@@ -295,6 +485,13 @@ static void process_incoming_migration_co(void *opaque)
         exit(EXIT_FAILURE);
     }
 
+    if (ps >= POSTCOPY_INCOMING_RUNNING) {
+        /* The guest was started by the POSTCOPY_RUN command */
+        migrate_decompress_threads_join();
+        migrate_generate_event(MIGRATION_STATUS_COMPLETED);
+        return;
+    }
+
     /* Make sure all file formats flush their mutable metadata */
     bdrv_invalidate_cache_all(&local_err);
     if (local_err) {
@@ -310,19 +507,9 @@ static void process_incoming_migration_co(void *opaque)
      */
     qemu_announce_self();
 
-    /* If global state section was not received or we are in running
-       state, we need to obey autostart. Any other state is set with
-       runstate_set. */
-
-    if (!global_state_received() ||
-        global_state_get_runstate() == RUN_STATE_RUNNING) {
-        if (autostart) {
-            vm_start();
-        } else {
-            runstate_set(RUN_STATE_PAUSED);
-        }
-    } else {
-        runstate_set(global_state_get_runstate());
+    /* The VM was already resumed by the COLO failover */
+    if (!colo_done) {
+        migration_incoming_resume_vm();
     }
     migrate_decompress_threads_join();
     /*
@@ -395,10 +582,94 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_checkpoint_delay =
+            s->parameters[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY];
+    params->x_checkpoint_dirty_pages =
+            s->parameters[MIGRATION_PARAMETER_X_CHECKPOINT_DIRTY_PAGES];
+    params->x_heartbeat_interval =
+            s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_INTERVAL];
+    params->x_heartbeat_timeout =
+            s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->x_compress_method =
+            s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD];
 
     return params;
 }
 
+void migration_checkpoint_record(MigrationCheckpointStat stat,
+                                 int64_t value)
+{
+    MigrationHistogram *h = &migrate_get_current()->checkpoint_stats[stat];
+    int bucket;
+
+    value = MAX(value, 0);
+    bucket = value < 2 ? 0 : 63 - clz64(value);
+    bucket = MIN(bucket, MIGRATION_HISTOGRAM_BUCKETS - 1);
+
+    if (!h->count || value < h->min) {
+        h->min = value;
+    }
+    h->max = MAX(h->max, value);
+    h->last = value;
+    h->total += value;
+    h->count++;
+    h->buckets[bucket]++;
+}
+
+static CheckpointHistogram *get_checkpoint_histogram(MigrationHistogram *h)
+{
+    CheckpointHistogram *info = g_malloc0(sizeof(*info));
+    intList **tail = &info->buckets;
+    int i, used;
+
+    info->count = h->count;
+    info->last = h->last;
+    info->min = h->min;
+    info->max = h->max;
+    info->total = h->total;
+
+    for (used = MIGRATION_HISTOGRAM_BUCKETS; used > 0; used--) {
+        if (h->buckets[used - 1]) {
+            break;
+        }
+    }
+    for (i = 0; i < used; i++) {
+        *tail = g_malloc0(sizeof(**tail));
+        (*tail)->value = h->buckets[i];
+        tail = &(*tail)->next;
+    }
+
+    return info;
+}
+
+static void get_checkpoint_stats(MigrationInfo *info)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationHistogram *h = s->checkpoint_stats;
+    CheckpointStats *stats;
+
+    if (!h[MIGRATION_CHECKPOINT_PAUSE].count) {
+        return;
+    }
+
+    info->has_x_checkpoint_stats = true;
+    info->x_checkpoint_stats = stats = g_malloc0(sizeof(*stats));
+    stats->pause = get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_PAUSE]);
+    stats->bitmap_sync =
+        get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_BITMAP_SYNC]);
+    stats->ram_send =
+        get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_RAM_SEND]);
+    stats->device_save =
+        get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_DEVICE_SAVE]);
+    stats->flush = get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_FLUSH]);
+    stats->secondary_load =
+        get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_SECONDARY_LOAD]);
+    stats->bytes = get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_BYTES]);
+    stats->pages = get_checkpoint_histogram(&h[MIGRATION_CHECKPOINT_PAGES]);
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -427,7 +698,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->has_total_time = false;
         break;
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_CANCELLING:
+    case MIGRATION_STATUS_COLO:
         info->has_status = true;
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
@@ -449,6 +722,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->postcopy_requests = ram_postcopy_requests();
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -464,9 +738,20 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_checkpoint_stats(info);
+
+        if (s->state == MIGRATION_STATUS_COLO) {
+            info->has_x_colo = true;
+            info->x_colo = g_malloc0(sizeof(*info->x_colo));
+            info->x_colo->periodic = s->colo_checkpoints_periodic;
+            info->x_colo->dirty = s->colo_checkpoints_dirty;
+            info->x_colo->requested = s->colo_checkpoints_requested;
+            info->x_colo->dirty_pages = s->colo_dirty_pages;
+        }
         break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_checkpoint_stats(info);
 
         info->has_status = true;
         info->has_total_time = true;
@@ -487,6 +772,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->postcopy_requests = ram_postcopy_requests();
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -507,7 +793,9 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationCapabilityStatusList *cap;
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
-        s->state == MIGRATION_STATUS_SETUP) {
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+        s->state == MIGRATION_STATUS_SETUP ||
+        s->state == MIGRATION_STATUS_COLO) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -526,7 +814,20 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_checkpoint_delay,
+                                int64_t x_checkpoint_delay,
+                                bool has_x_checkpoint_dirty_pages,
+                                int64_t x_checkpoint_dirty_pages,
+                                bool has_x_heartbeat_interval,
+                                int64_t x_heartbeat_interval,
+                                bool has_x_heartbeat_timeout,
+                                int64_t x_heartbeat_timeout,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_compress_method,
+                                MigrationCompressMethod x_compress_method,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -561,6 +862,69 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "x_cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_checkpoint_delay &&
+            (x_checkpoint_delay < 1 || x_checkpoint_delay > INT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_checkpoint_delay",
+                   "is invalid, it should be positive");
+        return;
+    }
+    if (has_x_checkpoint_dirty_pages &&
+            (x_checkpoint_dirty_pages < 0 ||
+             x_checkpoint_dirty_pages > INT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_checkpoint_dirty_pages",
+                   "is invalid, it should not be negative");
+        return;
+    }
+    if (has_x_heartbeat_interval &&
+            (x_heartbeat_interval < 1 || x_heartbeat_interval > INT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_heartbeat_interval",
+                   "is invalid, it should be positive");
+        return;
+    }
+    if (has_x_heartbeat_timeout &&
+            (x_heartbeat_timeout < 0 || x_heartbeat_timeout > INT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_heartbeat_timeout",
+                   "is invalid, it should not be negative");
+        return;
+    }
+    if (has_x_heartbeat_interval || has_x_heartbeat_timeout) {
+        int64_t interval = has_x_heartbeat_interval ? x_heartbeat_interval :
+            s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_INTERVAL];
+        int64_t timeout = has_x_heartbeat_timeout ? x_heartbeat_timeout :
+            s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT];
+
+        /* The channel is silent for up to an interval between heartbeats */
+        if (timeout && timeout < 2 * interval) {
+            error_setg(errp, "x-heartbeat-timeout must be 0 or at least "
+                       "twice x-heartbeat-interval");
+            return;
+        }
+    }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_compress_method &&
+            !page_compress_available(x_compress_method)) {
+        error_setg(errp, "Compression method '%s' is not built in",
+                   MigrationCompressMethod_lookup[x_compress_method]);
+        return;
+    }
+    /* The compression threads keep the method they were created with */
+    if (has_x_compress_method && migration_is_running(s) &&
+        x_compress_method !=
+            s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD]) {
+        error_setg(errp, "x-compress-method can't be changed while a "
+                   "migration is running");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -581,11 +945,35 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_checkpoint_delay) {
+        s->parameters[MIGRATION_PARAMETER_X_CHECKPOINT_DELAY] =
+                                                    x_checkpoint_delay;
+    }
+    if (has_x_checkpoint_dirty_pages) {
+        s->parameters[MIGRATION_PARAMETER_X_CHECKPOINT_DIRTY_PAGES] =
+                                                    x_checkpoint_dirty_pages;
+    }
+    if (has_x_heartbeat_interval) {
+        s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_INTERVAL] =
+                                                    x_heartbeat_interval;
+    }
+    if (has_x_heartbeat_timeout) {
+        s->parameters[MIGRATION_PARAMETER_X_HEARTBEAT_TIMEOUT] =
+                                                    x_heartbeat_timeout;
+    }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+    if (has_x_compress_method) {
+        s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD] =
+                                                    x_compress_method;
+    }
 }
 
 /* shared migration helpers */
 
-static void migrate_set_state(MigrationState *s, int old_state, int new_state)
+void migrate_set_state(MigrationState *s, int old_state, int new_state)
 {
     if (atomic_cmpxchg(&s->state, old_state, new_state) == old_state) {
         trace_migrate_set_state(new_state);
@@ -611,7 +999,8 @@ static void migrate_fd_cleanup(void *opaque)
         s->file = NULL;
     }
 
-    assert(s->state != MIGRATION_STATUS_ACTIVE);
+    assert(s->state != MIGRATION_STATUS_ACTIVE &&
+           s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE);
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -641,7 +1030,8 @@ static void migrate_fd_cancel(MigrationState *s)
     do {
         old_state = s->state;
         if (old_state != MIGRATION_STATUS_SETUP &&
-            old_state != MIGRATION_STATUS_ACTIVE) {
+            old_state != MIGRATION_STATUS_ACTIVE &&
+            old_state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
             break;
         }
         migrate_set_state(s, old_state, MIGRATION_STATUS_CANCELLING);
@@ -685,40 +1075,39 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIGRATION_STATUS_FAILED);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE);
+}
+
+bool migration_is_running(MigrationState *s)
+{
+    return (s->state == MIGRATION_STATUS_ACTIVE ||
+            s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+            s->state == MIGRATION_STATUS_SETUP ||
+            s->state == MIGRATION_STATUS_CANCELLING ||
+            s->state == MIGRATION_STATUS_COLO);
+}
+
 static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
-    int compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
-    int compress_thread_count =
-            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
-    int decompress_thread_count =
-            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
-    int x_cpu_throttle_initial =
-            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
-    int x_cpu_throttle_increment =
-            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    int parameters[MIGRATION_PARAMETER_MAX];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
+    g_free(s->uri);
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
-
-    s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
-    s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
-               compress_thread_count;
-    s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
-               decompress_thread_count;
-    s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL] =
-                x_cpu_throttle_initial;
-    s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
-                x_cpu_throttle_increment;
+    memcpy(s->parameters, parameters, sizeof(parameters));
     s->bandwidth_limit = bandwidth_limit;
     migrate_set_state(s, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
@@ -773,9 +1162,7 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = has_blk && blk;
     params.shared = has_inc && inc;
 
-    if (s->state == MIGRATION_STATUS_ACTIVE ||
-        s->state == MIGRATION_STATUS_SETUP ||
-        s->state == MIGRATION_STATUS_CANCELLING) {
+    if (migration_is_running(s)) {
         error_setg(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -783,6 +1170,63 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
     }
+    if (dirtyrate_uses_dirty_log()) {
+        error_setg(errp, "A dirty rate measurement is using dirty logging");
+        return;
+    }
+
+    if (params.blk && migrate_colo_enabled()) {
+        error_setg(errp, "COLO does not support block migration");
+        return;
+    }
+
+    if (migrate_postcopy_ram()) {
+        if (params.blk) {
+            error_setg(errp, "Postcopy is not compatible with block migration");
+            return;
+        }
+        if (migrate_colo_enabled()) {
+            error_setg(errp, "Postcopy is not compatible with COLO");
+            return;
+        }
+        if (migrate_use_compression()) {
+            error_setg(errp, "Postcopy is not compatible with compression");
+            return;
+        }
+    }
+
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "Multifd needs a tcp: or unix: migration URI");
+            return;
+        }
+        if (migrate_postcopy_ram() || migrate_colo_enabled()) {
+            error_setg(errp, "Multifd is not compatible with postcopy or COLO");
+            return;
+        }
+    }
+
+    if (migrate_use_zero_copy_send()) {
+        if (!migrate_use_multifd() || !strstart(uri, "tcp:", NULL)) {
+            error_setg(errp, "Zero-copy send needs x-multifd and a tcp: "
+                       "migration URI");
+            return;
+        }
+        if (migrate_use_compression() || migrate_use_xbzrle()) {
+            error_setg(errp, "Zero-copy send is not compatible with "
+                       "compression or xbzrle");
+            return;
+        }
+    }
+
+    if (migrate_use_host_pages()) {
+        if (migrate_use_compression() || migrate_use_xbzrle() ||
+            migrate_use_multifd() || migrate_postcopy_ram()) {
+            error_setg(errp, "Host page granularity is not compatible with "
+                       "compression, xbzrle, multifd or postcopy");
+            return;
+        }
+    }
 
     if (qemu_savevm_state_blocked(errp)) {
         return;
@@ -800,6 +1244,7 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     s->state = MIGRATION_STATUS_NONE;
 
     s = migrate_init(&params);
+    s->uri = g_strdup(uri);
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -834,6 +1279,28 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable postcopy with migrate_set_capability before"
+                         " the start of migration");
+        return;
+    }
+
+    if (s->state == MIGRATION_STATUS_NONE) {
+        error_setg(errp, "Postcopy must be started after migration has been"
+                         " started");
+        return;
+    }
+    /*
+     * we don't error if migration has finished since that would be racy
+     * with issuing this command.
+     */
+    atomic_set(&s->start_postcopy, true);
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -902,6 +1369,71 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
+bool migrate_use_host_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_HOST_PAGES];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
+/* Postcopy requests pages on the return path, so it always needs one */
+bool migrate_use_return_path(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_RETURN_PATH] ||
+           migrate_postcopy_ram();
+}
+
+bool migrate_colo_enabled(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_COLO];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -929,6 +1461,15 @@ int migrate_compress_level(void)
     return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_COMPRESS_METHOD];
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -974,51 +1515,353 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
-/**
- * migration_completion: Used by migration_thread when there's not much left.
- *   The caller 'breaks' the loop when this returns.
+/* migration thread support */
+/*
+ * Something bad happened to the RP stream, mark an error
+ * The caller shall print or trace something to indicate why
+ */
+static void mark_source_rp_bad(MigrationState *s)
+{
+    s->rp_state.error = true;
+}
+
+/*
+ * Handles messages sent on the return path towards the source VM
  *
- * @s: Current migration state
- * @*old_vm_running: Pointer to old_vm_running flag
- * @*start_time: Pointer to time to update
  */
-static void migration_completion(MigrationState *s, bool *old_vm_running,
-                                 int64_t *start_time)
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    QEMUFile *rp = ms->from_dst_file;
+    uint16_t header_len, header_type;
+    uint8_t buf[512];
+    uint32_t tmp32;
+    ram_addr_t start;
+    size_t len;
+    char *rbname;
+    int res;
+
+    trace_source_return_path_thread_entry();
+    while (!ms->rp_state.error && !qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_loop_top();
+        header_type = qemu_get_be16(rp);
+        header_len = qemu_get_be16(rp);
+
+        if (header_type >= MIG_RP_MSG_MAX ||
+            header_type == MIG_RP_MSG_INVALID) {
+            error_report("RP: Received invalid message 0x%04x length 0x%04x",
+                    header_type, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* Leaves room to terminate a RAMBlock name */
+        if (header_len >= sizeof(buf)) {
+            error_report("RP: Received bad message 0x%04x length 0x%04x",
+                         header_type, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* We know we've got a valid header by this point */
+        res = qemu_get_buffer(rp, buf, header_len);
+        if (res != header_len) {
+            error_report("RP: Failed reading data for message 0x%04x"
+                         " read %d expected %d",
+                         header_type, res, header_len);
+            mark_source_rp_bad(ms);
+            goto out;
+        }
+
+        /* OK, we have the message and the data */
+        switch (header_type) {
+        case MIG_RP_MSG_SHUT:
+            if (header_len != sizeof(tmp32)) {
+                error_report("RP: Bad SHUT message length %d", header_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            tmp32 = be32_to_cpup((uint32_t *)buf);
+            trace_source_return_path_thread_shut(tmp32);
+            if (tmp32) {
+                error_report("RP: Sibling indicated error %d", tmp32);
+                mark_source_rp_bad(ms);
+            }
+            /*
+             * We'll let the main thread deal with closing the RP
+             * we could do a shutdown(2) on it, but we're the only user
+             * anyway, so there's nothing gained.
+             */
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+            /* be64 start, be32 len, counted RAMBlock name */
+            if (header_len < 13 || header_len != 13 + buf[12]) {
+                error_report("RP: Bad REQ_PAGES message length %d",
+                             header_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            start = be64_to_cpup((uint64_t *)buf);
+            len = be32_to_cpup((uint32_t *)(buf + 8));
+            rbname = NULL;
+            if (buf[12]) {
+                rbname = (char *)buf + 13;
+                rbname[buf[12]] = '\0';
+            }
+            if (ram_save_queue_pages(rbname, start, len)) {
+                mark_source_rp_bad(ms);
+            }
+            break;
+
+        case MIG_RP_MSG_PONG:
+            if (header_len != sizeof(tmp32)) {
+                error_report("RP: Bad PONG message length %d", header_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            tmp32 = be32_to_cpup((uint32_t *)buf);
+            trace_source_return_path_thread_pong(tmp32);
+            break;
+
+        case MIG_RP_MSG_LOADED:
+            if (header_len != 0) {
+                error_report("RP: Bad LOADED message length %d", header_len);
+                mark_source_rp_bad(ms);
+                goto out;
+            }
+            ms->rp_state.loaded_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+            trace_source_return_path_thread_loaded();
+            break;
+
+        default:
+            break;
+        }
+    }
+    if (qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_bad_end();
+        mark_source_rp_bad(ms);
+    }
+
+    trace_source_return_path_thread_end();
+out:
+    return NULL;
+}
+
+static int open_return_path_on_source(MigrationState *ms)
+{
+    ms->from_dst_file = qemu_file_get_return_path(ms->file);
+    if (!ms->from_dst_file) {
+        return -1;
+    }
+
+    qemu_thread_create(&ms->rp_state.thread, "return path",
+                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+    ms->rp_state.thread_created = true;
+
+    return 0;
+}
+
+/*
+ * Wait for the return path thread to see the destination's SHUT, or make
+ * it exit right away when @error is set.
+ *
+ * Returns 0 if the destination reported success, -1 otherwise
+ */
+static int await_return_path_close_on_source(MigrationState *ms, bool error)
+{
+    /*
+     * If this is a normal exit then the destination will send a SHUT and the
+     * rp_thread will exit, however if there's an error we need to cause
+     * it to exit.
+     */
+    if (error) {
+        /*
+         * shutdown(2), if we have it, will cause it to unblock if it's stuck
+         * waiting for the destination.
+         */
+        qemu_file_shutdown(ms->from_dst_file);
+        mark_source_rp_bad(ms);
+    }
+    trace_await_return_path_close_on_source_joining();
+    qemu_thread_join(&ms->rp_state.thread);
+    ms->rp_state.thread_created = false;
+    trace_await_return_path_close_on_source_close();
+    qemu_fclose(ms->from_dst_file);
+    ms->from_dst_file = NULL;
+
+    return ms->rp_state.error ? -1 : 0;
+}
+
+/*
+ * Switch from precopy to postcopy: stop the guest, tell the destination
+ * which pages it must drop, then send it the device state and make it
+ * start the guest; the rest of RAM follows, requested pages first.
+ *
+ * Returns 0 on success, -1 after moving the state to FAILED
+ */
+static int postcopy_start(MigrationState *ms, bool *old_vm_running,
+                          int64_t *start_time)
 {
     int ret;
+    QEMUFile *fb;
+    int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    migrate_set_state(ms, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_POSTCOPY_ACTIVE);
 
+    trace_postcopy_start();
     qemu_mutex_lock_iothread();
-    *start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
     *old_vm_running = runstate_is_running();
-
     ret = global_state_store();
     if (!ret) {
         ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
-        if (ret >= 0) {
-            qemu_file_set_rate_limit(s->file, INT64_MAX);
-            qemu_savevm_state_complete(s->file);
-        }
     }
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The guest is stopped here, what is left is latency for the dest */
+    qemu_file_set_rate_limit(ms->file, INT64_MAX);
+
+    /*
+     * in Finish migrate and with the io-lock held everything should
+     * be quiet, but we've potentially still got dirty pages and we
+     * need to tell the destination to throw any pages it's already received
+     * that are dirty
+     */
+    if (ram_postcopy_send_discard_bitmap(ms->file)) {
+        error_report("postcopy send discard bitmap failed");
+        goto fail;
+    }
+
+    /*
+     * The package is read completely by the destination before it's
+     * loaded: the LISTEN it contains starts the thread that reads the
+     * main stream while the devices are still being loaded.
+     */
+    fb = qemu_bufopen("w", NULL);
+    if (!fb) {
+        error_report("Failed to create buffered file");
+        goto fail;
+    }
+
+    qemu_savevm_send_postcopy_listen(fb);
+    qemu_savevm_state_devices(fb);
+    qemu_savevm_send_postcopy_run(fb);
+
+    /* Now send that blob */
+    if (qemu_savevm_send_packaged(ms->file, qemu_buf_get(fb))) {
+        qemu_fclose(fb);
+        goto fail;
+    }
+    qemu_fclose(fb);
+
+    /*
+     * The guest runs on the destination as soon as the package is loaded;
+     * the destination's LOADED refines this at the end of migration.
+     */
+    *start_time = time_at_stop;
+    ms->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - time_at_stop;
+
+    qemu_mutex_unlock_iothread();
+
+    ret = qemu_file_get_error(ms->file);
+    if (ret) {
+        error_report("postcopy_start: Migration stream errored");
+        migrate_set_state(ms, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                              MIGRATION_STATUS_FAILED);
+    }
+
+    return ret;
+
+fail:
+    migrate_set_state(ms, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
     qemu_mutex_unlock_iothread();
+    return -1;
+}
+
+/**
+ * migration_completion: Used by migration_thread when there's not much left.
+ *   The caller 'breaks' the loop when this returns.
+ *
+ * @s: Current migration state
+ * @current_active_state: The migration state we expect to be in
+ * @*old_vm_running: Pointer to old_vm_running flag
+ * @*start_time: Pointer to time to update
+ */
+static void migration_completion(MigrationState *s, int current_active_state,
+                                 bool *old_vm_running,
+                                 int64_t *start_time)
+{
+    int64_t pause_start, pos;
+    int ret = 0;
+
+    if (s->state == MIGRATION_STATUS_ACTIVE) {
+        qemu_mutex_lock_iothread();
+        *start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+        *old_vm_running = runstate_is_running();
+
+        ret = global_state_store();
+        if (!ret) {
+            ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            if (ret >= 0) {
+                qemu_file_set_rate_limit(s->file, INT64_MAX);
+                pause_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+                pos = qemu_ftell(s->file);
+                qemu_savevm_state_complete(s->file);
+                migration_checkpoint_record(MIGRATION_CHECKPOINT_BYTES,
+                                            qemu_ftell(s->file) - pos);
+                migration_checkpoint_record(MIGRATION_CHECKPOINT_PAUSE,
+                                        qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                        pause_start);
+            }
+        }
+        qemu_mutex_unlock_iothread();
+    } else if (s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        /* The devices went in the package, only RAM is left */
+        qemu_mutex_lock_iothread();
+        qemu_savevm_live_state(s->file);
+        qemu_mutex_unlock_iothread();
+    }
 
     if (ret < 0) {
         goto fail;
     }
 
+    /*
+     * If rp was opened we must clean up the thread before
+     * cleaning everything else up (since if there are no failures
+     * it will wait for the destination to send it's status in
+     * a SHUT command).
+     */
+    if (s->rp_state.thread_created &&
+        await_return_path_close_on_source(s,
+                                          qemu_file_get_error(s->file) != 0)) {
+        goto fail;
+    }
+
     if (qemu_file_get_error(s->file)) {
         trace_migration_completion_file_err();
         goto fail;
     }
 
-    migrate_set_state(s, MIGRATION_STATUS_ACTIVE, MIGRATION_STATUS_COMPLETED);
+    if (migrate_colo_enabled()) {
+        /* The migration thread goes on with the COLO checkpoints */
+        migrate_set_state(s, MIGRATION_STATUS_ACTIVE, MIGRATION_STATUS_COLO);
+        return;
+    }
+
+    migrate_set_state(s, current_active_state, MIGRATION_STATUS_COMPLETED);
     return;
 
 fail:
-    migrate_set_state(s, MIGRATION_STATUS_ACTIVE, MIGRATION_STATUS_FAILED);
+    migrate_set_state(s, current_active_state, MIGRATION_STATUS_FAILED);
 }
 
-/* migration thread support */
 
 static void *migration_thread(void *opaque)
 {
@@ -1029,16 +1872,30 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool enable_colo = false;
+    bool entered_postcopy = false;
+    /* The active state we expect to be in; ACTIVE or POSTCOPY_ACTIVE */
+    int current_active_state = MIGRATION_STATUS_ACTIVE;
 
     rcu_register_thread();
 
     qemu_savevm_state_header(s->file);
+    if (s->rp_state.thread_created) {
+        /* Have the destination open its side and check it answers */
+        qemu_savevm_send_open_return_path(s->file);
+        qemu_savevm_send_ping(s->file, 1);
+    }
+    if (migrate_postcopy_ram()) {
+        /* Now tell the dest that it should prepare for postcopy */
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
     qemu_savevm_state_begin(s->file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIGRATION_STATUS_SETUP, MIGRATION_STATUS_ACTIVE);
 
-    while (s->state == MIGRATION_STATUS_ACTIVE) {
+    while (s->state == MIGRATION_STATUS_ACTIVE ||
+           s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
@@ -1046,16 +1903,31 @@ static void *migration_thread(void *opaque)
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
+                /* Still a significant amount to transfer */
+                if (migrate_postcopy_ram() &&
+                    s->state != MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+                    atomic_read(&s->start_postcopy) &&
+                    ram_postcopy_can_start()) {
+
+                    if (!postcopy_start(s, &old_vm_running, &start_time)) {
+                        current_active_state =
+                            MIGRATION_STATUS_POSTCOPY_ACTIVE;
+                        entered_postcopy = true;
+                    }
+
+                    continue;
+                }
                 qemu_savevm_state_iterate(s->file);
             } else {
                 trace_migration_thread_low_pending(pending_size);
-                migration_completion(s, &old_vm_running, &start_time);
+                migration_completion(s, current_active_state,
+                                     &old_vm_running, &start_time);
                 break;
             }
         }
 
         if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+            migrate_set_state(s, current_active_state,
                               MIGRATION_STATUS_FAILED);
             break;
         }
@@ -1090,19 +1962,42 @@ static void *migration_thread(void *opaque)
     /* If we enabled cpu throttling for auto-converge, turn it off. */
     cpu_throttle_stop();
 
+    /* The migration failed or was cancelled, the dest won't send SHUT */
+    if (s->rp_state.thread_created) {
+        await_return_path_close_on_source(s, true);
+    }
+
     qemu_mutex_lock_iothread();
+    if (s->state == MIGRATION_STATUS_COLO) {
+        /* Only the initial switch over counts as migration downtime */
+        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time;
+        enable_colo = true;
+        /* Returns once the pair is broken */
+        migrate_start_colo_process(s);
+    }
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!enable_colo && s->rp_state.loaded_time) {
+            /* The destination told us when it had loaded everything */
+            s->downtime = s->rp_state.loaded_time - start_time;
+        } else if (!enable_colo && !entered_postcopy) {
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        if (enable_colo) {
+            /* The primary keeps running whatever its state before COLO */
+            vm_start();
+        } else {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        }
     } else {
-        if (old_vm_running) {
+        /* After postcopy started, the guest state only exists on the dest */
+        if (old_vm_running && !entered_postcopy) {
             vm_start();
         }
     }
@@ -1115,6 +2010,21 @@ static void *migration_thread(void *opaque)
 
 void migrate_fd_connect(MigrationState *s)
 {
+    /*
+     * Open the return path; postcopy needs it for page requests, otherwise
+     * it is asked for with the return-path capability.
+     */
+    if (migrate_use_return_path()) {
+        if (open_return_path_on_source(s)) {
+            error_report("Unable to open return-path, the transport "
+                         "does not support one");
+            qemu_fclose(s->file);
+            s->file = NULL;
+            migrate_fd_error(s);
+            return;
+        }
+    }
+
     /* This is a best 1st approximation. ns to ms */
     s->expected_downtime = max_downtime/1000000;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
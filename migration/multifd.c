@@ -0,0 +1,604 @@
+/*
+ * Multiple channel RAM migration (multifd)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * With multifd, guest pages are not written to the main migration stream
+ * but to x-multifd-channels extra connections to the same address, each
+ * with its own thread on both sides.  A page always goes on the channel
+ * its offset in the RAMBlock maps to.
+ *
+ * Each round over RAM sends a page at most once, but the next round may
+ * send it again on another path (e.g. as a zero page in the main stream).
+ * So at the end of each round the source puts a sync marker on every
+ * channel and RAM_SAVE_FLAG_MULTIFD_SYNC in the main stream; the
+ * destination's ram_load() waits there until every channel loaded what
+ * came before its marker, and the channels wait for ram_load() to get
+ * there before they go on.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/rcu_queue.h"
+#include "migration/migration.h"
+#include "migration/multifd.h"
+#include "migration/qemu-file.h"
+#include "exec/ram_addr.h"
+#include "trace.h"
+
+/* Sent first on each channel, then at the start of each packet */
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+/* The packet ends with a sync marker */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/*
+ * Most pages in a packet; that many consecutive pages of a RAMBlock also
+ * make the shard that goes to one channel.
+ */
+#define MULTIFD_PACKET_PAGES 64
+
+typedef struct {
+    RAMBlock *block;
+    uint32_t num;
+    ram_addr_t offset[MULTIFD_PACKET_PAGES];
+} MultiFDPages;
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    QEMUFile *file;
+    /* Posted by the migration thread when there is a packet to send */
+    QemuSemaphore sem;
+    /* Posted by the channel thread when it can take the next packet */
+    QemuSemaphore sem_free;
+    /* Filled by the migration thread */
+    MultiFDPages *pending;
+    /* Owned by the channel thread between sem and sem_free */
+    MultiFDPages *pages;
+    uint32_t flags;
+    bool quit;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* Set by a channel thread that failed to send */
+    bool error;
+} *multifd_send_state;
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    QEMUFile *file;
+    bool created;
+    /* Posted by the channel thread when it reaches a sync marker or exits */
+    QemuSemaphore sem_sync;
+    /* Posted by ram_load() once all the channels reached the marker */
+    QemuSemaphore sem;
+    bool exited;
+    bool quit;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    int listen_fd;
+    QemuThread accept_thread;
+} *multifd_recv_state;
+
+static int multifd_send_packet(MultiFDSendParams *p)
+{
+    QEMUFile *f = p->file;
+    MultiFDPages *pages = p->pages;
+    size_t len;
+    uint32_t i;
+
+    qemu_put_be32(f, MULTIFD_MAGIC);
+    qemu_put_be32(f, p->flags);
+    qemu_put_be32(f, pages->num);
+    if (pages->num) {
+        len = strlen(pages->block->idstr);
+        qemu_put_byte(f, len);
+        qemu_put_buffer(f, (uint8_t *)pages->block->idstr, len);
+        for (i = 0; i < pages->num; i++) {
+            qemu_put_be64(f, pages->offset[i]);
+        }
+        /*
+         * Straight from guest memory, like ram_save_page() does.  The
+         * block can't go away, multifd_queue_page() took a reference.
+         */
+        for (i = 0; i < pages->num; i++) {
+            qemu_put_buffer_async(f, pages->block->host + pages->offset[i],
+                                  TARGET_PAGE_SIZE);
+        }
+    }
+    if (p->flags & MULTIFD_FLAG_SYNC) {
+        /*
+         * With zero-copy the kernel may still read guest pages we sent;
+         * wait for it before the next round can send them again.
+         */
+        qemu_file_flush_zero_copy(f);
+    } else {
+        qemu_fflush(f);
+    }
+    trace_multifd_send_packet(p->id, pages->num, p->flags);
+
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        if (atomic_read(&p->quit)) {
+            break;
+        }
+        /* After an error keep freeing packets, the migration is failing */
+        if (!atomic_read(&multifd_send_state->error) &&
+            multifd_send_packet(p)) {
+            error_report("multifd: sending on channel %d failed", p->id);
+            atomic_set(&multifd_send_state->error, true);
+        }
+        if (p->pages->num) {
+            memory_region_unref(p->pages->block->mr);
+        }
+        qemu_sem_post(&p->sem_free);
+    }
+
+    return NULL;
+}
+
+static int multifd_connect(MigrationState *s, Error **errp)
+{
+    const char *p;
+
+    if (strstart(s->uri, "tcp:", &p)) {
+        return inet_connect(p, errp);
+    }
+#if !defined(WIN32)
+    if (strstart(s->uri, "unix:", &p)) {
+        return unix_connect(p, errp);
+    }
+#endif
+    error_setg(errp, "multifd needs a tcp: or unix: migration URI");
+    return -1;
+}
+
+int multifd_save_setup(MigrationState *s)
+{
+    int count = migrate_multifd_channels();
+    Error *local_err = NULL;
+    int i, fd;
+
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, count);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        char *name;
+
+        fd = multifd_connect(s, &local_err);
+        if (fd < 0) {
+            error_report_err(local_err);
+            multifd_save_cleanup(true);
+            return -1;
+        }
+
+        p->id = i;
+        p->file = qemu_fopen_socket(fd, "wb");
+        if (migrate_use_zero_copy_send()) {
+            int ret = qemu_file_enable_zero_copy(p->file);
+
+            if (ret) {
+                error_report("multifd: zero-copy send is not available on "
+                             "channel %d: %s", i, strerror(-ret));
+                qemu_fclose(p->file);
+                multifd_save_cleanup(true);
+                return -1;
+            }
+        }
+        p->pending = g_new0(MultiFDPages, 1);
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_sem_init(&p->sem, 0);
+        qemu_sem_init(&p->sem_free, 1);
+
+        qemu_put_be32(p->file, MULTIFD_MAGIC);
+        qemu_put_be32(p->file, MULTIFD_VERSION);
+        qemu_put_be32(p->file, i);
+        qemu_put_be32(p->file, count);
+        qemu_fflush(p->file);
+
+        name = g_strdup_printf("multifd send %d", i);
+        qemu_thread_create(&p->thread, name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        g_free(name);
+        multifd_send_state->count++;
+    }
+    trace_multifd_save_setup(count);
+
+    return 0;
+}
+
+void multifd_save_cleanup(bool abort)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (abort) {
+            /* The destination may not read anymore */
+            qemu_file_shutdown(p->file);
+        }
+        /* Wait for the packet in flight */
+        qemu_sem_wait(&p->sem_free);
+        atomic_set(&p->quit, true);
+        qemu_sem_post(&p->sem);
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem);
+        qemu_sem_destroy(&p->sem_free);
+        if (p->pending->num) {
+            memory_region_unref(p->pending->block->mr);
+        }
+        g_free(p->pending);
+        g_free(p->pages);
+    }
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+bool multifd_save_active(void)
+{
+    return multifd_send_state != NULL;
+}
+
+/* Hand the pending pages of @p to its thread */
+static int multifd_send_pages(MultiFDSendParams *p, uint32_t flags)
+{
+    MultiFDPages *pages;
+
+    qemu_sem_wait(&p->sem_free);
+    if (atomic_read(&multifd_send_state->error)) {
+        qemu_sem_post(&p->sem_free);
+        return -1;
+    }
+    pages = p->pages;
+    p->pages = p->pending;
+    p->pending = pages;
+    p->pending->block = NULL;
+    p->pending->num = 0;
+    p->flags = flags;
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    uint64_t shard = offset / (MULTIFD_PACKET_PAGES * TARGET_PAGE_SIZE);
+    MultiFDSendParams *p;
+    MultiFDPages *pages;
+
+    p = &multifd_send_state->params[shard % multifd_send_state->count];
+    pages = p->pending;
+    if (pages->num && pages->block != block) {
+        /* A packet only holds pages of one RAMBlock */
+        if (multifd_send_pages(p, 0)) {
+            return -1;
+        }
+    }
+    if (!pages->num) {
+        /* Dropped by the channel thread once the packet was sent */
+        memory_region_ref(block->mr);
+        pages->block = block;
+    }
+    pages->offset[pages->num++] = offset;
+    if (pages->num == MULTIFD_PACKET_PAGES) {
+        return multifd_send_pages(p, 0);
+    }
+
+    return 0;
+}
+
+int multifd_send_flush(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (p->pending->num && multifd_send_pages(p, 0)) {
+            ret = -1;
+        }
+    }
+    /* Even after an error, other channels may still be sending */
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_sem_wait(&p->sem_free);
+        qemu_sem_post(&p->sem_free);
+    }
+    if (atomic_read(&multifd_send_state->error)) {
+        ret = -1;
+    }
+    trace_multifd_send_flush(ret);
+
+    return ret;
+}
+
+int multifd_send_sync_main(void)
+{
+    int i;
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        if (multifd_send_pages(&multifd_send_state->params[i],
+                               MULTIFD_FLAG_SYNC)) {
+            return -1;
+        }
+    }
+    trace_multifd_send_sync_main();
+
+    return 0;
+}
+
+/* Load one packet into guest memory; called within an RCU critical section */
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags)
+{
+    QEMUFile *f = p->file;
+    ram_addr_t offset[MULTIFD_PACKET_PAGES];
+    char idstr[256];
+    RAMBlock *block;
+    uint32_t magic, num, i;
+
+    magic = qemu_get_be32(f);
+    *flags = qemu_get_be32(f);
+    num = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (magic != MULTIFD_MAGIC || num > MULTIFD_PACKET_PAGES) {
+        error_report("multifd: bad packet on channel %d (magic 0x%x, %u "
+                     "pages)", p->id, magic, num);
+        return -EINVAL;
+    }
+    trace_multifd_recv_packet(p->id, num, *flags);
+    if (!num) {
+        return 0;
+    }
+
+    qemu_get_counted_string(f, idstr);
+    block = ram_block_by_name(idstr);
+    if (!block) {
+        error_report("multifd: unknown RAMBlock '%s'", idstr);
+        return -EINVAL;
+    }
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+        if (offset[i] & ~TARGET_PAGE_MASK ||
+            offset[i] >= block->used_length) {
+            error_report("multifd: bad offset " RAM_ADDR_FMT " in '%s'",
+                         offset[i], idstr);
+            return -EINVAL;
+        }
+    }
+    for (i = 0; i < num; i++) {
+        qemu_get_buffer(f, block->host + offset[i], TARGET_PAGE_SIZE);
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    uint32_t flags;
+    int ret;
+
+    rcu_register_thread();
+    while (true) {
+        rcu_read_lock();
+        ret = multifd_recv_packet(p, &flags);
+        rcu_read_unlock();
+        if (ret) {
+            /* The source closes the channels once the migration is over */
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&p->sem_sync);
+            qemu_sem_wait(&p->sem);
+            if (atomic_read(&p->quit)) {
+                break;
+            }
+        }
+    }
+    atomic_set(&p->exited, true);
+    qemu_sem_post(&p->sem_sync);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/* Read the greeting of a new channel; returns its id or -1 */
+static int multifd_recv_handshake(QEMUFile *f)
+{
+    uint32_t magic, version, id, count;
+
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    id = qemu_get_be32(f);
+    count = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        error_report("multifd: failed to read the channel greeting");
+        return -1;
+    }
+    if (magic != MULTIFD_MAGIC || version != MULTIFD_VERSION) {
+        error_report("multifd: bad greeting (magic 0x%x version %u)",
+                     magic, version);
+        return -1;
+    }
+    if (count != multifd_recv_state->count || id >= count ||
+        multifd_recv_state->params[id].created) {
+        error_report("multifd: unexpected channel %u of %u, x-multifd-channels "
+                     "is %d here", id, count, multifd_recv_state->count);
+        return -1;
+    }
+
+    return id;
+}
+
+/*
+ * Accept the channels without the main loop: ram_load() may already be
+ * blocked waiting for them in a sync.
+ */
+static void *multifd_recv_accept_thread(void *opaque)
+{
+    int accepted, i;
+
+    for (accepted = 0; accepted < multifd_recv_state->count; accepted++) {
+        MultiFDRecvParams *p;
+        QEMUFile *f;
+        char *name;
+        int c, id;
+
+        do {
+            c = qemu_accept(multifd_recv_state->listen_fd, NULL, NULL);
+        } while (c < 0 && socket_error() == EINTR);
+        if (c < 0) {
+            /* Also how multifd_recv_cleanup() stops us */
+            break;
+        }
+
+        qemu_set_block(c);
+        f = qemu_fopen_socket(c, "rb");
+        id = multifd_recv_handshake(f);
+        if (id < 0) {
+            qemu_fclose(f);
+            break;
+        }
+
+        p = &multifd_recv_state->params[id];
+        p->file = f;
+        p->created = true;
+        name = g_strdup_printf("multifd recv %d", id);
+        qemu_thread_create(&p->thread, name, multifd_recv_thread, p,
+                           QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+
+    if (accepted < multifd_recv_state->count) {
+        /* Don't leave ram_load() waiting for channels that won't come */
+        for (i = 0; i < multifd_recv_state->count; i++) {
+            MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+            if (!p->created) {
+                atomic_set(&p->exited, true);
+                qemu_sem_post(&p->sem_sync);
+            }
+        }
+    }
+    trace_multifd_recv_accept_done(accepted);
+
+    return NULL;
+}
+
+void multifd_recv_accept_channels(int listen_fd)
+{
+    int count = migrate_multifd_channels();
+    int i;
+
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, count);
+    multifd_recv_state->count = count;
+    multifd_recv_state->listen_fd = listen_fd;
+    for (i = 0; i < count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        p->id = i;
+        qemu_sem_init(&p->sem_sync, 0);
+        qemu_sem_init(&p->sem, 0);
+    }
+
+    qemu_set_block(listen_fd);
+    qemu_thread_create(&multifd_recv_state->accept_thread, "multifd accept",
+                       multifd_recv_accept_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+}
+
+int multifd_recv_sync_main(void)
+{
+    int ret = 0;
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: sync received but x-multifd is not enabled");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_sem_wait(&p->sem_sync);
+        if (atomic_read(&p->exited)) {
+            error_report("multifd: channel %d is gone", i);
+            ret = -EIO;
+        }
+    }
+    if (ret) {
+        return ret;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem);
+    }
+    trace_multifd_recv_sync_main();
+
+    return 0;
+}
+
+void multifd_recv_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    /* Wakes the accept thread up if channels are still missing */
+    shutdown(multifd_recv_state->listen_fd, SHUT_RDWR);
+    qemu_thread_join(&multifd_recv_state->accept_thread);
+    closesocket(multifd_recv_state->listen_fd);
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->created) {
+            atomic_set(&p->quit, true);
+            qemu_file_shutdown(p->file);
+            qemu_sem_post(&p->sem);
+            qemu_thread_join(&p->thread);
+            qemu_fclose(p->file);
+        }
+        qemu_sem_destroy(&p->sem_sync);
+        qemu_sem_destroy(&p->sem);
+    }
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
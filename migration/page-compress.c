@@ -0,0 +1,153 @@
+/*
+ * Page compression for migration
+ *
+ * The compression threads compress one guest page at a time with zlib,
+ * LZ4 or zstd.  LZ4 is several times faster than zlib for a somewhat
+ * worse ratio and is what lets a few threads keep up with a fast link;
+ * zstd is in between.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "qemu-common.h"
+#include "migration/page-compress.h"
+
+struct PageCompress {
+    MigrationCompressMethod method;
+#ifdef CONFIG_ZSTD
+    /* zstd allocates a lot for each call without these */
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+bool page_compress_available(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return true;
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return true;
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+PageCompress *page_compress_new(MigrationCompressMethod method)
+{
+    PageCompress *pc = g_new0(PageCompress, 1);
+
+    assert(page_compress_available(method));
+    pc->method = method;
+    return pc;
+}
+
+void page_compress_free(PageCompress *pc)
+{
+    if (!pc) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(pc->zstd_cctx);
+    ZSTD_freeDCtx(pc->zstd_dctx);
+#endif
+    g_free(pc);
+}
+
+ssize_t page_compress(PageCompress *pc, int level, uint8_t *dst, size_t dlen,
+                      const uint8_t *src, size_t size)
+{
+    switch (pc->method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB: {
+        uLongf blen = dlen;
+
+        /* Z_BUF_ERROR when it doesn't fit */
+        if (compress2(dst, &blen, src, size, level) != Z_OK) {
+            return -1;
+        }
+        return blen;
+    }
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int blen = LZ4_compress_default((const char *)src, (char *)dst,
+                                        size, dlen);
+
+        return blen > 0 ? blen : -1;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t blen;
+
+        if (!pc->zstd_cctx) {
+            pc->zstd_cctx = ZSTD_createCCtx();
+            if (!pc->zstd_cctx) {
+                return -1;
+            }
+        }
+        /* zstd takes 0 as its default level, but 0 is "none" for zlib */
+        blen = ZSTD_compressCCtx(pc->zstd_cctx, dst, dlen, src, size,
+                                 MAX(level, 1));
+        return ZSTD_isError(blen) ? -1 : blen;
+    }
+#endif
+    default:
+        abort();
+    }
+}
+
+ssize_t page_decompress(PageCompress *pc, MigrationCompressMethod method,
+                        uint8_t *dst, size_t dlen,
+                        const uint8_t *src, size_t slen)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB: {
+        uLongf len = dlen;
+
+        if (uncompress(dst, &len, src, slen) != Z_OK) {
+            return -1;
+        }
+        return len;
+    }
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int len = LZ4_decompress_safe((const char *)src, (char *)dst,
+                                      slen, dlen);
+
+        return len >= 0 ? len : -1;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t len;
+
+        if (!pc->zstd_dctx) {
+            pc->zstd_dctx = ZSTD_createDCtx();
+            if (!pc->zstd_dctx) {
+                return -1;
+            }
+        }
+        len = ZSTD_decompressDCtx(pc->zstd_dctx, dst, dlen, src, slen);
+        return ZSTD_isError(len) ? -1 : len;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
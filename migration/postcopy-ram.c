@@ -0,0 +1,539 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * Copyright 2013-2015 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *  Dave Gilbert  <dgilbert@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Postcopy is a migration technique where the execution flips from the
+ * source to the destination before all the data has been copied.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "sysemu/sysemu.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu_queue.h"
+#include "exec/ram_addr.h"
+#include "trace.h"
+
+/*
+ * userfaultfd arrived with Linux 4.3; the headers in linux-headers/ are
+ * enough to build, whether the running kernel has it is only known at
+ * runtime (postcopy_ram_supported_by_host).
+ */
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/userfaultfd.h>
+
+static bool ufd_version_check(int ufd)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
+                     strerror(errno));
+        return false;
+    }
+
+    ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                 (__u64)1 << _UFFDIO_UNREGISTER;
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("Missing userfault features: %" PRIx64,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        return false;
+    }
+
+    return true;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    long pagesize = getpagesize();
+    RAMBlock *block;
+    int ufd = -1;
+    bool ret = false;
+
+    /* Each page is placed atomically, a target page must be a host page */
+    if (pagesize != TARGET_PAGE_SIZE) {
+        error_report("Postcopy: target page size (%d) must match host page "
+                     "size (%ld)", TARGET_PAGE_SIZE, pagesize);
+        goto out;
+    }
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        goto out;
+    }
+
+    /* Version and features check */
+    if (!ufd_version_check(ufd)) {
+        goto out;
+    }
+
+    /* userfaultfd only handles anonymous memory so far */
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->fd >= 0) {
+            error_report("Postcopy: RAM block %s is file backed",
+                         block->idstr);
+            rcu_read_unlock();
+            goto out;
+        }
+    }
+    rcu_read_unlock();
+
+    ret = true;
+out:
+    if (ufd != -1) {
+        close(ufd);
+    }
+    return ret;
+}
+
+/**
+ * postcopy_ram_discard_range: Discard a range of memory.
+ * We can assume that if we've been called postcopy_ram_supported_by_host
+ * returned true.
+ *
+ * @mis: Current incoming migration state.
+ * @start, @length: range of memory to discard.
+ *
+ * returns: 0 on success.
+ */
+int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
+                               size_t length)
+{
+    trace_postcopy_ram_discard_range(start, length);
+    if (madvise(start, length, MADV_DONTNEED)) {
+        error_report("%s MADV_DONTNEED: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Setup an area of RAM so that it *can* be used for postcopy later; this
+ * must be done right at the start prior to pre-copy: any page populated
+ * now would not fault later, so the whole of RAM is discarded, precopy
+ * fills it again.
+ */
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        /*
+         * Transparent huge pages would map 2MB at once on the first write,
+         * we need to see faults at page granularity.
+         */
+        qemu_madvise(block->host, block->used_length, QEMU_MADV_NOHUGEPAGE);
+        ret = postcopy_ram_discard_range(mis, block->host, block->used_length);
+        if (ret) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+ * At the end of migration, undo the effects of init_range
+ */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    trace_postcopy_ram_incoming_cleanup_entry();
+
+    if (mis->have_fault_thread) {
+        uint64_t tmp64 = 1;
+
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            struct uffdio_range range_struct;
+
+            range_struct.start = (uintptr_t)block->host;
+            range_struct.len = block->used_length;
+            if (ioctl(mis->userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+                error_report("%s: userfault unregister %s", __func__,
+                             strerror(errno));
+            }
+        }
+        rcu_read_unlock();
+
+        /* Tell the fault_thread to exit */
+        if (write(mis->userfault_quit_fd, &tmp64, 8) != 8) {
+            error_report("%s: incrementing userfault_quit_fd: %s", __func__,
+                         strerror(errno));
+        }
+        trace_postcopy_ram_incoming_cleanup_join();
+        qemu_thread_join(&mis->fault_thread);
+        mis->have_fault_thread = false;
+
+        close(mis->userfault_fd);
+        close(mis->userfault_quit_fd);
+        mis->userfault_fd = -1;
+        mis->userfault_quit_fd = -1;
+    }
+
+    /* The source may also have decided not to switch to postcopy */
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        qemu_madvise(block->host, block->used_length, QEMU_MADV_HUGEPAGE);
+    }
+    rcu_read_unlock();
+
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, getpagesize());
+        mis->postcopy_tmp_page = NULL;
+    }
+    trace_postcopy_ram_incoming_cleanup_exit();
+    return 0;
+}
+
+/*
+ * Find the RAMBlock holding a faulting address and the offset in it.
+ * Called within an RCU critical section.
+ */
+static RAMBlock *postcopy_block_from_host(uint8_t *host, ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->host && host >= block->host &&
+            host - block->host < block->used_length) {
+            *offset = host - block->host;
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Handle faults detected by the USERFAULT markings
+ */
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffd_msg msg;
+    RAMBlock *last_rb = NULL;
+    int ret;
+
+    rcu_register_thread();
+    trace_postcopy_ram_fault_thread_entry();
+    qemu_sem_post(&mis->fault_thread_sem);
+
+    while (true) {
+        struct pollfd pfd[2];
+        ram_addr_t rb_offset;
+        RAMBlock *rb;
+
+        /*
+         * We're mainly waiting for the kernel to give us a faulting HVA,
+         * however we can be told to quit via userfault_quit_fd which is
+         * an eventfd
+         */
+        pfd[0].fd = mis->userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = mis->userfault_quit_fd;
+        pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1 /* Wait forever */) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            trace_postcopy_ram_fault_thread_quit();
+            break;
+        }
+
+        ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN) {
+                /*
+                 * if a wake up happens on the other thread just after
+                 * the poll, there is nothing to read.
+                 */
+                continue;
+            }
+            if (ret < 0) {
+                error_report("%s: Failed to read full userfault message: %s",
+                             __func__, strerror(errno));
+                break;
+            } else {
+                error_report("%s: Read %d bytes from userfaultfd expected %zd",
+                             __func__, ret, sizeof(msg));
+                break; /* Lost alignment, don't know what we'd read next */
+            }
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("%s: Read unexpected event %u from userfaultfd",
+                         __func__, msg.event);
+            continue; /* It's not a page fault, shouldn't happen */
+        }
+
+        rcu_read_lock();
+        rb = postcopy_block_from_host(
+                 (uint8_t *)(uintptr_t)msg.arg.pagefault.address, &rb_offset);
+        if (!rb) {
+            rcu_read_unlock();
+            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                         PRIx64, (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+
+        rb_offset &= TARGET_PAGE_MASK;
+        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
+                                                rb->idstr, rb_offset);
+
+        /*
+         * Send the request to the source; the name of the RAMBlock is only
+         * sent when it changes.
+         */
+        migrate_send_rp_req_pages(mis, rb != last_rb ? rb->idstr : NULL,
+                                  rb_offset, TARGET_PAGE_SIZE);
+        last_rb = rb;
+        rcu_read_unlock();
+    }
+    trace_postcopy_ram_fault_thread_exit();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    /* Open the fd for the kernel to give us userfaults */
+    mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (mis->userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Although the host check already tested the API, we need to
+     * do the check again as an ABI handshake on the new fd.
+     */
+    if (!ufd_version_check(mis->userfault_fd)) {
+        close(mis->userfault_fd);
+        return -1;
+    }
+
+    /* Now an eventfd we use to tell the fault-thread to quit */
+    mis->userfault_quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (mis->userfault_quit_fd == -1) {
+        error_report("%s: Opening userfault_quit_fd: %s", __func__,
+                     strerror(errno));
+        close(mis->userfault_fd);
+        return -1;
+    }
+
+    qemu_sem_init(&mis->fault_thread_sem, 0);
+    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
+                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    qemu_sem_wait(&mis->fault_thread_sem);
+    qemu_sem_destroy(&mis->fault_thread_sem);
+    mis->have_fault_thread = true;
+
+    /* Mark so that we get notified of accesses to unwritten areas */
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        struct uffdio_register reg_struct;
+
+        reg_struct.range.start = (uintptr_t)block->host;
+        reg_struct.range.len = block->used_length;
+        reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+        /* Now tell our userfault_fd that it's responsible for this area */
+        if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+            error_report("%s userfault register: %s", __func__,
+                         strerror(errno));
+            rcu_read_unlock();
+            return -1;
+        }
+        if ((reg_struct.ioctls & UFFD_API_RANGE_IOCTLS) !=
+            UFFD_API_RANGE_IOCTLS) {
+            error_report("%s: userfault can't place pages in %s", __func__,
+                         block->idstr);
+            rcu_read_unlock();
+            return -1;
+        }
+    }
+    rcu_read_unlock();
+
+    trace_postcopy_ram_enable_notify();
+
+    return 0;
+}
+
+/*
+ * Place a host page (from) at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    struct uffdio_copy copy_struct;
+
+    copy_struct.dst = (uint64_t)(uintptr_t)host;
+    copy_struct.src = (uint64_t)(uintptr_t)from;
+    copy_struct.len = getpagesize();
+    copy_struct.mode = 0;
+
+    /* copy also acks to the kernel, waking up threads stalled on the page */
+    if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct)) {
+        int e = errno;
+        /*
+         * The page was requested and arrived with the background stream
+         * too: the second copy is the one that loses.
+         */
+        if (e == EEXIST) {
+            return 0;
+        }
+        error_report("%s: %s copy host: %p from: %p", __func__,
+                     strerror(e), host, from);
+        return -e;
+    }
+
+    trace_postcopy_place_page(host);
+    return 0;
+}
+
+/*
+ * Place a zero page at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    struct uffdio_zeropage zero_struct;
+
+    zero_struct.range.start = (uint64_t)(uintptr_t)host;
+    zero_struct.range.len = getpagesize();
+    zero_struct.mode = 0;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct)) {
+        int e = errno;
+        if (e == EEXIST) {
+            return 0;
+        }
+        error_report("%s: %s zero host: %p", __func__, strerror(e), host);
+        return -e;
+    }
+
+    trace_postcopy_place_page_zero(host);
+    return 0;
+}
+
+/*
+ * Returns a target page of memory that can be mapped at a later point in time
+ * using postcopy_place_page
+ * The same address is used repeatedly, postcopy_place_page just takes the
+ * backing page away.
+ * Returns: Pointer to allocated page
+ *
+ */
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_tmp_page) {
+        mis->postcopy_tmp_page = mmap(NULL, getpagesize(),
+                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                             MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_page == MAP_FAILED) {
+            mis->postcopy_tmp_page = NULL;
+            error_report("%s: %s", __func__, strerror(errno));
+            return NULL;
+        }
+    }
+
+    return mis->postcopy_tmp_page;
+}
+
+#else
+/* No target OS support, stubs just fail */
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int postcopy_ram_incoming_init(MigrationIncomingState *mis)
+{
+    error_report("postcopy_ram_incoming_init: No OS support");
+    return -1;
+}
+
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
+                               size_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    assert(0);
+    return -1;
+}
+
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    assert(0);
+    return NULL;
+}
+
+#endif
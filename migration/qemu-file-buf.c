@@ -366,6 +366,63 @@ ssize_t qsb_write_at(QEMUSizedBuffer *qsb, const uint8_t *source,
     return count;
 }
 
+/**
+ * Write the first @size bytes held in the QEMUSizedBuffer to a QEMUFile
+ * without an intermediate copy.
+ *
+ * @f: A QEMUFile to write the data to
+ * @qsb: A QEMUSizedBuffer holding the data
+ * @size: The number of bytes to write; must not exceed the used length
+ */
+void qsb_put_buffer(QEMUFile *f, const QEMUSizedBuffer *qsb, size_t size)
+{
+    size_t l;
+    size_t i;
+
+    assert(size <= qsb->used);
+
+    for (i = 0; i < qsb->n_iov && size > 0; i++) {
+        l = MIN(qsb->iov[i].iov_len, size);
+        qemu_put_buffer(f, qsb->iov[i].iov_base, l);
+        size -= l;
+    }
+}
+
+/**
+ * Read @size bytes from a QEMUFile into the QEMUSizedBuffer, replacing
+ * its previous content. This function will automatically grow the
+ * QEMUSizedBuffer; the memory already allocated is reused.
+ *
+ * @qsb: A QEMUSizedBuffer
+ * @f: A QEMUFile to read the data from
+ * @size: The number of bytes to read
+ *
+ * Returns the number of bytes read into @qsb, which is less than @size
+ * on allocation failure or if the QEMUFile hit an error
+ */
+size_t qsb_fill_buffer(QEMUSizedBuffer *qsb, QEMUFile *f, size_t size)
+{
+    size_t l, got;
+    size_t i;
+
+    qsb->used = 0;
+    if (qsb_grow(qsb, size) < 0) {
+        return 0;
+    }
+
+    for (i = 0; i < qsb->n_iov && size > 0; i++) {
+        l = MIN(qsb->iov[i].iov_len, size);
+        got = qemu_get_buffer(f, qsb->iov[i].iov_base, l);
+        qsb->used += got;
+        size -= got;
+        if (got != l) {
+            break;
+        }
+    }
+
+    return qsb->used;
+}
+
 typedef struct QEMUBuffer {
     QEMUSizedBuffer *qsb;
     QEMUFile *file;
@@ -46,6 +46,8 @@ struct QEMUFile {
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    /* Async buffers go out through ops->writev_buffer_zero_copy */
+    bool zero_copy;
 
     int last_error;
 };
@@ -27,10 +27,20 @@
 #include "qemu/coroutine.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#include "trace.h"
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define QEMU_FILE_ZERO_COPY
+#include <poll.h>
+#include <linux/errqueue.h>
+#endif
 
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    /* sendmsg(MSG_ZEROCOPY) calls made, and how many the kernel completed */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_done;
 } QEMUFileSocket;
 
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
@@ -47,6 +57,131 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     return len;
 }
 
+#ifdef QEMU_FILE_ZERO_COPY
+static int socket_enable_zero_copy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int one = 1;
+
+    /* Fails for unix sockets and kernels before 4.14 */
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Each completion notification on the error queue covers the range
+ * [ee_info, ee_data] of our sendmsg() calls.
+ */
+static int socket_reap_zero_copy(QEMUFileSocket *s)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = { 0 };
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    ssize_t ret;
+
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ret = recvmsg(s->fd, &msg, MSG_ERRQUEUE);
+    if (ret < 0) {
+        return -errno;
+    }
+
+    cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 &&
+                  cm->cmsg_type == IPV6_RECVERR))) {
+        return -EINVAL;
+    }
+    serr = (struct sock_extended_err *)CMSG_DATA(cm);
+    if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        return serr->ee_errno ? -serr->ee_errno : -EIO;
+    }
+    s->zero_copy_done += serr->ee_data - serr->ee_info + 1;
+    trace_qemu_file_zero_copy_done(s->fd, serr->ee_info, serr->ee_data,
+                                   !!(serr->ee_code &
+                                      SO_EE_CODE_ZEROCOPY_COPIED));
+    return 0;
+}
+
+static int socket_flush_zero_copy(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    struct pollfd pfd;
+    int ret;
+
+    while (s->zero_copy_done < s->zero_copy_queued) {
+        ret = socket_reap_zero_copy(s);
+        if (ret == -EINTR || ret == 0) {
+            continue;
+        }
+        if (ret != -EAGAIN) {
+            return ret;
+        }
+        /* POLLERR is reported once a notification is queued */
+        pfd.fd = s->fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -errno;
+        }
+        if ((pfd.revents & (POLLHUP | POLLNVAL)) && !(pfd.revents & POLLERR)) {
+            return -EPIPE;
+        }
+    }
+    return 0;
+}
+
+static ssize_t socket_writev_buffer_zero_copy(void *opaque, struct iovec *iov,
+                                              int iovcnt, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t size = iov_size(iov, iovcnt);
+    unsigned int cnt = iovcnt;
+    struct msghdr msg = { 0 };
+    ssize_t len, total = 0;
+    bool copy = false;
+    int ret;
+
+    while (total < size) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        len = sendmsg(s->fd, &msg, copy ? 0 : MSG_ZEROCOPY);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && !copy) {
+                if (s->zero_copy_done == s->zero_copy_queued) {
+                    /*
+                     * Nothing of ours is pinned, waiting won't help: this
+                     * buffer alone is over the limit, copy it instead
+                     */
+                    copy = true;
+                    continue;
+                }
+                /* Over the locked memory limit: let earlier sends finish */
+                ret = socket_flush_zero_copy(s);
+                if (ret < 0) {
+                    return ret;
+                }
+                continue;
+            }
+            return -errno;
+        }
+        if (!copy) {
+            s->zero_copy_queued++;
+        }
+        total += len;
+        /* f->iov is reset after the flush, so it can be changed here */
+        iov_discard_front(&iov, &cnt, len);
+    }
+    return total;
+}
+#endif
+
 static int socket_get_fd(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -205,21 +340,77 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
     return s->file;
 }
 
-static const QEMUFileOps socket_read_ops = {
+/*
+ * The return path shares the socket with the forward file, which owns it;
+ * closing the return path only releases its own state.
+ */
+static int socket_return_close(void *opaque)
+{
+    g_free(opaque);
+    return 0;
+}
+
+static const QEMUFileOps socket_return_read_ops = {
     .get_fd     = socket_get_fd,
     .get_buffer = socket_get_buffer,
-    .close      = socket_close,
+    .close      = socket_return_close,
     .shut_down  = socket_shutdown
-
 };
 
-static const QEMUFileOps socket_write_ops = {
+static const QEMUFileOps socket_return_write_ops = {
     .get_fd        = socket_get_fd,
     .writev_buffer = socket_writev_buffer,
-    .close         = socket_close,
+    .close         = socket_return_close,
     .shut_down     = socket_shutdown
 };
 
+/*
+ * Give a QEMUFile* off the same socket but data in the opposite
+ * direction.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try and open a return */
+        return NULL;
+    }
+
+    reverse = g_new0(QEMUFileSocket, 1);
+    reverse->fd = forward->fd;
+    /* I don't think there's a better way to tell which direction 'this' is */
+    if (forward->file->ops->get_buffer != NULL) {
+        /* being called from the read side, so we need to be able to write */
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_write_ops);
+    } else {
+        reverse->file = qemu_fopen_ops(reverse, &socket_return_read_ops);
+    }
+    return reverse->file;
+}
+
+static const QEMUFileOps socket_read_ops = {
+    .get_fd          = socket_get_fd,
+    .get_buffer      = socket_get_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path
+};
+
+static const QEMUFileOps socket_write_ops = {
+    .get_fd          = socket_get_fd,
+    .writev_buffer   = socket_writev_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path,
+#ifdef QEMU_FILE_ZERO_COPY
+    .enable_zero_copy        = socket_enable_zero_copy,
+    .writev_buffer_zero_copy = socket_writev_buffer_zero_copy,
+    .flush_zero_copy         = socket_flush_zero_copy,
+#endif
+};
+
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 {
     QEMUFileSocket *s;
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/atomic.h"
 #include "qemu/sockets.h"
 #include "qemu/coroutine.h"
 #include "migration/migration.h"
@@ -44,6 +45,18 @@ int qemu_file_shutdown(QEMUFile *f)
     return f->ops->shut_down(f->opaque, true, true);
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -91,6 +104,47 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/* Whether @iov points into f->buf, which is reused after a flush */
+static bool qemu_file_iov_is_buffered(QEMUFile *f, const struct iovec *iov)
+{
+    const uint8_t *base = iov->iov_base;
+
+    return base >= f->buf && base < f->buf + IO_BUF_SIZE;
+}
+
+/*
+ * Write the iovec in order, copying what is in f->buf and sending the
+ * async buffers (guest pages) with zero-copy.
+ */
+static ssize_t qemu_fflush_zero_copy(QEMUFile *f)
+{
+    unsigned int start, i = 0;
+    ssize_t ret, total = 0;
+    bool buffered;
+
+    while (i < f->iovcnt) {
+        start = i;
+        buffered = qemu_file_iov_is_buffered(f, &f->iov[i]);
+        while (i < f->iovcnt &&
+               qemu_file_iov_is_buffered(f, &f->iov[i]) == buffered) {
+            i++;
+        }
+        if (buffered) {
+            ret = f->ops->writev_buffer(f->opaque, f->iov + start, i - start,
+                                        f->pos + total);
+        } else {
+            ret = f->ops->writev_buffer_zero_copy(f->opaque, f->iov + start,
+                                                  i - start, f->pos + total);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        total += ret;
+    }
+
+    return total;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -106,7 +160,9 @@ void qemu_fflush(QEMUFile *f)
     }
 
     if (f->ops->writev_buffer) {
-        if (f->iovcnt > 0) {
+        if (f->iovcnt > 0 && f->zero_copy) {
+            ret = qemu_fflush_zero_copy(f);
+        } else if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
         }
     } else {
@@ -124,6 +180,39 @@ void qemu_fflush(QEMUFile *f)
     }
 }
 
+int qemu_file_enable_zero_copy(QEMUFile *f)
+{
+    int ret;
+
+    if (!f->ops->enable_zero_copy) {
+        return -ENOTSUP;
+    }
+    ret = f->ops->enable_zero_copy(f->opaque);
+    if (!ret) {
+        f->zero_copy = true;
+    }
+    return ret;
+}
+
+/*
+ * Flush @f and wait until the transport is done with every buffer given to
+ * qemu_put_buffer_async(), so that they can be changed again.
+ */
+int qemu_file_flush_zero_copy(QEMUFile *f)
+{
+    int ret;
+
+    qemu_fflush(f);
+    if (!f->zero_copy || qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    ret = f->ops->flush_zero_copy(f->opaque);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags)
 {
     int ret = 0;
@@ -239,6 +328,16 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for @len bytes sent on another connection on behalf of @f, so
+ * rate limiting and the bandwidth estimate still cover them.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->pos += len;
+    f->bytes_xfer += len;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -485,6 +584,16 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Number of bytes that went through the backend so far.  Unlike
+ * qemu_ftell() this does not flush, so another thread may use it to
+ * check that a transfer is making progress.
+ */
+int64_t qemu_file_progress(QEMUFile *f)
+{
+    return atomic_read(&f->pos);
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -32,12 +32,19 @@
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/colo.h"
+#include "migration/multifd.h"
+#include "migration/page-compress.h"
+#include "qemu/mpmc-ring.h"
+#include "migration/postcopy-ram.h"
+#include "sysemu/sysemu.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/queue.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -54,7 +61,11 @@ static uint64_t bitmap_sync_count;
 /***********************************************************/
 /* ram save/restore */
 
-#define RAM_SAVE_FLAG_FULL     0x01 /* Obsolete, not used anymore */
+/*
+ * The obsolete RAM_SAVE_FLAG_FULL isn't accepted by any version, so its
+ * bit is reused; 0x400 would overlap the address on targets with 1K pages.
+ */
+#define RAM_SAVE_FLAG_HOST_PAGE 0x01
 #define RAM_SAVE_FLAG_COMPRESS 0x02
 #define RAM_SAVE_FLAG_MEM_SIZE 0x04
 #define RAM_SAVE_FLAG_PAGE     0x08
@@ -63,6 +74,29 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* The pages sent on the multifd channels so far must be loaded first */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
+
+/* The top byte of the length of a compressed page is its method (0 = zlib) */
+#define RAM_COMPRESS_METHOD_SHIFT      24
+#define RAM_COMPRESS_LEN_MASK          ((1 << RAM_COMPRESS_METHOD_SHIFT) - 1)
+
+/*
+ * A host page record has the number of target pages in it; with the top
+ * bit set they are all zero and no data follows.
+ */
+#define RAM_HOST_PAGE_ZERO             (1U << 31)
+#define RAM_HOST_PAGE_MAX_PAGES        ((1U << 30) >> TARGET_PAGE_BITS)
+/*
+ * Larger host pages are sent as several records of this size, so that the
+ * rate limit is checked between them.
+ */
+#define RAM_HOST_PAGE_CHUNK            (2 * 1024 * 1024)
+/*
+ * A host page with fewer than one in RAM_HOST_PAGE_SPLIT of its target
+ * pages dirty is cheaper to send a target page at a time.
+ */
+#define RAM_HOST_PAGE_SPLIT            8
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -78,7 +112,11 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE.  The pointer is RCU protected, so that the
+     * migration thread can look pages up without taking a lock; lock
+     * serializes replacing it.
+     */
     PageCache *cache;
     QemuMutex lock;
 } XBZRLE;
@@ -102,11 +140,12 @@ static void XBZRLE_cache_unlock(void)
  * called from qmp_migrate_set_cache_size in main thread, possibly while
  * a migration is in progress.
  * A running migration maybe using the cache and might finish during this
- * call, hence changes to the cache are protected by XBZRLE.lock().
+ * call, hence replacing the cache is protected by XBZRLE.lock(); the
+ * old cache is freed once the migration thread can't be using it anymore.
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
+    PageCache *new_cache, *old_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -127,8 +166,9 @@ int64_t xbzrle_cache_resize(int64_t new_size)
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        old_cache = XBZRLE.cache;
+        atomic_rcu_set(&XBZRLE.cache, new_cache);
+        cache_fini_rcu(old_cache);
     }
 
 out_new_size:
@@ -149,6 +189,7 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t postcopy_requests;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -213,6 +254,11 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t ram_postcopy_requests(void)
+{
+    return acct_info.postcopy_requests;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -223,6 +269,8 @@ static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* Incoming pages go to the COLO RAM cache rather than to guest memory */
+static bool ram_cache_enable;
 
 /* used by the search for pages to send */
 struct PageSearchStatus {
@@ -235,77 +283,241 @@ struct PageSearchStatus {
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
+/*
+ * Pages the destination asked for while running in postcopy; they are
+ * sent ahead of the background scan.  The return path thread queues
+ * them, the migration thread consumes them.
+ */
+struct RAMSrcPageRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+};
+
+static QemuMutex src_page_req_mutex;
+static QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
+/* Requests name their RAMBlock only when it changes */
+static RAMBlock *last_req_rb;
+
+/*
+ * Late iterations find a handful of dirty pages in a bitmap of millions,
+ * so the bitmap has a summary with one bit per word of it, which the page
+ * search uses to skip zero words.  Setting a bit of bmap sets the bit of
+ * its word in summary; the summary bits of words that became zero are only
+ * dropped when the search finds them, which is safe because the search and
+ * the sync run in the same thread.
+ */
 static struct BitmapRcu {
     struct rcu_head rcu;
     unsigned long *bmap;
+    unsigned long *summary;
+    /* Chunks whose dirty log must be cleared before they are sent */
+    unsigned long *clear_bmap;
 } *migration_bitmap_rcu;
 
-struct CompressParam {
-    bool start;
-    bool done;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
+/*
+ * Accelerators with manual dirty log protection (KVM) don't re-arm the
+ * dirty log when it is synced; that is done one chunk of guest memory at a
+ * time, right before the first dirty page of the chunk is sent.  So a sync
+ * doesn't write protect all of the guest at once, and pages that are sent
+ * late in the iteration aren't reported again just because they were
+ * written to while the iteration was in progress.
+ */
+#define CLEAR_CHUNK_BITS (30 - TARGET_PAGE_BITS)  /* 1GB, in pages */
+#define CLEAR_CHUNK_SIZE (1ULL << (CLEAR_CHUNK_BITS + TARGET_PAGE_BITS))
+
+static unsigned long *clear_bitmap_new(int64_t pages)
+{
+    return bitmap_new((pages >> CLEAR_CHUNK_BITS) + 1);
+}
+
+static void migration_bitmap_set(struct BitmapRcu *bitmap, long start, long nr)
+{
+    bitmap_set(bitmap->bmap, start, nr);
+    if (nr > 0) {
+        bitmap_set(bitmap->summary, BIT_WORD(start),
+                   BIT_WORD(start + nr - 1) - BIT_WORD(start) + 1);
+    }
+}
+
+/*
+ * Next dirty page in [nr, size) of the migration bitmap, or size if
+ * there is none.  Only the words that the summary lists are looked at.
+ */
+static unsigned long migration_bitmap_find_next(struct BitmapRcu *bitmap,
+                                                unsigned long size,
+                                                unsigned long nr)
+{
+    unsigned long nwords = BITS_TO_LONGS(size);
+    unsigned long w, bits;
+
+    while (nr < size) {
+        w = find_next_bit(bitmap->summary, nwords, BIT_WORD(nr));
+        if (w >= nwords) {
+            break;
+        }
+        if (w > BIT_WORD(nr)) {
+            nr = w * BITS_PER_LONG;
+        }
+        bits = bitmap->bmap[w] & (~0UL << (nr % BITS_PER_LONG));
+        if (bits) {
+            return MIN(w * BITS_PER_LONG + ctzl(bits), size);
+        }
+        if (!bitmap->bmap[w]) {
+            clear_bit(w, bitmap->summary);
+        }
+        nr = (w + 1) * BITS_PER_LONG;
+    }
+
+    return size;
+}
+
+/* Page the migration thread hands to the compression threads */
+typedef struct CompressReq {
     RAMBlock *block;
     ram_addr_t offset;
+} CompressReq;
+
+/*
+ * Compressed pages in the stream format, handed back to the migration
+ * thread a few at a time.  They all belong to last_sent_block, so the
+ * order in which batches reach the stream doesn't matter.
+ */
+typedef struct CompressBatch {
+    QEMUFile *file;
+    int pages;
+} CompressBatch;
+
+/* Pages in a batch; 4 uncompressed pages and headers fit in a QEMUFile */
+#define COMPRESS_BATCH_PAGES 4
+
+struct CompressParam {
+    QemuThread thread;
+    /* fixed for the whole migration, the parameter may change */
+    MigrationCompressMethod method;
+    PageCompress *pc;
+    uint8_t *buf;
+    /* batch being filled, NULL if none */
+    CompressBatch *batch;
 };
 typedef struct CompressParam CompressParam;
 
-struct DecompressParam {
-    bool start;
-    QemuMutex mutex;
-    QemuCond cond;
+/* Compressed page the load thread hands to the decompression threads */
+typedef struct DecompressReq {
     void *des;
-    uint8 *compbuf;
+    uint8_t *compbuf;
     int len;
+    MigrationCompressMethod method;
+} DecompressReq;
+
+struct DecompressParam {
+    QemuThread thread;
+    PageCompress *pc;
 };
 typedef struct DecompressParam DecompressParam;
 
-static CompressParam *comp_param;
-static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
+/*
+ * The compression threads take CompressReqs from comp_req_ring, fill
+ * batches taken from comp_free_ring and put them on comp_done_ring, from
+ * where the migration thread copies them into the stream whenever it
+ * queues a page.  Nobody waits for one thread in particular: the
+ * migration thread only sleeps when comp_req_ring is full, until any
+ * thread completes a batch.
  */
-static QemuMutex *comp_done_lock;
-static QemuCond *comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
+static CompressParam *comp_param;
+/* Used by the migration thread itself for the first page of a block */
+static CompressParam comp_main;
+static CompressBatch *comp_batches;
+static MPMCRing comp_req_ring;
+static MPMCRing comp_done_ring;
+static MPMCRing comp_free_ring;
+/* Pages queued that aren't on comp_done_ring yet */
+static int comp_pending;
+static QemuEvent comp_work_event;
+static QemuEvent comp_done_event;
+static QemuEvent comp_free_event;
+/* The empty QEMUFileOps will be used by file in CompressBatch */
 static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
 static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
-static QemuThread *decompress_threads;
-static uint8_t *compressed_data_buf;
+/* Like the compression side, but the load thread gives buffers to fill */
+static uint8_t **decomp_bufs;
+static MPMCRing decomp_req_ring;
+static MPMCRing decomp_free_ring;
+/* Pages queued that aren't decompressed yet */
+static int decomp_pending;
+static QemuEvent decomp_work_event;
+static QemuEvent decomp_done_event;
+
+static int do_compress_ram_page(CompressParam *param, QEMUFile *f,
+                                RAMBlock *block, ram_addr_t offset);
+
+/* Number of batches: one per thread being filled and as many in flight */
+static int compress_batch_count(void)
+{
+    return migrate_compress_threads() * 2;
+}
+
+static void compress_batch_publish(CompressParam *param)
+{
+    CompressBatch *batch = param->batch;
+    bool ok;
 
-static int do_compress_ram_page(CompressParam *param);
+    if (!batch) {
+        return;
+    }
+    param->batch = NULL;
+    /* Room for all the batches, it can't be full */
+    ok = mpmc_ring_push(&comp_done_ring, &batch);
+    assert(ok);
+    atomic_sub(&comp_pending, batch->pages);
+    qemu_event_set(&comp_done_event);
+}
+
+static bool compress_batch_get(CompressParam *param)
+{
+    while (!mpmc_ring_pop(&comp_free_ring, &param->batch)) {
+        qemu_event_reset(&comp_free_event);
+        if (mpmc_ring_pop(&comp_free_ring, &param->batch)) {
+            break;
+        }
+        if (atomic_read(&quit_comp_thread)) {
+            return false;
+        }
+        qemu_event_wait(&comp_free_event);
+    }
+    return true;
+}
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
-
-    while (!quit_comp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        /* Re-check the quit_comp_thread in case of
-         * terminate_compression_threads is called just before
-         * qemu_mutex_lock(&param->mutex) and after
-         * while(!quit_comp_thread), re-check it here can make
-         * sure the compression thread terminate as expected.
-         */
-        while (!param->start && !quit_comp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
+    CompressReq req;
+
+    while (!atomic_read(&quit_comp_thread)) {
+        if (!mpmc_ring_pop(&comp_req_ring, &req)) {
+            /* Don't sit on pages while idle */
+            compress_batch_publish(param);
+            qemu_event_reset(&comp_work_event);
+            if (mpmc_ring_is_empty(&comp_req_ring) &&
+                !atomic_read(&quit_comp_thread)) {
+                qemu_event_wait(&comp_work_event);
+            }
+            continue;
+        }
+        if (!param->batch && !compress_batch_get(param)) {
+            break;
         }
-        if (!quit_comp_thread) {
-            do_compress_ram_page(param);
+        do_compress_ram_page(param, param->batch->file, req.block, req.offset);
+        if (++param->batch->pages == COMPRESS_BATCH_PAGES) {
+            compress_batch_publish(param);
         }
-        param->start = false;
-        qemu_mutex_unlock(&param->mutex);
-
-        qemu_mutex_lock(comp_done_lock);
-        param->done = true;
-        qemu_cond_signal(comp_done_cond);
-        qemu_mutex_unlock(comp_done_lock);
     }
 
     return NULL;
@@ -313,15 +525,23 @@ static void *do_data_compress(void *opaque)
 
 static inline void terminate_compression_threads(void)
 {
-    int idx, thread_count;
+    atomic_mb_set(&quit_comp_thread, true);
+    qemu_event_set(&comp_work_event);
+    qemu_event_set(&comp_free_event);
+    qemu_event_set(&comp_done_event);
+}
 
-    thread_count = migrate_compress_threads();
-    quit_comp_thread = true;
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
-    }
+static void compress_param_init(CompressParam *param)
+{
+    param->method = migrate_compress_method();
+    param->pc = page_compress_new(param->method);
+    param->buf = g_malloc(TARGET_PAGE_SIZE);
+}
+
+static void compress_param_fini(CompressParam *param)
+{
+    page_compress_free(param->pc);
+    g_free(param->buf);
 }
 
 void migrate_compress_threads_join(void)
@@ -334,48 +554,68 @@ void migrate_compress_threads_join(void)
     terminate_compression_threads();
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
-    }
-    qemu_mutex_destroy(comp_done_lock);
-    qemu_cond_destroy(comp_done_cond);
-    g_free(compress_threads);
+        qemu_thread_join(&comp_param[i].thread);
+        compress_param_fini(&comp_param[i]);
+    }
+    compress_param_fini(&comp_main);
+    qemu_fclose(comp_main.batch->file);
+    g_free(comp_main.batch);
+    comp_main.batch = NULL;
+    for (i = 0; i < compress_batch_count(); i++) {
+        qemu_fclose(comp_batches[i].file);
+    }
+    mpmc_ring_destroy(&comp_req_ring);
+    mpmc_ring_destroy(&comp_done_ring);
+    mpmc_ring_destroy(&comp_free_ring);
+    qemu_event_destroy(&comp_work_event);
+    qemu_event_destroy(&comp_done_event);
+    qemu_event_destroy(&comp_free_event);
+    g_free(comp_batches);
     g_free(comp_param);
-    g_free(comp_done_cond);
-    g_free(comp_done_lock);
-    compress_threads = NULL;
+    comp_batches = NULL;
     comp_param = NULL;
-    comp_done_cond = NULL;
-    comp_done_lock = NULL;
 }
 
 void migrate_compress_threads_create(void)
 {
-    int i, thread_count;
+    int i, thread_count, batch_count;
+    CompressBatch *batch;
 
     if (!migrate_use_compression()) {
         return;
     }
     quit_comp_thread = false;
     compression_switch = true;
+    comp_pending = 0;
     thread_count = migrate_compress_threads();
-    compress_threads = g_new0(QemuThread, thread_count);
+    batch_count = compress_batch_count();
     comp_param = g_new0(CompressParam, thread_count);
-    comp_done_cond = g_new0(QemuCond, 1);
-    comp_done_lock = g_new0(QemuMutex, 1);
-    qemu_cond_init(comp_done_cond);
-    qemu_mutex_init(comp_done_lock);
-    for (i = 0; i < thread_count; i++) {
-        /* com_param[i].file is just used as a dummy buffer to save data, set
-         * it's ops to empty.
+    comp_batches = g_new0(CompressBatch, batch_count);
+    /* Enough requests for every thread to fill a couple of batches */
+    mpmc_ring_init(&comp_req_ring,
+                   pow2ceil(thread_count * COMPRESS_BATCH_PAGES * 2),
+                   sizeof(CompressReq));
+    mpmc_ring_init(&comp_done_ring, pow2ceil(batch_count),
+                   sizeof(CompressBatch *));
+    mpmc_ring_init(&comp_free_ring, pow2ceil(batch_count),
+                   sizeof(CompressBatch *));
+    qemu_event_init(&comp_work_event, false);
+    qemu_event_init(&comp_done_event, false);
+    qemu_event_init(&comp_free_event, false);
+    for (i = 0; i < batch_count; i++) {
+        /* batch files are just used as a dummy buffer to save data, set
+         * their ops to empty.
          */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
-        qemu_thread_create(compress_threads + i, "compress",
+        comp_batches[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        batch = &comp_batches[i];
+        mpmc_ring_push(&comp_free_ring, &batch);
+    }
+    compress_param_init(&comp_main);
+    comp_main.batch = g_new0(CompressBatch, 1);
+    comp_main.batch->file = qemu_fopen_ops(NULL, &empty_ops);
+    for (i = 0; i < thread_count; i++) {
+        compress_param_init(&comp_param[i]);
+        qemu_thread_create(&comp_param[i].thread, "compress",
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
@@ -414,21 +654,34 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
  * transfer pages to the destination then we should be able to complete
  * migration. Some workloads dirty memory way too fast and will not effectively
  * converge, even with auto-converge.
+ *
+ * @dirty and @sent are the bytes dirtied and sent during the same period.
+ * The guest dirtied @dirty while running (100 - throttle)% of the time, so
+ * assuming the dirty rate is proportional to the time it runs, aim for the
+ * throttle at which it dirties half of what is sent.  The parameters limit
+ * the first step and each change, so a noisy period can't over-throttle.
  */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_guest_adjust(uint64_t dirty, uint64_t sent)
 {
     MigrationState *s = migrate_get_current();
-    uint64_t pct_initial =
-            s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
-    uint64_t pct_icrement =
+    int pct_initial = s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
+    int pct_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    int pct_cur = cpu_throttle_get_percentage();
+    int pct;
 
-    /* We have not started throttling yet. Let's start it. */
+    pct = dirty ? 100 - (int)((double)sent / 2 * (100 - pct_cur) / dirty) : 0;
     if (!cpu_throttle_active()) {
-        cpu_throttle_set(pct_initial);
+        pct = MIN(pct, pct_initial);
     } else {
-        /* Throttling already on, just increase the rate */
-        cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+        pct = MAX(MIN(pct, pct_cur + pct_increment), pct_cur - pct_increment);
+    }
+    trace_migration_throttle(pct_cur, pct, dirty, sent);
+
+    if (pct <= 0) {
+        cpu_throttle_stop();
+    } else if (pct != pct_cur) {
+        cpu_throttle_set(pct);
     }
 }
 
@@ -440,14 +693,16 @@ static void mig_throttle_guest_down(void)
  */
 static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 {
+    PageCache *cache;
+
     if (ram_bulk_stage || !migrate_use_xbzrle()) {
         return;
     }
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
-                 bitmap_sync_count);
+    cache = atomic_rcu_read(&XBZRLE.cache);
+    cache_insert(cache, current_addr, ZERO_TARGET_PAGE, bitmap_sync_count);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -472,25 +727,26 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
                             ram_addr_t offset, bool last_stage,
                             uint64_t *bytes_transferred)
 {
+    PageCache *cache = atomic_rcu_read(&XBZRLE.cache);
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
+    if (!cache_is_cached(cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
+            if (cache_insert(cache, current_addr, *current_data,
                              bitmap_sync_count) == -1) {
                 return -1;
             } else {
                 /* update *current_data when the page has been
                    inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
+                *current_data = get_cached_data(cache, current_addr);
             }
         }
         return -1;
     }
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    prev_cached_page = get_cached_data(cache, current_addr);
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
@@ -531,6 +787,48 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     return 1;
 }
 
+/*
+ * Clear the dirty log of the chunk that contains @addr, if it hasn't been
+ * done since the last sync.  Must be called before a page that was found
+ * dirty is read, so that writes after that are not lost.
+ *
+ * Called with rcu_read_lock() to protect migration_bitmap
+ */
+static void migration_clear_dirty_log(ram_addr_t addr)
+{
+    unsigned long *clear_bmap;
+    ram_addr_t start, end;
+    RAMBlock *block;
+    bool locked;
+
+    clear_bmap = atomic_rcu_read(&migration_bitmap_rcu)->clear_bmap;
+    if (!test_and_clear_bit(addr >> (CLEAR_CHUNK_BITS + TARGET_PAGE_BITS),
+                            clear_bmap)) {
+        return;
+    }
+
+    start = addr & ~(CLEAR_CHUNK_SIZE - 1);
+    end = start + CLEAR_CHUNK_SIZE;
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    /* a chunk can span several blocks, clear all of them */
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t s = MAX(start, block->offset);
+        ram_addr_t e = MIN(end, block->offset + block->used_length);
+
+        if (s < e) {
+            memory_region_clear_dirty_bitmap(block->mr, s - block->offset,
+                                             e - s);
+        }
+    }
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    trace_migration_clear_dirty_log(start);
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(RAMBlock *rb,
@@ -540,31 +838,175 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(RAMBlock *rb,
     unsigned long nr = base + (start >> TARGET_PAGE_BITS);
     uint64_t rb_size = rb->used_length;
     unsigned long size = base + (rb_size >> TARGET_PAGE_BITS);
-    unsigned long *bitmap;
+    struct BitmapRcu *bitmap;
 
     unsigned long next;
 
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu);
     if (ram_bulk_stage && nr > base) {
         next = nr + 1;
     } else {
-        next = find_next_bit(bitmap, size, nr);
+        next = migration_bitmap_find_next(bitmap, size, nr);
     }
 
     if (next < size) {
-        clear_bit(next, bitmap);
+        clear_bit(next, bitmap->bmap);
         migration_dirty_pages--;
+        migration_clear_dirty_log(next << TARGET_PAGE_BITS);
     }
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+/* Called with rcu_read_lock() to protect migration_bitmap */
+static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    bool ret = test_and_clear_bit(addr >> TARGET_PAGE_BITS, bitmap);
+
+    if (ret) {
+        migration_dirty_pages--;
+        migration_clear_dirty_log(addr);
+    }
+    return ret;
+}
+
+/*
+ * A sync while the VM is stopped is downtime, so large blocks are split
+ * among a few threads; each of them gets whole words of the bitmaps, so
+ * that they never write the same word of the migration bitmap.
+ */
+#define BITMAP_SYNC_THREADS    4
+#define BITMAP_SYNC_SLICE_MIN  (8ULL << 30)
+
+typedef struct BitmapSyncWorker {
+    QemuThread thread;
+    QemuSemaphore sem;
+    bool quit;
+    unsigned long *dest;
+    unsigned long *summary;
+    ram_addr_t start;
+    ram_addr_t length;
+    uint64_t num_dirty;
+} BitmapSyncWorker;
+
+static BitmapSyncWorker *bitmap_sync_workers;
+static QemuSemaphore bitmap_sync_done_sem;
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncWorker *w = opaque;
+
+    for (;;) {
+        qemu_sem_wait(&w->sem);
+        if (w->quit) {
+            break;
+        }
+        w->num_dirty = cpu_physical_memory_sync_dirty_bitmap(w->dest,
+                                                             w->summary,
+                                                             w->start,
+                                                             w->length);
+        qemu_sem_post(&bitmap_sync_done_sem);
+    }
+
+    return NULL;
+}
+
+static void bitmap_sync_threads_create(void)
+{
+    BitmapSyncWorker *w;
+    int i;
+
+    if (ram_bytes_total() < 2 * BITMAP_SYNC_SLICE_MIN) {
+        return;
+    }
+    qemu_sem_init(&bitmap_sync_done_sem, 0);
+    bitmap_sync_workers = g_new0(BitmapSyncWorker, BITMAP_SYNC_THREADS);
+    for (i = 0; i < BITMAP_SYNC_THREADS; i++) {
+        w = &bitmap_sync_workers[i];
+        qemu_sem_init(&w->sem, 0);
+        qemu_thread_create(&w->thread, "bitmap_sync", bitmap_sync_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void bitmap_sync_threads_join(void)
+{
+    BitmapSyncWorker *w;
+    int i;
+
+    if (!bitmap_sync_workers) {
+        return;
+    }
+    for (i = 0; i < BITMAP_SYNC_THREADS; i++) {
+        w = &bitmap_sync_workers[i];
+        w->quit = true;
+        qemu_sem_post(&w->sem);
+        qemu_thread_join(&w->thread);
+        qemu_sem_destroy(&w->sem);
+    }
+    qemu_sem_destroy(&bitmap_sync_done_sem);
+    g_free(bitmap_sync_workers);
+    bitmap_sync_workers = NULL;
+}
+
+/* The caller syncs the first slice, the workers the others */
+static uint64_t bitmap_sync_parallel(unsigned long *dest,
+                                     unsigned long *summary,
+                                     ram_addr_t start, ram_addr_t length)
+{
+    const ram_addr_t align = (ram_addr_t)BITS_PER_LONG << TARGET_PAGE_BITS;
+    int n = MIN(BITMAP_SYNC_THREADS + 1, length / BITMAP_SYNC_SLICE_MIN);
+    ram_addr_t end = start + length;
+    ram_addr_t bound[BITMAP_SYNC_THREADS + 2];
+    uint64_t num_dirty;
+    BitmapSyncWorker *w;
+    int i;
+
+    bound[0] = start;
+    for (i = 1; i < n; i++) {
+        bound[i] = MIN(ROUND_UP(start + length / n * i, align), end);
+    }
+    bound[n] = end;
+
+    for (i = 1; i < n; i++) {
+        w = &bitmap_sync_workers[i - 1];
+        w->dest = dest;
+        w->summary = summary;
+        w->start = bound[i];
+        w->length = bound[i + 1] - bound[i];
+        qemu_sem_post(&w->sem);
+    }
+    num_dirty = cpu_physical_memory_sync_dirty_bitmap(dest, summary, start,
+                                                      bound[1] - start);
+    for (i = 1; i < n; i++) {
+        qemu_sem_wait(&bitmap_sync_done_sem);
+    }
+    for (i = 1; i < n; i++) {
+        num_dirty += bitmap_sync_workers[i - 1].num_dirty;
+    }
+
+    return num_dirty;
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
-    unsigned long *bitmap;
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    struct BitmapRcu *bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    unsigned long first = start >> (CLEAR_CHUNK_BITS + TARGET_PAGE_BITS);
+    unsigned long last = (start + length - 1) >>
+                         (CLEAR_CHUNK_BITS + TARGET_PAGE_BITS);
+
+    if (bitmap_sync_workers && length >= 2 * BITMAP_SYNC_SLICE_MIN) {
+        migration_dirty_pages += bitmap_sync_parallel(bitmap->bmap,
+                                                      bitmap->summary,
+                                                      start, length);
+    } else {
+        migration_dirty_pages +=
+            cpu_physical_memory_sync_dirty_bitmap(bitmap->bmap,
+                                                  bitmap->summary,
+                                                  start, length);
+    }
+    bitmap_set(bitmap->clear_bmap, first, last - first + 1);
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -583,11 +1025,56 @@ static void migration_bitmap_sync_init(void)
     iterations_prev = 0;
 }
 
-/* Called with iothread lock held, to protect ram_list.dirty_memory[] */
-static void migration_bitmap_sync(void)
+/*
+ * Move the dirty log of all RAM blocks into the migration bitmap and return
+ * the number of pages that became dirty in it.
+ *
+ * Called with iothread lock held, to protect ram_list.dirty_memory[].
+ *
+ * With @yield_iothread, the lock is dropped between chunks of the walk
+ * over dirty_memory[], so that a sync of a large guest doesn't hold up
+ * vCPUs and the monitor for its whole length.  Only for callers that hold
+ * no other lock and can cope with the memory map changing meanwhile.
+ * Otherwise blocks are synced whole, in parallel if they are large.
+ */
+static uint64_t migration_bitmap_sync_dirty_log(bool yield_iothread)
 {
     RAMBlock *block;
+    ram_addr_t offset, len;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
+
+    trace_migration_bitmap_sync_start();
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        for (offset = 0; offset < block->used_length; offset += len) {
+            len = block->used_length - offset;
+            if (yield_iothread) {
+                len = MIN(len, CLEAR_CHUNK_SIZE);
+            }
+            qemu_mutex_lock(&migration_bitmap_mutex);
+            migration_bitmap_sync_range(block->offset + offset, len);
+            qemu_mutex_unlock(&migration_bitmap_mutex);
+            if (yield_iothread) {
+                qemu_mutex_unlock_iothread();
+                qemu_mutex_lock_iothread();
+            }
+        }
+    }
+    rcu_read_unlock();
+
+    trace_migration_bitmap_sync_end(migration_dirty_pages
+                                    - num_dirty_pages_init);
+    return migration_dirty_pages - num_dirty_pages_init;
+}
+
+/*
+ * Sync the dirty log as above, then update the dirty rate statistics and
+ * the auto-converge throttle once a second.
+ */
+static void migration_bitmap_sync(bool yield_iothread)
+{
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
@@ -602,41 +1089,34 @@ static void migration_bitmap_sync(void)
         start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
-    trace_migration_bitmap_sync_start();
-    address_space_sync_dirty_bitmap(&address_space_memory);
-
-    qemu_mutex_lock(&migration_bitmap_mutex);
-    rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
-    }
-    rcu_read_unlock();
-    qemu_mutex_unlock(&migration_bitmap_mutex);
-
-    trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
-    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
+    num_dirty_pages_period += migration_bitmap_sync_dirty_log(yield_iothread);
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens twice, start or increase
-               throttling */
+            /* Start throttling once the dirtied bytes were more than half
+               of the bytes transferred during two periods in a row; from
+               then on, adjust the throttle every period.  Throttling is
+               relaxed when the guest dirties much less than that. */
+            uint64_t dirty = num_dirty_pages_period * TARGET_PAGE_SIZE;
+            uint64_t sent;
+
             bytes_xfer_now = ram_bytes_transferred();
+            sent = bytes_xfer_now - bytes_xfer_prev;
 
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ >= 2)) {
-                    trace_migration_throttle();
+            if (s->dirty_pages_rate && sent && dirty > sent / 2) {
+                if (cpu_throttle_active() || ++dirty_rate_high_cnt >= 2) {
                     dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
-             }
-             bytes_xfer_prev = bytes_xfer_now;
+                    mig_throttle_guest_adjust(dirty, sent);
+                }
+            } else {
+                dirty_rate_high_cnt = 0;
+                if (cpu_throttle_active() && sent && dirty < sent / 4) {
+                    mig_throttle_guest_adjust(dirty, sent);
+                }
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         }
 
         if (migrate_use_xbzrle()) {
@@ -718,8 +1198,6 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         pages = 1;
     }
 
-    XBZRLE_cache_lock();
-
     current_addr = block->offset + offset;
 
     if (block == last_sent_block) {
@@ -740,7 +1218,12 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !migration_in_postcopy(migrate_get_current())) {
+            /*
+             * In postcopy the destination places whole pages atomically,
+             * it has no old copy of the page to apply a delta to.
+             */
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -753,7 +1236,16 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     }
 
     /* XBZRLE overflow or normal page */
-    if (pages == -1) {
+    if (pages == -1 && send_async && multifd_save_active()) {
+        /* Only the page's data goes on a multifd channel */
+        if (multifd_queue_page(block, current_addr - block->offset)) {
+            qemu_file_set_error(f, -EIO);
+        }
+        qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    } else if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_PAGE);
         if (send_async) {
@@ -766,107 +1258,197 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         acct_info.norm_pages++;
     }
 
-    XBZRLE_cache_unlock();
+    return pages;
+}
+
+/* Whether the pages of @block are sent a host page at a time */
+static bool ram_use_host_pages(RAMBlock *block)
+{
+    return block->page_size > TARGET_PAGE_SIZE && migrate_use_host_pages();
+}
+
+/* Called with rcu_read_lock() to protect migration_bitmap */
+static unsigned long migration_bitmap_count_dirty(ram_addr_t start,
+                                                  ram_addr_t end)
+{
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    unsigned long last = end >> TARGET_PAGE_BITS;
+    unsigned long nr = find_next_bit(bitmap, last, start >> TARGET_PAGE_BITS);
+    unsigned long count = 0;
+
+    while (nr < last) {
+        count++;
+        nr = find_next_bit(bitmap, last, nr + 1);
+    }
+    return count;
+}
+
+/**
+ * ram_save_host_page: Send the host page that contains a dirty page
+ *
+ * The host page, or its RAM_HOST_PAGE_CHUNK sized part for larger ones,
+ * is sent whole, with a single header, unless only a few of its target
+ * pages are dirty.  @pss is moved to the last target page sent, so that
+ * the search continues after it.
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: the search status, pointing at the dirty page that was found
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_host_page(QEMUFile *f, PageSearchStatus *pss,
+                              bool last_stage, uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t size = MIN(block->page_size, RAM_HOST_PAGE_CHUNK);
+    ram_addr_t start = pss->offset & ~(size - 1);
+    ram_addr_t end = MIN(start + size, block->used_length);
+    uint32_t pages = (end - start) >> TARGET_PAGE_BITS;
+    ram_addr_t offset, addr;
+    uint64_t bytes_xmit;
+    uint8_t *p;
+    int ret;
+
+    /* In the bulk stage every page is dirty, no need to count */
+    if (!ram_bulk_stage &&
+        (1 + migration_bitmap_count_dirty(block->offset + start,
+                                          block->offset + end)) *
+        RAM_HOST_PAGE_SPLIT < pages) {
+        return ram_save_page(f, block, pss->offset, last_stage,
+                             bytes_transferred);
+    }
+
+    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
+        migration_bitmap_clear_dirty(block->offset + addr);
+    }
+    pss->offset = end - TARGET_PAGE_SIZE;
+
+    p = block->host + start;
+    bytes_xmit = 0;
+    ret = ram_control_save_page(f, block->offset, start, end - start,
+                                &bytes_xmit);
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        *bytes_transferred += bytes_xmit;
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_xmit > 0) {
+                acct_info.norm_pages += pages;
+            } else if (bytes_xmit == 0) {
+                acct_info.dup_pages += pages;
+            }
+        }
+        return pages;
+    }
+
+    offset = start;
+    if (block == last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    *bytes_transferred += save_page_header(f, block,
+                                           offset | RAM_SAVE_FLAG_HOST_PAGE);
+    if (is_zero_range(p, end - start)) {
+        qemu_put_be32(f, pages | RAM_HOST_PAGE_ZERO);
+        *bytes_transferred += 4;
+        acct_info.dup_pages += pages;
+    } else {
+        /* The header and the host page go out in the same writev */
+        qemu_put_be32(f, pages);
+        qemu_put_buffer_async(f, p, end - start);
+        *bytes_transferred += 4 + end - start;
+        acct_info.norm_pages += pages;
+    }
+    trace_ram_save_host_page(block->idstr, (uint64_t)start, pages);
 
     return pages;
 }
 
-static int do_compress_ram_page(CompressParam *param)
+static int do_compress_ram_page(CompressParam *param, QEMUFile *f,
+                                RAMBlock *block, ram_addr_t offset)
 {
-    int bytes_sent, blen;
+    int bytes_sent;
+    ssize_t blen;
     uint8_t *p;
-    RAMBlock *block = param->block;
-    ram_addr_t offset = param->offset;
 
     p = block->host + (offset & TARGET_PAGE_MASK);
 
-    bytes_sent = save_page_header(param->file, block, offset |
+    /* Not worth decompressing unless it saves an eighth of the page */
+    blen = page_compress(param->pc, migrate_compress_level(), param->buf,
+                         TARGET_PAGE_SIZE - TARGET_PAGE_SIZE / 8,
+                         p, TARGET_PAGE_SIZE);
+    if (blen < 0) {
+        bytes_sent = save_page_header(f, block, offset | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        return bytes_sent + TARGET_PAGE_SIZE;
+    }
+
+    bytes_sent = save_page_header(f, block, offset |
                                   RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    bytes_sent += blen;
+    qemu_put_be32(f, blen | param->method << RAM_COMPRESS_METHOD_SHIFT);
+    qemu_put_buffer(f, param->buf, blen);
+    bytes_sent += 4 + blen;
 
     return bytes_sent;
 }
 
-static inline void start_compression(CompressParam *param)
-{
-    param->done = false;
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
-}
+static uint64_t bytes_transferred;
 
-static inline void start_decompression(DecompressParam *param)
+/* Copy the batches the compression threads completed into the stream */
+static uint64_t compress_drain_batches(QEMUFile *f)
 {
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
+    CompressBatch *batch;
+    uint64_t bytes = 0;
+    bool freed = false;
+
+    while (mpmc_ring_pop(&comp_done_ring, &batch)) {
+        bytes += qemu_put_qemu_file(f, batch->file);
+        batch->pages = 0;
+        mpmc_ring_push(&comp_free_ring, &batch);
+        freed = true;
+    }
+    if (freed) {
+        qemu_event_set(&comp_free_event);
+    }
+    return bytes;
 }
 
-static uint64_t bytes_transferred;
-
 static void flush_compressed_data(QEMUFile *f)
 {
-    int idx, len, thread_count;
-
     if (!migrate_use_compression()) {
         return;
     }
-    thread_count = migrate_compress_threads();
-    for (idx = 0; idx < thread_count; idx++) {
-        if (!comp_param[idx].done) {
-            qemu_mutex_lock(comp_done_lock);
-            while (!comp_param[idx].done && !quit_comp_thread) {
-                qemu_cond_wait(comp_done_cond, comp_done_lock);
-            }
-            qemu_mutex_unlock(comp_done_lock);
-        }
-        if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
+    for (;;) {
+        /* Reset before looking, so that no completion is missed */
+        qemu_event_reset(&comp_done_event);
+        bytes_transferred += compress_drain_batches(f);
+        if (!atomic_mb_read(&comp_pending) ||
+            atomic_read(&quit_comp_thread)) {
+            break;
         }
+        qemu_event_wait(&comp_done_event);
     }
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
-}
-
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
                                            uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    CompressReq req = { .block = block, .offset = offset };
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
-                start_compression(&comp_param[idx]);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
+    atomic_inc(&comp_pending);
+    for (;;) {
+        qemu_event_reset(&comp_done_event);
+        *bytes_transferred += compress_drain_batches(f);
+        if (mpmc_ring_push(&comp_req_ring, &req)) {
             break;
-        } else {
-            qemu_cond_wait(comp_done_cond, comp_done_lock);
         }
+        /* All threads are busy, wait for any of them */
+        qemu_event_wait(&comp_done_event);
     }
-    qemu_mutex_unlock(comp_done_lock);
+    qemu_event_set(&comp_work_event);
+    acct_info.norm_pages++;
 
-    return pages;
+    return 1;
 }
 
 /**
@@ -920,13 +1502,13 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
                 /* Use the qemu thread to compress the data to make sure the
                  * first page is sent out before other pages
                  */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
+                do_compress_ram_page(&comp_main, comp_main.batch->file,
+                                     block, offset);
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
+                bytes_xmit = qemu_put_qemu_file(f, comp_main.batch->file);
                 *bytes_transferred += bytes_xmit;
                 pages = 1;
             }
@@ -942,6 +1524,25 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
+/*
+ * Called whenever the next pages found may have been sent already: make the
+ * destination load what the multifd channels carried before going on with
+ * the main stream.
+ */
+static void ram_multifd_sync(QEMUFile *f)
+{
+    if (!multifd_save_active()) {
+        return;
+    }
+    if (multifd_send_sync_main()) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    /* The destination's channels wait until it reads that */
+    qemu_fflush(f);
+}
+
 /*
  * Find the next dirty page and update any state associated with
  * the search process.
@@ -976,6 +1577,7 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
             /* Flag that we've looped */
             pss->complete_round = true;
             ram_bulk_stage = false;
+            ram_multifd_sync(f);
             if (migrate_use_xbzrle()) {
                 /* If xbzrle is on, stop using the data compression at this
                  * point. In theory, xbzrle can do better than compression.
@@ -995,6 +1597,188 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
     }
 }
 
+/*
+ * Take the next page off the postcopy request queue
+ *
+ * Returns: the RAMBlock of the page, NULL if the queue is empty
+ *
+ * @offset: set to the offset of the page within the RAMBlock
+ * @ram_addr_abs: set to the page address in the ram_addr_t space
+ */
+static RAMBlock *unqueue_page(ram_addr_t *offset, ram_addr_t *ram_addr_abs)
+{
+    RAMBlock *block = NULL;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    if (!QSIMPLEQ_EMPTY(&src_page_requests)) {
+        struct RAMSrcPageRequest *entry = QSIMPLEQ_FIRST(&src_page_requests);
+
+        block = entry->rb;
+        *offset = entry->offset;
+        *ram_addr_abs = (entry->offset + entry->rb->offset) &
+                        TARGET_PAGE_MASK;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+            g_free(entry);
+        }
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    return block;
+}
+
+/*
+ * Find the next page requested by the destination that is still dirty,
+ * and point @pss at it; its dirty bit is cleared.
+ *
+ * Called within an RCU critical section.
+ *
+ * Returns: true if a queued page is found
+ */
+static bool get_queued_page(PageSearchStatus *pss)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t dirty_ram_abs;
+    bool dirty = false;
+
+    do {
+        block = unqueue_page(&offset, &dirty_ram_abs);
+        if (block) {
+            /*
+             * A page we've already sent is clean; asking again happens
+             * when the page is still in flight.
+             */
+            dirty = migration_bitmap_clear_dirty(dirty_ram_abs);
+            if (!dirty) {
+                trace_get_queued_page_not_dirty(block->idstr,
+                                                (uint64_t)offset,
+                                                (uint64_t)dirty_ram_abs, 1);
+            } else {
+                trace_get_queued_page(block->idstr, (uint64_t)offset,
+                                      (uint64_t)dirty_ram_abs);
+            }
+        }
+    } while (block && !dirty);
+
+    if (block) {
+        /*
+         * As soon as we start servicing pages out of order, then we have
+         * to kill the bulk stage, since the bulk stage assumes
+         * in (migration_bitmap_find_and_reset_dirty) that every page is
+         * dirty, that's no longer true.
+         */
+        ram_bulk_stage = false;
+
+        pss->block = block;
+        pss->offset = offset;
+    }
+
+    return !!block;
+}
+
+/*
+ * Drop the requests that are left when the migration ends
+ */
+static void flush_page_queue(void)
+{
+    struct RAMSrcPageRequest *mspr, *next_mspr;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_FOREACH_SAFE(mspr, &src_page_requests, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(mspr);
+    }
+    last_req_rb = NULL;
+    qemu_mutex_unlock(&src_page_req_mutex);
+}
+
+/* Called within an RCU critical section */
+RAMBlock *ram_block_by_name(const char *name)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(name, block->idstr)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Queue the pages for transmission, e.g. a request from postcopy
+ * destination.
+ * Called from the return path thread.
+ *
+ * Returns: 0 on success, -1 if the request is invalid
+ *
+ * @rbname: The RAMBlock the request is for - may be NULL (to mean reuse last)
+ * @start: Offset from the start of the RAMBlock
+ * @len: Length (in bytes) to send
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMBlock *ramblock;
+    struct RAMSrcPageRequest *new_entry;
+
+    acct_info.postcopy_requests++;
+    rcu_read_lock();
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = last_req_rb;
+
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        ramblock = ram_block_by_name(rbname);
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        last_req_rb = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (start + len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    new_entry = g_new0(struct RAMSrcPageRequest, 1);
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -1024,13 +1808,22 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     }
 
     do {
-        found = find_dirty_block(f, &pss, &again);
+        again = true;
+        /* Pages the destination is waiting for come first */
+        found = get_queued_page(&pss);
+
+        if (!found) {
+            found = find_dirty_block(f, &pss, &again);
+        }
 
         if (found) {
             if (compression_switch && migrate_use_compression()) {
                 pages = ram_save_compressed_page(f, pss.block, pss.offset,
                                                  last_stage,
                                                  bytes_transferred);
+            } else if (ram_use_host_pages(pss.block)) {
+                pages = ram_save_host_page(f, &pss, last_stage,
+                                           bytes_transferred);
             } else {
                 pages = ram_save_page(f, pss.block, pss.offset, last_stage,
                                       bytes_transferred);
@@ -1097,6 +1890,8 @@ void free_xbzrle_decoded_buf(void)
 static void migration_bitmap_free(struct BitmapRcu *bmap)
 {
     g_free(bmap->bmap);
+    g_free(bmap->summary);
+    g_free(bmap->clear_bmap);
     g_free(bmap);
 }
 
@@ -1111,13 +1906,16 @@ static void migration_end(void)
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
+    bitmap_sync_threads_join();
+
+    flush_page_queue();
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        cache_fini_rcu(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
-        XBZRLE.cache = NULL;
+        atomic_rcu_set(&XBZRLE.cache, NULL);
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
     }
@@ -1126,6 +1924,7 @@ static void migration_end(void)
 
 static void ram_migration_cancel(void *opaque)
 {
+    multifd_save_cleanup(true);
     migration_end();
 }
 
@@ -1149,6 +1948,8 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         struct BitmapRcu *old_bitmap = migration_bitmap_rcu, *bitmap;
         bitmap = g_new(struct BitmapRcu, 1);
         bitmap->bmap = bitmap_new(new);
+        bitmap->summary = bitmap_new(BITS_TO_LONGS(new));
+        bitmap->clear_bmap = clear_bitmap_new(new);
 
         /* prevent migration_bitmap content from being set bit
          * by migration_bitmap_sync_range() at the same time.
@@ -1157,7 +1958,10 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
          */
         qemu_mutex_lock(&migration_bitmap_mutex);
         bitmap_copy(bitmap->bmap, old_bitmap->bmap, old);
-        bitmap_set(bitmap->bmap, old, new - old);
+        bitmap_copy(bitmap->summary, old_bitmap->summary, BITS_TO_LONGS(old));
+        migration_bitmap_set(bitmap, old, new - old);
+        bitmap_copy(bitmap->clear_bmap, old_bitmap->clear_bmap,
+                    (old >> CLEAR_CHUNK_BITS) + 1);
         atomic_rcu_set(&migration_bitmap_rcu, bitmap);
         qemu_mutex_unlock(&migration_bitmap_mutex);
         migration_dirty_pages += new - old;
@@ -1181,11 +1985,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
+    if (migrate_use_multifd() && multifd_save_setup(migrate_get_current())) {
+        return -1;
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+        atomic_rcu_set(&XBZRLE.cache,
+                       cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
+                                  TARGET_PAGE_SIZE));
         if (!XBZRLE.cache) {
             XBZRLE_cache_unlock();
             error_report("Error creating cache");
@@ -1216,12 +2025,15 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     qemu_mutex_lock_ramlist();
     rcu_read_lock();
     bytes_transferred = 0;
+    acct_info.postcopy_requests = 0;
     reset_ram_globals();
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap_rcu = g_new(struct BitmapRcu, 1);
     migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
+    migration_bitmap_rcu->summary = bitmap_new(BITS_TO_LONGS(ram_bitmap_pages));
+    migration_bitmap_set(migration_bitmap_rcu, 0, ram_bitmap_pages);
+    migration_bitmap_rcu->clear_bmap = clear_bitmap_new(ram_bitmap_pages);
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -1230,7 +2042,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
     memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    bitmap_sync_threads_create();
+    migration_bitmap_sync(false);
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
@@ -1262,6 +2075,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     rcu_read_lock();
     if (ram_list.version != last_version) {
         reset_ram_globals();
+        /* The walk over RAM starts over */
+        ram_multifd_sync(f);
     }
 
     /* Read version before ram_list.blocks */
@@ -1320,9 +2135,14 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int64_t start, sync_end;
+    uint64_t total_pages = 0;
+
     rcu_read_lock();
 
-    migration_bitmap_sync();
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    migration_bitmap_sync(false);
+    sync_end = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -1337,14 +2157,31 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         if (pages == 0) {
             break;
         }
+        total_pages += pages;
     }
 
     flush_compressed_data(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+    ram_multifd_sync(f);
+    /* Everything must be on the wire once the final stage returns */
+    if (multifd_save_active() && multifd_send_flush()) {
+        qemu_file_set_error(f, -EIO);
+    }
+
+    migration_checkpoint_record(MIGRATION_CHECKPOINT_BITMAP_SYNC,
+                                sync_end - start);
+    migration_checkpoint_record(MIGRATION_CHECKPOINT_RAM_SEND,
+                                qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                sync_end);
+    migration_checkpoint_record(MIGRATION_CHECKPOINT_PAGES, total_pages);
 
     rcu_read_unlock();
 
-    migration_end();
+    /* COLO keeps tracking dirty pages for the following checkpoints */
+    if (!migrate_colo_enabled()) {
+        multifd_save_cleanup(false);
+        migration_end();
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -1359,7 +2196,7 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     if (remaining_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
-        migration_bitmap_sync();
+        migration_bitmap_sync(true);
         rcu_read_unlock();
         qemu_mutex_unlock_iothread();
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
@@ -1367,6 +2204,125 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     return remaining_size;
 }
 
+/*
+ * Postcopy can only start once every page has been sent at least once:
+ * the destination then has all of RAM except the pages that we tell it
+ * to discard.
+ */
+bool ram_postcopy_can_start(void)
+{
+    return !ram_bulk_stage;
+}
+
+/* Maximum number of ranges in one MIG_CMD_POSTCOPY_RAM_DISCARD */
+#define MAX_DISCARDS_PER_COMMAND 256
+
+/*
+ * Transmit the dirty bitmap as discard commands: those pages were sent
+ * during precopy but have been dirtied since, the destination drops them
+ * and will fault on them.
+ *
+ * Called with the iothread lock held and the VM stopped.
+ *
+ * Returns: 0 on success, negative on error
+ */
+int ram_postcopy_send_discard_bitmap(QEMUFile *f)
+{
+    uint64_t starts[MAX_DISCARDS_PER_COMMAND];
+    uint64_t lengths[MAX_DISCARDS_PER_COMMAND];
+    unsigned long *bitmap;
+    RAMBlock *block;
+
+    trace_ram_postcopy_send_discard_bitmap();
+    rcu_read_lock();
+    migration_bitmap_sync(false);
+
+    /* Restart the background scan from the start of RAM */
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->used_length >> TARGET_PAGE_BITS);
+        unsigned long run_start = find_next_bit(bitmap, last, first);
+        uint16_t nentries = 0;
+
+        while (run_start < last) {
+            unsigned long run_end = find_next_zero_bit(bitmap, last,
+                                                       run_start + 1);
+
+            starts[nentries] = (uint64_t)(run_start - first) <<
+                               TARGET_PAGE_BITS;
+            lengths[nentries] = (uint64_t)(run_end - run_start) <<
+                                TARGET_PAGE_BITS;
+            if (++nentries == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(f, block->idstr,
+                                                      nentries, starts,
+                                                      lengths);
+                nentries = 0;
+            }
+            run_start = find_next_bit(bitmap, last, run_end);
+        }
+
+        if (nentries) {
+            qemu_savevm_send_postcopy_ram_discard(f, block->idstr, nentries,
+                                                  starts, lengths);
+        }
+    }
+    rcu_read_unlock();
+
+    return qemu_file_get_error(f);
+}
+
+/*
+ * Called on the destination when the source tells it to discard a range
+ * of a RAMBlock, see ram_postcopy_send_discard_bitmap()
+ *
+ * Returns: 0 on success, negative on error
+ */
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length)
+{
+    RAMBlock *rb;
+    int ret = -1;
+
+    trace_ram_discard_range(block_name, start, length);
+
+    rcu_read_lock();
+    rb = ram_block_by_name(block_name);
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'",
+                     block_name);
+    } else if ((start | length) & ~TARGET_PAGE_MASK ||
+               start + length > rb->used_length) {
+        error_report("ram_discard_range: Bad range %" PRIx64 "/%zx in %s",
+                     start, length, block_name);
+    } else {
+        ret = postcopy_ram_discard_range(mis, rb->host + start, length);
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+ * Sync the dirty log and return the number of pages waiting to be sent,
+ * i.e. for COLO those dirtied since the last checkpoint.
+ *
+ * This only counts pages: it is not a sync round, so bitmap_sync_count,
+ * the dirty rate and auto-converge are left to the next real sync.  The
+ * pages it finds still go into that sync's dirty rate.
+ * Called with iothread lock held, which is dropped meanwhile.
+ */
+uint64_t ram_dirty_pages_sync(void)
+{
+    num_dirty_pages_period += migration_bitmap_sync_dirty_log(true);
+
+    return ram_save_remaining();
+}
+
 static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 {
     unsigned int xh_len;
@@ -1402,12 +2358,40 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return 0;
 }
 
+/* Must be called from within a rcu critical section.
+ * While COLO is running, a checkpoint is staged in the RAM cache and only
+ * reaches guest memory through colo_flush_ram_cache(); every page loaded
+ * is marked in the migration bitmap so the flush copies just those.
+ */
+static inline void *host_for_load(RAMBlock *block, ram_addr_t offset)
+{
+    struct BitmapRcu *bitmap;
+    unsigned long page;
+
+    if (!ram_cache_enable) {
+        return block->host + offset;
+    }
+
+    if (!block->colo_cache || offset >= block->used_length) {
+        error_report("%s: Bad offset " RAM_ADDR_FMT " for COLO cache of %s",
+                     __func__, offset, block->idstr);
+        return NULL;
+    }
+
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    page = (block->offset + offset) >> TARGET_PAGE_BITS;
+    if (!test_and_set_bit(page, bitmap->bmap)) {
+        set_bit(BIT_WORD(page), bitmap->summary);
+        migration_dirty_pages++;
+    }
+    return block->colo_cache + offset;
+}
+
 /* Must be called from within a rcu critical section.
  * Returns a pointer from within the RCU-protected ram_list.
  */
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, ram_addr_t offset,
+                                              int flags)
 {
     static RAMBlock *block = NULL;
     char id[256];
@@ -1419,7 +2403,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
             return NULL;
         }
 
-        return block->host + offset;
+        return block;
     }
 
     len = qemu_get_byte(f);
@@ -1429,7 +2413,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (!strncmp(id, block->idstr, sizeof(id)) &&
             block->max_length > offset) {
-            return block->host + offset;
+            return block;
         }
     }
 
@@ -1437,6 +2421,60 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/* Must be called from within a rcu critical section.
+ * Returns a pointer from within the RCU-protected ram_list.
+ */
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    RAMBlock *block = ram_block_from_stream(f, offset, flags);
+
+    return block ? host_for_load(block, offset) : NULL;
+}
+
+/*
+ * Load a host page record: @pages target pages from @offset in the block,
+ * all zero if RAM_HOST_PAGE_ZERO is set in @pages.
+ *
+ * Returns: 0 on success, -EINVAL for a bad record
+ */
+static int ram_load_host_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                              uint32_t pages)
+{
+    bool zero = pages & RAM_HOST_PAGE_ZERO;
+    ram_addr_t addr, len;
+    void *host = NULL;
+
+    pages &= ~RAM_HOST_PAGE_ZERO;
+    len = (ram_addr_t)pages << TARGET_PAGE_BITS;
+    if (!pages || pages > RAM_HOST_PAGE_MAX_PAGES ||
+        offset + len > block->used_length) {
+        error_report("Bad host page of %u pages at " RAM_ADDR_FMT " in %s",
+                     pages, offset, block->idstr);
+        return -EINVAL;
+    }
+
+    /* The COLO cache tracks which target pages were loaded */
+    for (addr = offset; addr < offset + len; addr += TARGET_PAGE_SIZE) {
+        void *p = host_for_load(block, addr);
+
+        if (!p) {
+            return -EINVAL;
+        }
+        if (!host) {
+            host = p;
+        }
+    }
+
+    if (zero) {
+        ram_handle_compressed(host, 0, len);
+    } else {
+        qemu_get_buffer(f, host, len);
+    }
+    return 0;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1451,44 +2489,61 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
-
-    while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
+    DecompressReq req;
+
+    while (!atomic_read(&quit_decomp_thread)) {
+        if (!mpmc_ring_pop(&decomp_req_ring, &req)) {
+            qemu_event_reset(&decomp_work_event);
+            if (mpmc_ring_is_empty(&decomp_req_ring) &&
+                !atomic_read(&quit_decomp_thread)) {
+                qemu_event_wait(&decomp_work_event);
             }
-            param->start = false;
+            continue;
         }
-        qemu_mutex_unlock(&param->mutex);
+        /* decompression will fail in some case, especially
+         * when the page is dirted when doing the compression, it's
+         * not a problem because the dirty page will be retransferred
+         * and a failure won't break the data in other pages.
+         */
+        page_decompress(param->pc, req.method, req.des, TARGET_PAGE_SIZE,
+                        req.compbuf, req.len);
+        mpmc_ring_push(&decomp_free_ring, &req.compbuf);
+        atomic_dec(&decomp_pending);
+        qemu_event_set(&decomp_done_event);
     }
 
     return NULL;
 }
 
+/* Compressed pages the load thread can be ahead of the threads by */
+static int decompress_buf_count(void)
+{
+    return pow2ceil(migrate_decompress_threads() * 4);
+}
+
 void migrate_decompress_threads_create(void)
 {
-    int i, thread_count;
+    int i, thread_count, buf_count;
 
     thread_count = migrate_decompress_threads();
-    decompress_threads = g_new0(QemuThread, thread_count);
+    buf_count = decompress_buf_count();
     decomp_param = g_new0(DecompressParam, thread_count);
-    compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+    decomp_bufs = g_new0(uint8_t *, buf_count);
+    /* There are only as many requests as buffers */
+    mpmc_ring_init(&decomp_req_ring, buf_count, sizeof(DecompressReq));
+    mpmc_ring_init(&decomp_free_ring, buf_count, sizeof(uint8_t *));
+    qemu_event_init(&decomp_work_event, false);
+    qemu_event_init(&decomp_done_event, false);
     quit_decomp_thread = false;
+    decomp_pending = 0;
+    for (i = 0; i < buf_count; i++) {
+        decomp_bufs[i] = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        mpmc_ring_push(&decomp_free_ring, &decomp_bufs[i]);
+    }
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        qemu_thread_create(decompress_threads + i, "decompress",
+        /* the method of each page comes from the stream */
+        decomp_param[i].pc = page_compress_new(MIGRATION_COMPRESS_METHOD_ZLIB);
+        qemu_thread_create(&decomp_param[i].thread, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
@@ -1498,47 +2553,140 @@ void migrate_decompress_threads_join(void)
 {
     int i, thread_count;
 
-    quit_decomp_thread = true;
+    atomic_mb_set(&quit_decomp_thread, true);
+    qemu_event_set(&decomp_work_event);
     thread_count = migrate_decompress_threads();
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+        qemu_thread_join(&decomp_param[i].thread);
+        page_compress_free(decomp_param[i].pc);
     }
-    for (i = 0; i < thread_count; i++) {
-        qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        g_free(decomp_param[i].compbuf);
+    for (i = 0; i < decompress_buf_count(); i++) {
+        g_free(decomp_bufs[i]);
     }
-    g_free(decompress_threads);
+    mpmc_ring_destroy(&decomp_req_ring);
+    mpmc_ring_destroy(&decomp_free_ring);
+    qemu_event_destroy(&decomp_work_event);
+    qemu_event_destroy(&decomp_done_event);
     g_free(decomp_param);
-    g_free(compressed_data_buf);
-    decompress_threads = NULL;
+    g_free(decomp_bufs);
     decomp_param = NULL;
-    compressed_data_buf = NULL;
+    decomp_bufs = NULL;
+}
+
+/* A buffer for the next compressed page, once any thread is done with one */
+static uint8_t *decompress_get_buf(void)
+{
+    uint8_t *compbuf;
+
+    for (;;) {
+        qemu_event_reset(&decomp_done_event);
+        if (mpmc_ring_pop(&decomp_free_ring, &compbuf)) {
+            return compbuf;
+        }
+        qemu_event_wait(&decomp_done_event);
+    }
 }
 
 static void decompress_data_with_multi_threads(uint8_t *compbuf,
-                                               void *host, int len)
+                                               void *host, int len,
+                                               MigrationCompressMethod method)
 {
-    int idx, thread_count;
+    DecompressReq req = {
+        .des = host,
+        .compbuf = compbuf,
+        .len = len,
+        .method = method,
+    };
+    bool ok;
+
+    atomic_inc(&decomp_pending);
+    /* Room for all the buffers, it can't be full */
+    ok = mpmc_ring_push(&decomp_req_ring, &req);
+    assert(ok);
+    qemu_event_set(&decomp_work_event);
+}
 
-    thread_count = migrate_decompress_threads();
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (!decomp_param[idx].start) {
-                memcpy(decomp_param[idx].compbuf, compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
+/* Pages must be complete before the guest or the next section sees them */
+static void wait_for_decompress_done(void)
+{
+    while (atomic_mb_read(&decomp_pending)) {
+        qemu_event_reset(&decomp_done_event);
+        if (atomic_mb_read(&decomp_pending)) {
+            qemu_event_wait(&decomp_done_event);
+        }
+    }
+}
+
+/*
+ * Load the RAM sections that arrive once the guest runs on the destination:
+ * pages can't be written in place, the guest could see half of one, they
+ * are assembled in a temporary page and placed atomically.
+ *
+ * Must be called from within a rcu critical section.
+ */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    int flags = 0, ret = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    void *page_buffer = postcopy_get_tmp_page(mis);
+
+    if (!page_buffer) {
+        return -ENOMEM;
+    }
+
+    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+        ram_addr_t addr;
+        void *host;
+        uint8_t ch;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        trace_ram_load_postcopy_loop((uint64_t)addr, flags);
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_COMPRESS:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
                 break;
             }
-        }
-        if (idx < thread_count) {
+            ch = qemu_get_byte(f);
+            if (ch == 0) {
+                ret = postcopy_place_page_zero(mis, host);
+            } else {
+                memset(page_buffer, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, page_buffer);
+            }
+            break;
+        case RAM_SAVE_FLAG_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
+            ret = qemu_file_get_error(f);
+            if (!ret) {
+                ret = postcopy_place_page(mis, host, page_buffer);
+            }
+            break;
+        case RAM_SAVE_FLAG_EOS:
+            /* normal exit */
             break;
+        default:
+            error_report("Unknown combination of migration flags: %#x"
+                         " (postcopy mode)", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
         }
     }
+
+    return ret;
 }
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
@@ -1546,6 +2694,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    unsigned int method;
+    uint8_t *compbuf;
 
     seq_iter++;
 
@@ -1559,8 +2709,15 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      * critical section.
      */
     rcu_read_lock();
+    if (!ret && postcopy_state_get() >= POSTCOPY_INCOMING_LISTENING) {
+        ret = ram_load_postcopy(f);
+        rcu_read_unlock();
+        return ret;
+    }
+
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        RAMBlock *block;
         void *host;
         uint8_t ch;
 
@@ -1573,7 +2730,6 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
             while (!ret && total_ram_bytes) {
-                RAMBlock *block;
                 char id[256];
                 ram_addr_t length;
 
@@ -1635,13 +2791,23 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            method = (uint32_t)len >> RAM_COMPRESS_METHOD_SHIFT;
+            len &= RAM_COMPRESS_LEN_MASK;
+            if (method >= MIGRATION_COMPRESS_METHOD_MAX ||
+                !page_compress_available(method)) {
+                error_report("Unsupported page compression method %u",
+                             method);
+                ret = -EINVAL;
+                break;
+            }
+            if (len > compressBound(TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, compressed_data_buf, len);
-            decompress_data_with_multi_threads(compressed_data_buf, host, len);
+            compbuf = decompress_get_buf();
+            qemu_get_buffer(f, compbuf, len);
+            decompress_data_with_multi_threads(compbuf, host, len, method);
             break;
         case RAM_SAVE_FLAG_XBZRLE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1657,6 +2823,18 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_HOST_PAGE:
+            block = ram_block_from_stream(f, addr, flags);
+            if (!block) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            ret = ram_load_host_page(f, block, addr, qemu_get_be32(f));
+            break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1674,12 +2852,131 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    wait_for_decompress_done();
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
 }
 
+/*
+ * colo_init_ram_cache: allocate the secondary's RAM cache
+ *
+ * Each RAMBlock gets a copy of the guest memory as loaded by the initial
+ * migration, i.e. the state of the primary at the start of COLO.  Dirty
+ * logging is started so the pages the secondary writes between two
+ * checkpoints can be reverted by colo_flush_ram_cache().
+ *
+ * Returns 0 on success, -ENOMEM if a cache can not be allocated.
+ *
+ * Called with iothread lock held, before the secondary VM starts.
+ */
+int colo_init_ram_cache(void)
+{
+    RAMBlock *block;
+    int64_t ram_bitmap_pages;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        block->colo_cache = qemu_anon_ram_alloc(block->used_length, NULL);
+        if (!block->colo_cache) {
+            error_report("%s: Can't alloc memory for COLO cache of block %s,"
+                         " size 0x" RAM_ADDR_FMT, __func__, block->idstr,
+                         block->used_length);
+            goto out_locked;
+        }
+        memcpy(block->colo_cache, block->host, block->used_length);
+    }
+    rcu_read_unlock();
+
+    qemu_mutex_init(&migration_bitmap_mutex);
+    ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    migration_bitmap_rcu = g_new(struct BitmapRcu, 1);
+    migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
+    migration_bitmap_rcu->summary = bitmap_new(BITS_TO_LONGS(ram_bitmap_pages));
+    migration_bitmap_rcu->clear_bmap = clear_bitmap_new(ram_bitmap_pages);
+    migration_dirty_pages = 0;
+    ram_bulk_stage = false;
+
+    memory_global_dirty_log_start();
+    ram_cache_enable = true;
+    return 0;
+
+out_locked:
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->colo_cache) {
+            qemu_anon_ram_free(block->colo_cache, block->used_length);
+            block->colo_cache = NULL;
+        }
+    }
+    rcu_read_unlock();
+    return -ENOMEM;
+}
+
+/* Whether the secondary stages checkpoints in its RAM cache */
+bool colo_ram_cache_enabled(void)
+{
+    return ram_cache_enable;
+}
+
+/* Called with iothread lock held, once COLO is over on the secondary */
+void colo_release_ram_cache(void)
+{
+    RAMBlock *block;
+
+    ram_cache_enable = false;
+    migration_end();
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block->colo_cache) {
+            qemu_anon_ram_free(block->colo_cache, block->used_length);
+            block->colo_cache = NULL;
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * colo_flush_ram_cache: apply a fully received checkpoint to guest memory
+ *
+ * Copies from the cache every page either sent by the primary for this
+ * checkpoint or dirtied by the secondary since the previous one, which
+ * leaves guest memory identical to the primary's at the checkpoint.
+ *
+ * Called with iothread lock held and the secondary VM stopped.
+ */
+void colo_flush_ram_cache(void)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        migration_bitmap_sync_range(block->offset, block->used_length);
+    }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+    trace_colo_flush_ram_cache_begin(migration_dirty_pages);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        offset = 0;
+        while (true) {
+            offset = migration_bitmap_find_and_reset_dirty(block, offset);
+            if (offset >= block->used_length) {
+                break;
+            }
+            memcpy(block->host + offset, block->colo_cache + offset,
+                   TARGET_PAGE_SIZE);
+        }
+    }
+    rcu_read_unlock();
+    assert(migration_dirty_pages == 0);
+    trace_colo_flush_ram_cache_end();
+}
+
 static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
@@ -1692,5 +2989,6 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&src_page_req_mutex);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
@@ -19,6 +19,7 @@
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "migration/migration.h"
+#include "migration/multifd.h"
 #include "migration/qemu-file.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
@@ -66,7 +67,12 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
+    if (c >= 0 && migrate_use_multifd()) {
+        /* The multifd channels connect to the same socket */
+        multifd_recv_accept_channels(s);
+    } else {
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -20,6 +20,7 @@
 #include "qemu/sockets.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/multifd.h"
 #include "migration/qemu-file.h"
 #include "block/block.h"
 
@@ -66,7 +67,12 @@ static void unix_accept_incoming_migration(void *opaque)
         err = errno;
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    close(s);
+    if (c >= 0 && migrate_use_multifd()) {
+        /* The multifd channels connect to the same socket */
+        multifd_recv_accept_channels(s);
+    } else {
+        close(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -12,6 +12,175 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "qemu/host-utils.h"
+#include "qemu/cpuid.h"
+
+/*
+ * The encoder looks for the end of each zrun and nzrun with one of these:
+ * they return the first index from @i on where old_buf and new_buf are
+ * different (resp. equal), or @slen.
+ */
+typedef int (XbzrleRunFunc)(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen);
+
+static int xbzrle_zrun_end(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+/* SSE2 is always there on x86_64, compare 16 bytes at a time */
+static int xbzrle_zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                                int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (eq != 0xFFFF) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                                int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq != 0xFFFFFFFF) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#pragma GCC pop_options
+#endif
+
+static XbzrleRunFunc *xbzrle_zrun_end_fn = xbzrle_zrun_end;
+static XbzrleRunFunc *xbzrle_nzrun_end_fn = xbzrle_nzrun_end;
+
+static void __attribute__((constructor)) init_xbzrle_encode(void)
+{
+#ifdef __SSE2__
+    xbzrle_zrun_end_fn = xbzrle_zrun_end_sse2;
+    xbzrle_nzrun_end_fn = xbzrle_nzrun_end_sse2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (host_cpu_has_avx2()) {
+        xbzrle_zrun_end_fn = xbzrle_zrun_end_avx2;
+        xbzrle_nzrun_end_fn = xbzrle_nzrun_end_avx2;
+    }
+#endif
+}
 
 /*
   page = zrun nzrun
@@ -22,14 +191,17 @@
   nzrun = length byte...
 
   length = uleb128 encoded integer
+
+  Runs are always as long as they can be, so all the variants of the run
+  search produce the same encoding.
  */
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    XbzrleRunFunc *zrun_end = xbzrle_zrun_end_fn;
+    XbzrleRunFunc *nzrun_end = xbzrle_nzrun_end_fn;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +212,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        start = i;
+        i = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = i - start;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,51 +228,22 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        start = i;
+        i = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = i - start;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
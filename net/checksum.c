@@ -54,6 +54,21 @@ uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
     return net_checksum_finish(sum);
 }
 
+/*
+ * Incremental checksum update (RFC 1624) for a 32-bit field covered by
+ * @csum going from @from to @to, without summing the whole packet again.
+ * @csum is taken and returned in network byte order, @from and @to in
+ * host byte order.
+ */
+uint16_t net_checksum_update32(uint16_t csum, uint32_t from, uint32_t to)
+{
+    uint32_t sum = (uint16_t)~be16_to_cpu(csum);
+
+    sum += (uint16_t)~(from >> 16) + (uint16_t)~(from & 0xFFFF);
+    sum += (to >> 16) + (to & 0xFFFF);
+    return cpu_to_be16(net_checksum_finish(sum));
+}
+
 void net_checksum_calculate(uint8_t *data, int length)
 {
     int hlen, plen, proto, csum_offset;
@@ -0,0 +1,462 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * Compares the packets sent by the primary and the secondary guests and
+ * only asks for a checkpoint when they diverge.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "net/filter.h"
+#include "net/net.h"
+#include "net/eth.h"
+#include "net/colo.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qemu/iov.h"
+#include "qapi/qmp/qerror.h"
+#include "qom/object.h"
+#include "sysemu/char.h"
+#include "migration/colo.h"
+#include "trace.h"
+
+#define TYPE_FILTER_COLO_COMPARE "colo-compare"
+
+#define FILTER_COLO_COMPARE(obj) \
+    OBJECT_CHECK(CompareState, (obj), TYPE_FILTER_COLO_COMPARE)
+
+/* Period of the check for primary packets left without a counterpart */
+#define REGULAR_PACKET_CHECK_MS 100
+
+/* Age after which a primary packet with no counterpart forces a checkpoint */
+#define PACKET_MAX_WAIT_MS 3000
+
+typedef struct Packet {
+    uint8_t *data;
+    int size;
+    /* Start of the bytes that must be identical on both sides */
+    int payload_offset;
+    /* TCP flags, compared on top of the payload */
+    uint8_t tcp_flags;
+    int64_t creation_ms;
+    /* Primary only: where to send the packet once released */
+    NetClientState *sender;
+    unsigned flags;
+} Packet;
+
+typedef struct Connection {
+    /* Packets waiting for their counterpart, in the order they were sent */
+    GQueue primary_list;
+    GQueue secondary_list;
+    uint8_t ip_proto;
+} Connection;
+
+typedef struct CompareState {
+    NetFilterState parent_obj;
+
+    char *secondary_in;
+    CharDriverState *chr_sec_in;
+    SocketReadState sec_rs;
+
+    /* ConnectionKey -> Connection */
+    GHashTable *connection_track_table;
+    QEMUTimer check_timer;
+    Notifier checkpoint_notifier;
+} CompareState;
+
+static Packet *packet_new(const void *data, int size)
+{
+    Packet *pkt = g_new0(Packet, 1);
+
+    pkt->data = g_memdup(data, size);
+    pkt->size = size;
+    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    return pkt;
+}
+
+static void packet_destroy(void *opaque, void *user_data)
+{
+    Packet *pkt = opaque;
+
+    g_free(pkt->data);
+    g_free(pkt);
+}
+
+static void connection_destroy(void *opaque)
+{
+    Connection *conn = opaque;
+
+    g_queue_foreach(&conn->primary_list, packet_destroy, NULL);
+    g_queue_clear(&conn->primary_list);
+    g_queue_foreach(&conn->secondary_list, packet_destroy, NULL);
+    g_queue_clear(&conn->secondary_list);
+    g_free(conn);
+}
+
+/*
+ * Fill @key and the comparison offsets of @pkt.  Packets we can't make
+ * sense of are compared as a whole under the all-zero key.
+ */
+static void packet_parse(Packet *pkt, ConnectionKey *key)
+{
+    tcp_header *tcp;
+    int l4_offset;
+
+    pkt->payload_offset = 0;
+    pkt->tcp_flags = 0;
+
+    if (parse_packet_early(pkt->data, pkt->size, key, &l4_offset) < 0) {
+        return;
+    }
+
+    /*
+     * The IP header (id, ttl, checksum) legitimately differs between the
+     * two guests; so do the TCP sequence numbers, window and options.
+     */
+    switch (key->ip_proto) {
+    case IP_PROTO_TCP:
+        if (pkt->size < l4_offset + sizeof(tcp_header)) {
+            break;
+        }
+        tcp = (tcp_header *)(pkt->data + l4_offset);
+        pkt->tcp_flags = be16_to_cpu(tcp->th_offset_flags) & 0x3f;
+        pkt->payload_offset = MIN(pkt->size, l4_offset +
+                        ((be16_to_cpu(tcp->th_offset_flags) >> 12) << 2));
+        return;
+    case IP_PROTO_UDP:
+        if (pkt->size < l4_offset + sizeof(udp_header)) {
+            break;
+        }
+        pkt->payload_offset = l4_offset + sizeof(udp_header);
+        return;
+    default:
+        /* ICMP and the rest: everything above the IP header must match */
+        break;
+    }
+    pkt->payload_offset = l4_offset;
+}
+
+static bool colo_packet_match(Packet *ppkt, Packet *spkt)
+{
+    int plen = ppkt->size - ppkt->payload_offset;
+    int slen = spkt->size - spkt->payload_offset;
+
+    if (plen != slen || ppkt->tcp_flags != spkt->tcp_flags) {
+        return false;
+    }
+    return !memcmp(ppkt->data + ppkt->payload_offset,
+                   spkt->data + spkt->payload_offset, plen);
+}
+
+static void colo_release_primary_packet(CompareState *s, Packet *pkt)
+{
+    struct iovec iov = {
+        .iov_base = pkt->data,
+        .iov_len = pkt->size,
+    };
+
+    qemu_netfilter_pass_to_next(pkt->sender, pkt->flags, &iov, 1,
+                                NETFILTER(s));
+    packet_destroy(pkt, NULL);
+}
+
+/*
+ * Release the matching heads of the connection queues.  Stops at the
+ * first mismatch, which stays queued until the checkpoint it triggers
+ * flushes the connection.
+ */
+static void colo_compare_connection(CompareState *s, Connection *conn)
+{
+    Packet *ppkt, *spkt;
+
+    while (!g_queue_is_empty(&conn->primary_list) &&
+           !g_queue_is_empty(&conn->secondary_list)) {
+        ppkt = g_queue_peek_head(&conn->primary_list);
+        spkt = g_queue_peek_head(&conn->secondary_list);
+
+        if (!colo_packet_match(ppkt, spkt)) {
+            trace_colo_compare_miscompare(conn->ip_proto, ppkt->size,
+                                          spkt->size);
+            colo_checkpoint_notify();
+            return;
+        }
+
+        g_queue_pop_head(&conn->primary_list);
+        g_queue_pop_head(&conn->secondary_list);
+        packet_destroy(spkt, NULL);
+        colo_release_primary_packet(s, ppkt);
+    }
+}
+
+static void colo_flush_connection(void *key, void *value, void *opaque)
+{
+    CompareState *s = opaque;
+    Connection *conn = value;
+    Packet *pkt;
+
+    while ((pkt = g_queue_pop_head(&conn->primary_list))) {
+        colo_release_primary_packet(s, pkt);
+    }
+    g_queue_foreach(&conn->secondary_list, packet_destroy, NULL);
+    g_queue_clear(&conn->secondary_list);
+}
+
+/*
+ * Once the secondary has caught up with a checkpoint, whatever the
+ * primary sent before it is committed and may leave.
+ */
+static void colo_compare_flush(CompareState *s)
+{
+    g_hash_table_foreach(s->connection_track_table, colo_flush_connection, s);
+}
+
+static Connection *colo_compare_get_connection(CompareState *s,
+                                               ConnectionKey *key)
+{
+    Connection *conn;
+
+    conn = g_hash_table_lookup(s->connection_track_table, key);
+    if (conn) {
+        return conn;
+    }
+
+    if (g_hash_table_size(s->connection_track_table) >= HASHTABLE_MAX_SIZE) {
+        trace_colo_compare_table_reset(HASHTABLE_MAX_SIZE);
+        colo_compare_flush(s);
+        g_hash_table_remove_all(s->connection_track_table);
+    }
+
+    conn = g_new0(Connection, 1);
+    g_queue_init(&conn->primary_list);
+    g_queue_init(&conn->secondary_list);
+    conn->ip_proto = key->ip_proto;
+    g_hash_table_insert(s->connection_track_table,
+                        g_memdup(key, sizeof(*key)), conn);
+    return conn;
+}
+
+static void colo_compare_secondary_packet(SocketReadState *rs)
+{
+    CompareState *s = container_of(rs, CompareState, sec_rs);
+    ConnectionKey key;
+    Connection *conn;
+    Packet *pkt;
+
+    if (!migration_in_colo_state()) {
+        /* Nothing to compare against */
+        return;
+    }
+
+    pkt = packet_new(rs->buf, rs->packet_len);
+    packet_parse(pkt, &key);
+    conn = colo_compare_get_connection(s, &key);
+    g_queue_push_tail(&conn->secondary_list, pkt);
+    colo_compare_connection(s, conn);
+}
+
+static int compare_chr_can_read(void *opaque)
+{
+    return NET_BUFSIZE;
+}
+
+static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
+{
+    CompareState *s = opaque;
+
+    if (net_fill_rstate(&s->sec_rs, buf, size) < 0) {
+        error_report("colo-compare: bad packet from secondary_in, "
+                     "resynchronizing");
+        net_socket_rs_init(&s->sec_rs, colo_compare_secondary_packet);
+    }
+}
+
+static void colo_check_connection(void *key, void *value, void *opaque)
+{
+    Connection *conn = value;
+    bool *stale = opaque;
+    Packet *pkt = g_queue_peek_head(&conn->primary_list);
+
+    if (pkt && qemu_clock_get_ms(QEMU_CLOCK_HOST) - pkt->creation_ms >
+               PACKET_MAX_WAIT_MS) {
+        *stale = true;
+    }
+}
+
+static void colo_compare_check_timer(void *opaque)
+{
+    CompareState *s = opaque;
+    bool stale = false;
+
+    if (!migration_in_colo_state()) {
+        /* COLO is over, do not hold anything back anymore */
+        colo_compare_flush(s);
+    } else {
+        /* The secondary did not produce the same output in time */
+        g_hash_table_foreach(s->connection_track_table,
+                             colo_check_connection, &stale);
+        if (stale) {
+            colo_checkpoint_notify();
+        }
+    }
+
+    timer_mod(&s->check_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_HOST) + REGULAR_PACKET_CHECK_MS);
+}
+
+static void colo_compare_checkpoint_notify(Notifier *notifier, void *data)
+{
+    CompareState *s = container_of(notifier, CompareState,
+                                   checkpoint_notifier);
+
+    colo_compare_flush(s);
+}
+
+/* filter APIs */
+static ssize_t colo_compare_receive_iov(NetFilterState *nf,
+                                        NetClientState *sender,
+                                        unsigned flags,
+                                        const struct iovec *iov,
+                                        int iovcnt,
+                                        NetPacketSent *sent_cb)
+{
+    CompareState *s = FILTER_COLO_COMPARE(nf);
+    size_t size = iov_size(iov, iovcnt);
+    ConnectionKey key;
+    Connection *conn;
+    Packet *pkt;
+
+    /* Only the output of the guest is compared */
+    if (sender == nf->netdev || !migration_in_colo_state()) {
+        return 0;
+    }
+
+    pkt = g_new0(Packet, 1);
+    pkt->data = g_malloc(size);
+    pkt->size = iov_to_buf(iov, iovcnt, 0, pkt->data, size);
+    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    pkt->sender = sender;
+    pkt->flags = flags;
+
+    packet_parse(pkt, &key);
+    conn = colo_compare_get_connection(s, &key);
+    g_queue_push_tail(&conn->primary_list, pkt);
+    colo_compare_connection(s, conn);
+
+    /* The packet is ours now, sent_cb must not be called */
+    return size;
+}
+
+static void colo_compare_cleanup(NetFilterState *nf)
+{
+    CompareState *s = FILTER_COLO_COMPARE(nf);
+
+    if (s->chr_sec_in) {
+        qemu_chr_add_handlers(s->chr_sec_in, NULL, NULL, NULL, NULL);
+        qemu_chr_fe_release(s->chr_sec_in);
+        s->chr_sec_in = NULL;
+    }
+
+    if (s->connection_track_table) {
+        timer_del(&s->check_timer);
+        colo_remove_checkpoint_notifier(&s->checkpoint_notifier);
+        colo_compare_flush(s);
+        g_hash_table_destroy(s->connection_track_table);
+        s->connection_track_table = NULL;
+    }
+}
+
+static void colo_compare_setup(NetFilterState *nf, Error **errp)
+{
+    CompareState *s = FILTER_COLO_COMPARE(nf);
+
+    if (!s->secondary_in) {
+        error_setg(errp, QERR_MISSING_PARAMETER, "secondary_in");
+        return;
+    }
+
+    s->chr_sec_in = qemu_chr_find(s->secondary_in);
+    if (!s->chr_sec_in) {
+        error_setg(errp, "Character device '%s' not found", s->secondary_in);
+        return;
+    }
+    if (qemu_chr_fe_claim(s->chr_sec_in) != 0) {
+        error_setg(errp, QERR_DEVICE_IN_USE, s->secondary_in);
+        s->chr_sec_in = NULL;
+        return;
+    }
+
+    net_socket_rs_init(&s->sec_rs, colo_compare_secondary_packet);
+    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                      connection_key_equal,
+                                                      g_free,
+                                                      connection_destroy);
+
+    s->checkpoint_notifier.notify = colo_compare_checkpoint_notify;
+    colo_add_checkpoint_notifier(&s->checkpoint_notifier);
+
+    timer_init_ms(&s->check_timer, QEMU_CLOCK_HOST,
+                  colo_compare_check_timer, s);
+    timer_mod(&s->check_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_HOST) + REGULAR_PACKET_CHECK_MS);
+
+    qemu_chr_add_handlers(s->chr_sec_in, compare_chr_can_read,
+                          compare_sec_chr_in, NULL, s);
+}
+
+static void colo_compare_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    nfc->setup = colo_compare_setup;
+    nfc->cleanup = colo_compare_cleanup;
+    nfc->receive_iov = colo_compare_receive_iov;
+}
+
+static char *compare_get_secondary_in(Object *obj, Error **errp)
+{
+    CompareState *s = FILTER_COLO_COMPARE(obj);
+
+    return g_strdup(s->secondary_in);
+}
+
+static void compare_set_secondary_in(Object *obj, const char *value,
+                                     Error **errp)
+{
+    CompareState *s = FILTER_COLO_COMPARE(obj);
+
+    g_free(s->secondary_in);
+    s->secondary_in = g_strdup(value);
+}
+
+static void colo_compare_init(Object *obj)
+{
+    object_property_add_str(obj, "secondary_in",
+                            compare_get_secondary_in, compare_set_secondary_in,
+                            NULL);
+}
+
+static void colo_compare_finalize(Object *obj)
+{
+    CompareState *s = FILTER_COLO_COMPARE(obj);
+
+    g_free(s->secondary_in);
+}
+
+static const TypeInfo colo_compare_info = {
+    .name = TYPE_FILTER_COLO_COMPARE,
+    .parent = TYPE_NETFILTER,
+    .class_init = colo_compare_class_init,
+    .instance_init = colo_compare_init,
+    .instance_finalize = colo_compare_finalize,
+    .instance_size = sizeof(CompareState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&colo_compare_info);
+}
+
+type_init(register_types);
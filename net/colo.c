@@ -0,0 +1,101 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * Connection tracking shared by the COLO network filters.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "net/colo.h"
+#include "net/eth.h"
+#include "qemu/bitops.h"
+
+/*
+ * Fill @key from the headers of the ethernet frame @data and point
+ * @l4_offset at its transport header.  Ports are only filled for TCP and
+ * UDP, when their header is within @size.
+ *
+ * Returns 0 for IPv4 packets, -1 otherwise with @key all zero.
+ */
+int parse_packet_early(const uint8_t *data, int size, ConnectionKey *key,
+                       int *l4_offset)
+{
+    const struct ip_header *ip;
+    const tcp_header *tcp;
+    const udp_header *udp;
+    int l2hdr_len, l3hdr_len;
+
+    memset(key, 0, sizeof(*key));
+
+    if (size < sizeof(struct eth_header) + 2 * sizeof(struct vlan_header)) {
+        return -1;
+    }
+    l2hdr_len = eth_get_l2_hdr_length(data);
+    /* The innermost ethertype sits right before the L3 header */
+    if (lduw_be_p(data + l2hdr_len - 2) != ETH_P_IP ||
+        size < l2hdr_len + sizeof(struct ip_header)) {
+        return -1;
+    }
+
+    ip = (const struct ip_header *)(data + l2hdr_len);
+    l3hdr_len = IP_HDR_GET_LEN(ip);
+    if (l3hdr_len < sizeof(struct ip_header) ||
+        size < l2hdr_len + l3hdr_len) {
+        return -1;
+    }
+    *l4_offset = l2hdr_len + l3hdr_len;
+
+    key->src = ip->ip_src;
+    key->dst = ip->ip_dst;
+    key->ip_proto = ip->ip_p;
+
+    switch (ip->ip_p) {
+    case IP_PROTO_TCP:
+        if (size >= *l4_offset + sizeof(tcp_header)) {
+            tcp = (const tcp_header *)(data + *l4_offset);
+            key->src_port = tcp->th_sport;
+            key->dst_port = tcp->th_dport;
+        }
+        break;
+    case IP_PROTO_UDP:
+        if (size >= *l4_offset + sizeof(udp_header)) {
+            udp = (const udp_header *)(data + *l4_offset);
+            key->src_port = udp->uh_sport;
+            key->dst_port = udp->uh_dport;
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* Turn the key of one direction of a connection into the other's */
+void connection_key_reverse(ConnectionKey *key)
+{
+    uint32_t addr = key->src;
+    uint16_t port = key->src_port;
+
+    key->src = key->dst;
+    key->dst = addr;
+    key->src_port = key->dst_port;
+    key->dst_port = port;
+}
+
+guint connection_key_hash(gconstpointer opaque)
+{
+    const ConnectionKey *key = opaque;
+    uint32_t h;
+
+    h = key->src ^ rol32(key->dst, 11) ^
+        rol32(key->src_port | ((uint32_t)key->dst_port << 16), 23) ^
+        key->ip_proto;
+    return h * 0x9e3779b1;
+}
+
+gboolean connection_key_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(ConnectionKey));
+}
@@ -0,0 +1,34 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * Connection tracking shared by the COLO network filters.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_COLO_H
+#define QEMU_NET_COLO_H
+
+#include "qemu-common.h"
+
+/* Past this many tracked connections a filter flushes its table */
+#define HASHTABLE_MAX_SIZE 16384
+
+/* All zero for the packets that are not IPv4 */
+typedef struct ConnectionKey {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t ip_proto;
+} QEMU_PACKED ConnectionKey;
+
+int parse_packet_early(const uint8_t *data, int size, ConnectionKey *key,
+                       int *l4_offset);
+void connection_key_reverse(ConnectionKey *key);
+guint connection_key_hash(gconstpointer opaque);
+gboolean connection_key_equal(gconstpointer a, gconstpointer b);
+
+#endif /* QEMU_NET_COLO_H */
@@ -0,0 +1,372 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * filter-mirror copies the packets of a netdev to a chardev, and
+ * filter-redirector moves packets between a netdev and chardevs.  On the
+ * chardevs each packet is preceded by its length as a 32-bit big-endian
+ * integer.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "net/filter.h"
+#include "net/net.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qapi/qmp/qerror.h"
+#include "qom/object.h"
+#include "sysemu/char.h"
+#include "trace.h"
+
+#define TYPE_FILTER_MIRROR "filter-mirror"
+#define TYPE_FILTER_REDIRECTOR "filter-redirector"
+
+#define FILTER_MIRROR(obj) \
+    OBJECT_CHECK(MirrorState, (obj), TYPE_FILTER_MIRROR)
+#define FILTER_REDIRECTOR(obj) \
+    OBJECT_CHECK(MirrorState, (obj), TYPE_FILTER_REDIRECTOR)
+
+/* Past this many pending bytes, the batch is written out right away */
+#define MIRROR_BATCH_MAX_SIZE (1 * 1024 * 1024)
+
+typedef struct MirrorState {
+    NetFilterState parent_obj;
+
+    char *indev;
+    char *outdev;
+    CharDriverState *chr_in;
+    CharDriverState *chr_out;
+    SocketReadState rs;
+
+    /*
+     * Packets for chr_out accumulate here, with their length prefix, and
+     * go out in a single write once the main loop is done with the
+     * current batch of packets.
+     */
+    uint8_t *batch;
+    size_t batch_len;
+    size_t batch_size;
+    QEMUBH *flush_bh;
+} MirrorState;
+
+static void filter_mirror_flush(MirrorState *s)
+{
+    int ret;
+
+    if (!s->batch_len) {
+        return;
+    }
+
+    ret = qemu_chr_fe_write_all(s->chr_out, s->batch, s->batch_len);
+    if (ret != s->batch_len) {
+        error_report("filter %s: failed to write %zu bytes to chardev %s",
+                     object_get_canonical_path_component(OBJECT(s)),
+                     s->batch_len, s->outdev);
+    }
+    trace_filter_mirror_flush(s->batch_len);
+    s->batch_len = 0;
+}
+
+static void filter_mirror_flush_bh(void *opaque)
+{
+    filter_mirror_flush(opaque);
+}
+
+static void filter_mirror_queue(MirrorState *s, const struct iovec *iov,
+                                int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t len = cpu_to_be32(size);
+
+    if (s->batch_len + sizeof(len) + size > s->batch_size) {
+        s->batch_size = MAX(s->batch_size * 2,
+                            s->batch_len + sizeof(len) + size);
+        s->batch = g_realloc(s->batch, s->batch_size);
+    }
+
+    memcpy(s->batch + s->batch_len, &len, sizeof(len));
+    s->batch_len += sizeof(len);
+    iov_to_buf(iov, iovcnt, 0, s->batch + s->batch_len, size);
+    s->batch_len += size;
+
+    if (s->batch_len >= MIRROR_BATCH_MAX_SIZE) {
+        filter_mirror_flush(s);
+    } else {
+        qemu_bh_schedule(s->flush_bh);
+    }
+}
+
+/* Inject a packet read from chr_in as if it went through this filter */
+static void filter_redirector_send(SocketReadState *rs)
+{
+    MirrorState *s = container_of(rs, MirrorState, rs);
+    NetFilterState *nf = NETFILTER(s);
+    struct iovec iov = {
+        .iov_base = rs->buf,
+        .iov_len = rs->packet_len,
+    };
+
+    if (nf->direction == NET_FILTER_DIRECTION_ALL ||
+        nf->direction == NET_FILTER_DIRECTION_TX) {
+        /* Towards the guest */
+        qemu_netfilter_pass_to_next(nf->netdev, 0, &iov, 1, nf);
+    }
+
+    if ((nf->direction == NET_FILTER_DIRECTION_ALL ||
+         nf->direction == NET_FILTER_DIRECTION_RX) && nf->netdev->peer) {
+        /* Out of the netdev */
+        qemu_netfilter_pass_to_next(nf->netdev->peer, 0, &iov, 1, nf);
+    }
+}
+
+static int redirector_chr_can_read(void *opaque)
+{
+    return NET_BUFSIZE;
+}
+
+static void redirector_chr_read(void *opaque, const uint8_t *buf, int size)
+{
+    MirrorState *s = opaque;
+
+    if (net_fill_rstate(&s->rs, buf, size) < 0) {
+        error_report("filter %s: bad packet from chardev %s, "
+                     "resynchronizing",
+                     object_get_canonical_path_component(OBJECT(s)),
+                     s->indev);
+        net_socket_rs_init(&s->rs, filter_redirector_send);
+    }
+}
+
+/* filter APIs */
+static ssize_t filter_mirror_receive_iov(NetFilterState *nf,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         NetPacketSent *sent_cb)
+{
+    MirrorState *s = FILTER_MIRROR(nf);
+
+    filter_mirror_queue(s, iov, iovcnt);
+    /* The packet itself goes on untouched */
+    return 0;
+}
+
+static ssize_t filter_redirector_receive_iov(NetFilterState *nf,
+                                             NetClientState *sender,
+                                             unsigned flags,
+                                             const struct iovec *iov,
+                                             int iovcnt,
+                                             NetPacketSent *sent_cb)
+{
+    MirrorState *s = FILTER_REDIRECTOR(nf);
+
+    if (!s->chr_out) {
+        return 0;
+    }
+
+    filter_mirror_queue(s, iov, iovcnt);
+    /* The packet now belongs to outdev, sent_cb must not be called */
+    return iov_size(iov, iovcnt);
+}
+
+static void filter_mirror_cleanup_out(MirrorState *s)
+{
+    if (s->chr_out) {
+        qemu_bh_delete(s->flush_bh);
+        s->flush_bh = NULL;
+        filter_mirror_flush(s);
+        qemu_chr_fe_release(s->chr_out);
+        s->chr_out = NULL;
+    }
+    g_free(s->batch);
+    s->batch = NULL;
+    s->batch_len = s->batch_size = 0;
+}
+
+static void filter_mirror_cleanup(NetFilterState *nf)
+{
+    filter_mirror_cleanup_out(FILTER_MIRROR(nf));
+}
+
+static void filter_redirector_cleanup(NetFilterState *nf)
+{
+    MirrorState *s = FILTER_REDIRECTOR(nf);
+
+    if (s->chr_in) {
+        qemu_chr_add_handlers(s->chr_in, NULL, NULL, NULL, NULL);
+        qemu_chr_fe_release(s->chr_in);
+        s->chr_in = NULL;
+    }
+    filter_mirror_cleanup_out(s);
+}
+
+static CharDriverState *filter_mirror_claim_chardev(const char *name,
+                                                    Error **errp)
+{
+    CharDriverState *chr = qemu_chr_find(name);
+
+    if (!chr) {
+        error_setg(errp, "Character device '%s' not found", name);
+        return NULL;
+    }
+    if (qemu_chr_fe_claim(chr) != 0) {
+        error_setg(errp, QERR_DEVICE_IN_USE, name);
+        return NULL;
+    }
+    return chr;
+}
+
+static void filter_mirror_setup_out(MirrorState *s, Error **errp)
+{
+    s->chr_out = filter_mirror_claim_chardev(s->outdev, errp);
+    if (s->chr_out) {
+        s->flush_bh = qemu_bh_new(filter_mirror_flush_bh, s);
+    }
+}
+
+static void filter_mirror_setup(NetFilterState *nf, Error **errp)
+{
+    MirrorState *s = FILTER_MIRROR(nf);
+
+    if (!s->outdev) {
+        error_setg(errp, QERR_MISSING_PARAMETER, "outdev");
+        return;
+    }
+
+    filter_mirror_setup_out(s, errp);
+}
+
+static void filter_redirector_setup(NetFilterState *nf, Error **errp)
+{
+    MirrorState *s = FILTER_REDIRECTOR(nf);
+    Error *local_err = NULL;
+
+    if (!s->indev && !s->outdev) {
+        error_setg(errp, "filter redirector needs 'indev' or "
+                   "'outdev' at least one property set");
+        return;
+    }
+    if (s->indev && s->outdev && !strcmp(s->indev, s->outdev)) {
+        error_setg(errp, "'indev' and 'outdev' could not be same "
+                   "for filter redirector");
+        return;
+    }
+
+    if (s->indev) {
+        s->chr_in = filter_mirror_claim_chardev(s->indev, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        net_socket_rs_init(&s->rs, filter_redirector_send);
+        qemu_chr_add_handlers(s->chr_in, redirector_chr_can_read,
+                              redirector_chr_read, NULL, s);
+    }
+
+    if (s->outdev) {
+        filter_mirror_setup_out(s, errp);
+    }
+}
+
+static void filter_mirror_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    nfc->setup = filter_mirror_setup;
+    nfc->cleanup = filter_mirror_cleanup;
+    nfc->receive_iov = filter_mirror_receive_iov;
+}
+
+static void filter_redirector_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    nfc->setup = filter_redirector_setup;
+    nfc->cleanup = filter_redirector_cleanup;
+    nfc->receive_iov = filter_redirector_receive_iov;
+}
+
+static char *filter_mirror_get_indev(Object *obj, Error **errp)
+{
+    MirrorState *s = (MirrorState *)obj;
+
+    return g_strdup(s->indev);
+}
+
+static void filter_mirror_set_indev(Object *obj, const char *value,
+                                    Error **errp)
+{
+    MirrorState *s = (MirrorState *)obj;
+
+    g_free(s->indev);
+    s->indev = g_strdup(value);
+}
+
+static char *filter_mirror_get_outdev(Object *obj, Error **errp)
+{
+    MirrorState *s = (MirrorState *)obj;
+
+    return g_strdup(s->outdev);
+}
+
+static void filter_mirror_set_outdev(Object *obj, const char *value,
+                                     Error **errp)
+{
+    MirrorState *s = (MirrorState *)obj;
+
+    g_free(s->outdev);
+    s->outdev = g_strdup(value);
+}
+
+static void filter_mirror_init(Object *obj)
+{
+    object_property_add_str(obj, "outdev", filter_mirror_get_outdev,
+                            filter_mirror_set_outdev, NULL);
+}
+
+static void filter_redirector_init(Object *obj)
+{
+    object_property_add_str(obj, "indev", filter_mirror_get_indev,
+                            filter_mirror_set_indev, NULL);
+    object_property_add_str(obj, "outdev", filter_mirror_get_outdev,
+                            filter_mirror_set_outdev, NULL);
+}
+
+static void filter_mirror_fini(Object *obj)
+{
+    MirrorState *s = (MirrorState *)obj;
+
+    g_free(s->indev);
+    g_free(s->outdev);
+}
+
+static const TypeInfo filter_mirror_info = {
+    .name = TYPE_FILTER_MIRROR,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_mirror_class_init,
+    .instance_init = filter_mirror_init,
+    .instance_finalize = filter_mirror_fini,
+    .instance_size = sizeof(MirrorState),
+};
+
+static const TypeInfo filter_redirector_info = {
+    .name = TYPE_FILTER_REDIRECTOR,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_redirector_class_init,
+    .instance_init = filter_redirector_init,
+    .instance_finalize = filter_mirror_fini,
+    .instance_size = sizeof(MirrorState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&filter_mirror_info);
+    type_register_static(&filter_redirector_info);
+}
+
+type_init(register_types);
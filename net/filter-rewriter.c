@@ -0,0 +1,281 @@
+/*
+ * COarse-grain LOck-stepping Virtual Machines for Non-stop Service (COLO)
+ * (a.k.a. Fault Tolerance or Continuous Replication)
+ *
+ * Rewrites the TCP sequence numbers of the secondary guest so that its
+ * connections line up with the primary's.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "net/filter.h"
+#include "net/net.h"
+#include "net/eth.h"
+#include "net/checksum.h"
+#include "net/colo.h"
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "qom/object.h"
+#include "migration/colo.h"
+#include "trace.h"
+
+#define TYPE_FILTER_REWRITER "filter-rewriter"
+
+#define FILTER_COLO_REWRITER(obj) \
+    OBJECT_CHECK(RewriterState, (obj), TYPE_FILTER_REWRITER)
+
+/*
+ * Room for the headers that are looked at: a virtio-net header, Ethernet
+ * with two VLAN tags, IPv4 with options and the fixed part of TCP
+ */
+#define REWRITER_HDR_MAX 128
+
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_ACK 0x10
+
+/*
+ * The secondary picks its own initial sequence numbers, while its peers
+ * only ever talk to the primary.  Once the offset between the two ISNs is
+ * known, the sequence numbers the secondary sends are shifted into the
+ * primary's space and the acknowledgements it receives are shifted back.
+ */
+typedef struct RewriterConnection {
+    /* Sequence number of the SYN the secondary sent */
+    uint32_t isn;
+    /* Primary's sequence numbers minus the secondary's */
+    uint32_t offset;
+    bool offset_known;
+} RewriterConnection;
+
+typedef struct RewriterState {
+    NetFilterState parent_obj;
+
+    /* ConnectionKey, as sent by the guest -> RewriterConnection */
+    GHashTable *connection_track_table;
+    Notifier checkpoint_notifier;
+} RewriterState;
+
+/*
+ * With a partial checksum (VIRTIO_NET_HDR_F_NEEDS_CSUM) th_sum only holds
+ * the pseudo-header sum, which the sequence numbers are not part of; the
+ * device finishes it later.  Otherwise the checksum is updated
+ * incrementally, so the payload needn't be summed again.
+ */
+static void rewriter_update_seq(tcp_header *tcp, uint32_t *field,
+                                uint32_t value, bool csum_partial)
+{
+    uint32_t old = be32_to_cpu(*field);
+
+    *field = cpu_to_be32(value);
+    if (!csum_partial) {
+        tcp->th_sum = net_checksum_update32(tcp->th_sum, old, value);
+    }
+}
+
+/* Packet sent by the secondary guest; returns true if it was changed */
+static bool rewriter_handle_outgoing(RewriterState *s, ConnectionKey *key,
+                                     tcp_header *tcp, bool csum_partial)
+{
+    uint8_t flags = be16_to_cpu(tcp->th_offset_flags) & 0x3f;
+    RewriterConnection *conn;
+
+    if (flags & TCP_FLAG_SYN) {
+        /* Opening or answering: a new sequence space starts here */
+        if (g_hash_table_size(s->connection_track_table) >=
+            HASHTABLE_MAX_SIZE) {
+            g_hash_table_remove_all(s->connection_track_table);
+        }
+        conn = g_new0(RewriterConnection, 1);
+        conn->isn = be32_to_cpu(tcp->th_seq);
+        g_hash_table_replace(s->connection_track_table,
+                             g_memdup(key, sizeof(*key)), conn);
+        return false;
+    }
+
+    conn = g_hash_table_lookup(s->connection_track_table, key);
+    if (!conn || !conn->offset_known) {
+        return false;
+    }
+
+    rewriter_update_seq(tcp, &tcp->th_seq,
+                        be32_to_cpu(tcp->th_seq) + conn->offset,
+                        csum_partial);
+    if (flags & TCP_FLAG_RST) {
+        g_hash_table_remove(s->connection_track_table, key);
+    }
+    return true;
+}
+
+/*
+ * Packet sent to the secondary guest, originally meant for the primary;
+ * returns true if it was changed
+ */
+static bool rewriter_handle_incoming(RewriterState *s, ConnectionKey *key,
+                                     tcp_header *tcp, bool csum_partial)
+{
+    uint8_t flags = be16_to_cpu(tcp->th_offset_flags) & 0x3f;
+    RewriterConnection *conn;
+
+    connection_key_reverse(key);
+    conn = g_hash_table_lookup(s->connection_track_table, key);
+    if (!conn || !(flags & TCP_FLAG_ACK)) {
+        return false;
+    }
+
+    if (!conn->offset_known) {
+        /* The peer acknowledges the primary's SYN, whose seq is ISN + 1 */
+        conn->offset = be32_to_cpu(tcp->th_ack) - 1 - conn->isn;
+        conn->offset_known = true;
+        trace_colo_filter_rewriter_conn_offset(conn->offset);
+    }
+
+    rewriter_update_seq(tcp, &tcp->th_ack,
+                        be32_to_cpu(tcp->th_ack) - conn->offset,
+                        csum_partial);
+    if (flags & TCP_FLAG_RST) {
+        g_hash_table_remove(s->connection_track_table, key);
+    }
+    return true;
+}
+
+/*
+ * Rewrite the headers of a packet, copied to @data, which start with a
+ * virtio-net header if the netdev uses one.  Returns how many bytes of
+ * @data were rewritten, 0 if the packet wasn't changed.
+ */
+static size_t rewriter_process(RewriterState *s, NetClientState *sender,
+                               uint8_t *data, size_t size)
+{
+    NetFilterState *nf = NETFILTER(s);
+    int vnet_hdr_len = qemu_get_using_vnet_hdr_len(nf->netdev);
+    bool csum_partial = false;
+    bool changed;
+    ConnectionKey key;
+    tcp_header *tcp;
+    int l4_offset;
+
+    if (vnet_hdr_len) {
+        struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)data;
+
+        if (size < vnet_hdr_len) {
+            return 0;
+        }
+        csum_partial = hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        data += vnet_hdr_len;
+        size -= vnet_hdr_len;
+    }
+
+    if (parse_packet_early(data, size, &key, &l4_offset) < 0 ||
+        key.ip_proto != IP_PROTO_TCP ||
+        size < l4_offset + sizeof(tcp_header)) {
+        return 0;
+    }
+
+    tcp = (tcp_header *)(data + l4_offset);
+    if (sender == nf->netdev) {
+        changed = rewriter_handle_incoming(s, &key, tcp, csum_partial);
+    } else {
+        changed = rewriter_handle_outgoing(s, &key, tcp, csum_partial);
+    }
+    return changed ? vnet_hdr_len + l4_offset + sizeof(tcp_header) : 0;
+}
+
+/* filter APIs */
+static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         const struct iovec *iov,
+                                         int iovcnt,
+                                         NetPacketSent *sent_cb)
+{
+    RewriterState *s = FILTER_COLO_REWRITER(nf);
+    uint8_t hdr[REWRITER_HDR_MAX];
+    size_t size = iov_size(iov, iovcnt);
+    size_t hdr_len;
+    struct iovec *out;
+    unsigned int cnt;
+
+    if (!iovcnt) {
+        return 0;
+    }
+
+    /*
+     * The iovec belongs to the sender, and for virtio it is guest memory:
+     * rewrite a copy of the headers and send that on ourselves, followed
+     * by the rest of the original packet.
+     */
+    hdr_len = iov_to_buf(iov, iovcnt, 0, hdr, sizeof(hdr));
+    hdr_len = rewriter_process(s, sender, hdr, hdr_len);
+    if (!hdr_len) {
+        return 0;
+    }
+    out = g_new(struct iovec, iovcnt + 1);
+    out[0].iov_base = hdr;
+    out[0].iov_len = hdr_len;
+    cnt = iov_copy(out + 1, iovcnt, iov, iovcnt, hdr_len, size - hdr_len);
+    qemu_netfilter_pass_to_next(sender, flags, out, cnt + 1, nf);
+    g_free(out);
+
+    return size;
+}
+
+/*
+ * After a checkpoint the secondary runs on the primary's TCP state, its
+ * sequence numbers need no translation anymore.
+ */
+static void colo_rewriter_checkpoint_notify(Notifier *notifier, void *data)
+{
+    RewriterState *s = container_of(notifier, RewriterState,
+                                    checkpoint_notifier);
+
+    g_hash_table_remove_all(s->connection_track_table);
+}
+
+static void colo_rewriter_cleanup(NetFilterState *nf)
+{
+    RewriterState *s = FILTER_COLO_REWRITER(nf);
+
+    if (s->connection_track_table) {
+        colo_remove_checkpoint_notifier(&s->checkpoint_notifier);
+        g_hash_table_destroy(s->connection_track_table);
+        s->connection_track_table = NULL;
+    }
+}
+
+static void colo_rewriter_setup(NetFilterState *nf, Error **errp)
+{
+    RewriterState *s = FILTER_COLO_REWRITER(nf);
+
+    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                      connection_key_equal,
+                                                      g_free,
+                                                      g_free);
+    s->checkpoint_notifier.notify = colo_rewriter_checkpoint_notify;
+    colo_add_checkpoint_notifier(&s->checkpoint_notifier);
+}
+
+static void colo_rewriter_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    nfc->setup = colo_rewriter_setup;
+    nfc->cleanup = colo_rewriter_cleanup;
+    nfc->receive_iov = colo_rewriter_receive_iov;
+}
+
+static const TypeInfo colo_rewriter_info = {
+    .name = TYPE_FILTER_REWRITER,
+    .parent = TYPE_NETFILTER,
+    .class_init = colo_rewriter_class_init,
+    .instance_size = sizeof(RewriterState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&colo_rewriter_info);
+}
+
+type_init(register_types);
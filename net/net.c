@@ -45,6 +45,7 @@
 #include "qapi/dealloc-visitor.h"
 #include "sysemu/sysemu.h"
 #include "net/filter.h"
+#include "standard-headers/linux/virtio_net.h"
 
 /* Net bridge is currently not supported for W32. */
 #if !defined(_WIN32)
@@ -501,6 +502,7 @@ void qemu_using_vnet_hdr(NetClientState *nc, bool enable)
     }
 
     nc->info->using_vnet_hdr(nc, enable);
+    nc->using_vnet_hdr = enable;
 }
 
 void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
@@ -520,6 +522,20 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     }
 
     nc->info->set_vnet_hdr_len(nc, len);
+    nc->vnet_hdr_len = len;
+}
+
+/*
+ * Length of the virtio-net header in front of the packets exchanged with
+ * @nc, or 0 if there is none.  Until a length is set, backends use the
+ * plain struct virtio_net_hdr.
+ */
+int qemu_get_using_vnet_hdr_len(NetClientState *nc)
+{
+    if (!nc || !nc->using_vnet_hdr) {
+        return 0;
+    }
+    return nc->vnet_hdr_len ? nc->vnet_hdr_len : sizeof(struct virtio_net_hdr);
 }
 
 int qemu_set_vnet_le(NetClientState *nc, bool is_le)
@@ -1489,6 +1505,73 @@ int net_client_parse(QemuOptsList *opts_list, const char *optarg)
     return 0;
 }
 
+void net_socket_rs_init(SocketReadState *rs,
+                        SocketReadStateFinalize *finalize)
+{
+    rs->state = 0;
+    rs->index = 0;
+    rs->packet_len = 0;
+    memset(rs->buf, 0, sizeof(rs->buf));
+    rs->finalize = finalize;
+}
+
+/*
+ * Returns
+ *   0: success
+ *  -1: error occurs
+ */
+int net_fill_rstate(SocketReadState *rs, const uint8_t *buf, int size)
+{
+    unsigned int l;
+
+    while (size > 0) {
+        /* reassemble a packet from the network */
+        switch (rs->state) {
+        case 0:
+            l = 4 - rs->index;
+            if (l > size) {
+                l = size;
+            }
+            memcpy(rs->buf + rs->index, buf, l);
+            buf += l;
+            size -= l;
+            rs->index += l;
+            if (rs->index == 4) {
+                /* got length */
+                rs->packet_len = ntohl(*(uint32_t *)rs->buf);
+                rs->index = 0;
+                rs->state = 1;
+            }
+            break;
+        case 1:
+            l = rs->packet_len - rs->index;
+            if (l > size) {
+                l = size;
+            }
+            if (rs->index + l <= sizeof(rs->buf)) {
+                memcpy(rs->buf + rs->index, buf, l);
+            } else {
+                error_report("serious error: oversized packet received");
+                rs->index = rs->state = 0;
+                return -1;
+            }
+
+            rs->index += l;
+            buf += l;
+            size -= l;
+            if (rs->index >= rs->packet_len) {
+                rs->index = 0;
+                rs->state = 0;
+                if (rs->finalize) {
+                    rs->finalize(rs);
+                }
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
 /* From FreeBSD */
 /* XXX: optimize */
 unsigned compute_mcast_idx(const uint8_t *ep)
@@ -22,6 +22,7 @@
 #include <glib.h>
 
 #include "qemu-common.h"
+#include "qemu/rcu.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -35,25 +36,37 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
-typedef struct CacheItem CacheItem;
+/*
+ * The cache is set associative: the address of a page selects a set, and
+ * the page may be kept in any of the ways of that set.  When all of them
+ * are in use, the least recently used one is replaced.
+ */
+#define CACHE_WAYS 8
 
-struct CacheItem {
-    uint64_t it_addr;
-    uint64_t it_age;
-    uint8_t *it_data;
-};
+#define CACHE_ADDR_INVALID ((uint64_t)-1)
+
+/* Kept apart from the page data, a lookup only touches these */
+typedef struct CacheSet {
+    uint64_t it_addr[CACHE_WAYS];
+    uint64_t it_age[CACHE_WAYS];
+} CacheSet;
 
 struct PageCache {
-    CacheItem *page_cache;
+    struct rcu_head rcu;
+    CacheSet *sets;
+    /* all the pages, way w of set s being number s * ways + w */
+    uint8_t *data;
     unsigned int page_size;
+    unsigned int ways;
+    int64_t num_sets;
     int64_t max_num_items;
-    uint64_t max_item_age;
     int64_t num_items;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 {
     int64_t i;
+    int w;
 
     PageCache *cache;
 
@@ -63,7 +76,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -75,24 +88,29 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(CACHE_WAYS, num_pages);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %" PRId64 " of %u ways\n",
+            cache->num_sets, cache->ways);
 
     /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
-        DPRINTF("Failed to allocate cache->page_cache\n");
+    cache->sets = g_try_malloc(cache->num_sets * sizeof(*cache->sets));
+    cache->data = g_try_malloc(cache->max_num_items * page_size);
+    if (!cache->sets || !cache->data) {
+        DPRINTF("Failed to allocate cache->sets or cache->data\n");
+        g_free(cache->sets);
+        g_free(cache->data);
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+    for (i = 0; i < cache->num_sets; i++) {
+        for (w = 0; w < CACHE_WAYS; w++) {
+            cache->sets[i].it_addr[w] = CACHE_ADDR_INVALID;
+            cache->sets[i].it_age[w] = 0;
+        }
     }
 
     return cache;
@@ -100,90 +118,110 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
-    g_assert(cache->page_cache);
-
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
+    g_assert(cache->sets);
 
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
+    g_free(cache->sets);
+    g_free(cache->data);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+void cache_fini_rcu(PageCache *cache)
 {
-    size_t pos;
+    g_assert(cache);
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    call_rcu(cache, cache_fini, rcu);
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+static int64_t cache_get_set_index(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    g_assert(cache->num_sets);
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    return (address / cache->page_size) & (cache->num_sets - 1);
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Returns the way @addr is cached in, or -1 */
+static int cache_find_way(const PageCache *cache, const CacheSet *set,
+                          uint64_t addr)
+{
+    int w;
 
-    return &cache->page_cache[pos];
+    for (w = 0; w < cache->ways; w++) {
+        if (set->it_addr[w] == addr) {
+            return w;
+        }
+    }
+    return -1;
+}
+
+static uint8_t *cache_get_data(const PageCache *cache, int64_t set_index,
+                               int way)
+{
+    return cache->data +
+           (set_index * cache->ways + way) * (size_t)cache->page_size;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    int64_t idx = cache_get_set_index(cache, addr);
+    int w = cache_find_way(cache, &cache->sets[idx], addr);
+
+    return w < 0 ? NULL : cache_get_data(cache, idx, w);
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
                      uint64_t current_age)
 {
-    CacheItem *it;
-
-    it = cache_get_by_addr(cache, addr);
+    int64_t idx = cache_get_set_index(cache, addr);
+    CacheSet *set = &cache->sets[idx];
+    int w = cache_find_way(cache, set, addr);
 
-    if (it->it_addr == addr) {
+    if (w >= 0) {
         /* update the it_age when the cache hit */
-        it->it_age = current_age;
+        set->it_age[w] = current_age;
         return true;
     }
     return false;
 }
 
-int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
-                 uint64_t current_age)
+/* Returns a free way of @set, or else the least recently used one */
+static int cache_get_victim(const PageCache *cache, const CacheSet *set)
 {
+    int w, victim = 0;
 
-    CacheItem *it;
-
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    for (w = 0; w < cache->ways; w++) {
+        if (set->it_addr[w] == CACHE_ADDR_INVALID) {
+            return w;
+        }
+        if (set->it_age[w] < set->it_age[victim]) {
+            victim = w;
+        }
     }
-    /* allocate page */
-    if (!it->it_data) {
-        it->it_data = g_try_malloc(cache->page_size);
-        if (!it->it_data) {
-            DPRINTF("Error allocating page\n");
+    return victim;
+}
+
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
+                 uint64_t current_age)
+{
+    int64_t idx = cache_get_set_index(cache, addr);
+    CacheSet *set = &cache->sets[idx];
+    int w;
+
+    w = cache_find_way(cache, set, addr);
+    if (w < 0) {
+        w = cache_get_victim(cache, set);
+        if (set->it_addr[w] == CACHE_ADDR_INVALID) {
+            cache->num_items++;
+        } else if (set->it_age[w] + CACHED_PAGE_LIFETIME > current_age) {
+            /* even the oldest page of the set is fresh, don't replace it */
             return -1;
         }
-        cache->num_items++;
     }
 
-    memcpy(it->it_data, pdata, cache->page_size);
+    memcpy(cache_get_data(cache, idx, w), pdata, cache->page_size);
 
-    it->it_age = current_age;
-    it->it_addr = addr;
+    set->it_age[w] = current_age;
+    set->it_addr[w] = addr;
 
     return 0;
 }
@@ -192,13 +230,12 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
-
-    CacheItem *old_it, *new_it;
+    int w;
 
     g_assert(cache);
 
     /* cache was not inited */
-    if (cache->page_cache == NULL) {
+    if (cache->sets == NULL) {
         return -1;
     }
 
@@ -214,28 +251,40 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     }
 
     /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+    for (i = 0; i < cache->num_sets; i++) {
+        CacheSet *old_set = &cache->sets[i];
+
+        for (w = 0; w < cache->ways; w++) {
+            uint64_t addr = old_set->it_addr[w];
+            int64_t idx;
+            CacheSet *new_set;
+            int nw;
+
+            if (addr == CACHE_ADDR_INVALID) {
+                continue;
+            }
+            idx = cache_get_set_index(new_cache, addr);
+            new_set = &new_cache->sets[idx];
+            nw = cache_get_victim(new_cache, new_set);
+            if (new_set->it_addr[nw] == CACHE_ADDR_INVALID) {
+                new_cache->num_items++;
+            } else if (new_set->it_age[nw] >= old_set->it_age[w]) {
+                /* the set is full of more recently used pages */
+                continue;
             }
+            memcpy(cache_get_data(new_cache, idx, nw),
+                   cache_get_data(cache, i, w), cache->page_size);
+            new_set->it_addr[nw] = addr;
+            new_set->it_age[nw] = old_set->it_age[w];
         }
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
+    g_free(cache->sets);
+    g_free(cache->data);
+    cache->sets = new_cache->sets;
+    cache->data = new_cache->data;
+    cache->ways = new_cache->ways;
+    cache->num_sets = new_cache->num_sets;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
 
@@ -35,6 +35,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm-dirty-ring-size=n track dirty pages with KVM dirty rings of n entries (default: 0, use bitmaps)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
@@ -64,6 +65,11 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Track the pages written by each vCPU in a KVM dirty ring of @var{n} entries
+(a power of 2), instead of in dirty bitmaps.  A sync then costs in proportion
+to the pages that were written rather than to the size of guest memory,
+which helps large guests that write little.  The default, 0, uses bitmaps.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -3666,6 +3672,41 @@ queue @var{all|rx|tx} is an option that can be applied to any netfilter.
 @option{tx}: the filter is attached to the transmit queue of the netdev,
              where it will receive packets sent by the netdev.
 
+@item -object colo-compare,id=@var{id},netdev=@var{netdevid},secondary_in=@var{chardevid},queue=rx
+
+On the COLO primary, colo-compare holds the packets the guest sends on
+netdev @var{netdevid} and compares them with the ones the secondary
+guest sent, read from character device @var{chardevid} as a stream of
+packets each preceded by its length in network byte order. Packets are
+tracked per TCP/UDP connection; a primary packet is released as soon as
+the secondary sent the same payload, and a checkpoint is requested when
+they differ or when the secondary stays silent for too long.  Outside
+of COLO, packets go through unchanged.
+
+@item -object filter-mirror,id=@var{id},netdev=@var{netdevid},outdev=@var{chardevid}[,queue=@var{all|rx|tx}]
+
+filter-mirror on netdev @var{netdevid} copies every packet to character
+device @var{chardevid}, each packet preceded by its length in network
+byte order, and lets the packet go on.  Packets are written to the
+chardev in batches, once per main loop iteration.
+
+@item -object filter-redirector,id=@var{id},netdev=@var{netdevid},indev=@var{chardevid},outdev=@var{chardevid}[,queue=@var{all|rx|tx}]
+
+filter-redirector on netdev @var{netdevid} sends the packets it gets to
+character device @var{outdev} instead of passing them on, and injects
+the packets read from character device @var{indev} as if they had gone
+through the filter.  At least one of @var{indev} and @var{outdev} must
+be given, and they must differ.  Both use the framing of filter-mirror.
+
+@item -object filter-rewriter,id=@var{id},netdev=@var{netdevid}[,queue=@var{all|rx|tx}]
+
+On the COLO secondary, filter-rewriter shifts the TCP sequence numbers
+the secondary guest sends on netdev @var{netdevid}, and the
+acknowledgements it receives, so that its connections use the same
+sequence space as the primary's.  It must see both directions, so keep
+the default queue=all.  The translation is dropped at each checkpoint,
+since the secondary then continues from the primary's TCP state.
+
 @item -object filter-dump,id=@var{id},netdev=@var{dev},file=@var{filename}][,maxlen=@var{len}]
 
 Dump the network traffic on netdev @var{dev} to the file specified by
@@ -664,6 +664,49 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch an in-progress migration to postcopy mode.  Ignored after the end of
+migration (or once already in postcopy).  The x-postcopy-ram capability must
+be set before the migration is started.
+
+Example:
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "x-colo-lost-heartbeat",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_x_colo_lost_heartbeat,
+    },
+
+SQMP
+x-colo-lost-heartbeat
+---------------------
+
+Tell COLO that the peer is gone and fail over right away.  On the primary
+the VM goes on without protection; on the secondary the VM takes over from
+the last complete checkpoint.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "x-colo-lost-heartbeat" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -737,6 +780,71 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,mode:s?,sample-pages:i?",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its memory, without
+migrating it.  The result is read with query-dirty-rate.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+- "mode": "page-sampling" (default) hashes a sample of the pages,
+          "dirty-bitmap" uses dirty logging (json-string, optional)
+- "sample-pages": pages sampled per GiB with page-sampling, 128 to 4096,
+                  default 512 (json-int, optional)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 10 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the state and results of the last dirty rate measurement.
+
+returns a json-object with the following information:
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "dirty-rate": dirtied memory in MB/s, when measured (json-int, optional)
+- "start-time": start of the measurement, seconds since the epoch (json-int)
+- "calc-time": length of the measurement in seconds (json-int)
+- "mode": "page-sampling" or "dirty-bitmap" (json-string)
+- "sample-pages": pages sampled per GiB (json-int)
+- "ramblocks": when measured, json-array of json-objects with (optional):
+         - "id": RAM block name (json-string)
+         - "size": RAM block size in bytes (json-int)
+         - "dirty-rate": dirtied memory of the block in MB/s (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": { "status": "measured", "dirty-rate": 108,
+                 "start-time": 1444405353, "calc-time": 10,
+                 "mode": "page-sampling", "sample-pages": 512,
+                 "ramblocks": [ { "id": "pc.ram", "size": 4294967296,
+                                  "dirty-rate": 104 },
+                                { "id": "vga.vram", "size": 16777216,
+                                  "dirty-rate": 4 } ] } }
+
 EQMP
 
     {
@@ -3295,7 +3403,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "postcopy-active", "completed",
+       "failed", "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3326,6 +3435,8 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "postcopy-requests": pages requested by the destination while in
+           postcopy (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3342,6 +3453,28 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "x-colo": only present if "status" is "colo".
+  It is a json-object with the following COLO checkpoint information:
+         - "periodic": checkpoints taken because x-checkpoint-delay elapsed
+         - "dirty": checkpoints taken because x-checkpoint-dirty-pages pages
+           were dirtied
+         - "requested": checkpoints requested early, e.g. on a packet
+           mismatch
+         - "dirty-pages": pages dirtied since the last checkpoint
+- "x-checkpoint-stats": only present once the guest was paused for a COLO
+  checkpoint or for the completion of the migration.  It is a json-object
+  with the following members, each a histogram of the values seen at every
+  pause ("count", "last", "min", "max", "total" and "buckets", the number
+  of samples per power of two); times are in microseconds:
+         - "pause": time the guest was stopped
+         - "bitmap-sync": time spent syncing the dirty bitmap
+         - "ram-send": time spent sending the dirty RAM
+         - "device-save": time spent saving the device state
+         - "flush": time spent sending the device state (COLO only)
+         - "secondary-load": time the secondary took to load the
+           checkpoint (COLO only)
+         - "bytes": bytes sent while the guest was stopped
+         - "pages": RAM pages sent while the guest was stopped
 
 Examples:
 
@@ -3471,6 +3604,12 @@ Enable/Disable migration capabilities
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
 - "events": generate events for each migration state change
+- "x-colo": COarse-Grain LOck Stepping (COLO) for Non-stop Service
+- "x-postcopy-ram": postcopy mode for live migration
+- "return-path": open a channel from the destination back to the source
+- "x-multifd": send RAM pages on several connections in parallel
+- "x-zero-copy-send": send multifd pages without copying them (Linux only)
+- "x-host-pages": send huge page backed RAM a host page at a time
 
 Arguments:
 
@@ -3498,6 +3637,12 @@ Query current migration capabilities
          - "rdma-pin-all" : RDMA Pin Page state (json-bool)
          - "auto-converge" : Auto Converge state (json-bool)
          - "zero-blocks" : Zero Blocks state (json-bool)
+         - "x-colo" : COarse-Grain LOck Stepping state (json-bool)
+         - "x-postcopy-ram" : postcopy mode state (json-bool)
+         - "return-path" : return path state (json-bool)
+         - "x-multifd" : multifd state (json-bool)
+         - "x-zero-copy-send" : zero-copy send state (json-bool)
+         - "x-host-pages" : host page granularity state (json-bool)
 
 Arguments:
 
@@ -3523,6 +3668,19 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "x-checkpoint-delay": set the maximum interval between two COLO checkpoints,
+                        in milliseconds (json-int)
+- "x-checkpoint-dirty-pages": set the number of dirty pages that triggers an
+                              early COLO checkpoint, 0 to disable (json-int)
+- "x-heartbeat-interval": set how often the COLO primary checks that the
+                          secondary is alive, in milliseconds (json-int)
+- "x-heartbeat-timeout": set how long the COLO peer may stay silent before
+                         failing over, in milliseconds, 0 to disable
+                         (json-int)
+- "x-multifd-channels": set the number of connections multifd sends RAM
+                        pages on (json-int)
+- "x-compress-method": compression library, "zlib", "lz4" or "zstd"
+                       (json-string)
 
 Arguments:
 
@@ -3536,7 +3694,11 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,"
+            "x-checkpoint-delay:i?,x-checkpoint-dirty-pages:i?,"
+            "x-heartbeat-interval:i?,x-heartbeat-timeout:i?,"
+            "x-multifd-channels:i?,x-compress-method:s?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3549,6 +3711,16 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "x-checkpoint-delay" : maximum interval between two COLO
+                                  checkpoints, in milliseconds (json-int)
+         - "x-checkpoint-dirty-pages" : dirty pages that trigger an early COLO
+                                        checkpoint (json-int)
+         - "x-heartbeat-interval" : COLO heartbeat period, in milliseconds
+                                    (json-int)
+         - "x-heartbeat-timeout" : COLO failover timeout, in milliseconds
+                                   (json-int)
+         - "x-multifd-channels" : number of multifd connections (json-int)
+         - "x-compress-method" : compression library (json-string)
 
 Arguments:
 
@@ -4233,6 +4405,56 @@ Example:
                  "write-threshold": 17179869184 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "x-blockdev-change",
+        .args_type  = "parent:B,child:s?,node:s?",
+        .mhandler.cmd_new = qmp_marshal_x_blockdev_change,
+    },
+
+SQMP
+x-blockdev-change
+-----------------
+
+Dynamically reconfigure the block driver state graph.  It can be used
+to add, remove, insert or replace a graph node.  Currently only the
+Quorum driver implements this feature to add or remove its child.  This
+is useful to fix a broken quorum child.
+
+If @node is specified, it will be inserted under @parent.  @child
+may not be specified in this case.  If both @parent and @child are
+specified but @node is not, @child will be detached from @parent.
+
+Arguments:
+- "parent": the id or name of the parent node (json-string)
+- "child": the node name of the child to be removed (json-string, optional)
+- "node": the name of the node to be added (json-string, optional)
+
+Note: this command is experimental, and not a stable API.  It doesn't
+support all kinds of operations, all kinds of children, nor all block
+drivers.
+
+Example:
+
+Add a new node to a quorum
+-> { "execute": "blockdev-add",
+     "arguments": { "options": { "driver": "raw",
+                                 "node-name": "new_node",
+                                 "file": { "driver": "file",
+                                           "filename": "test.raw" } } } }
+<- { "return": {} }
+-> { "execute": "x-blockdev-change",
+     "arguments": { "parent": "disk1",
+                    "node": "new_node" } }
+<- { "return": {} }
+
+Delete a quorum's node
+-> { "execute": "x-blockdev-change",
+     "arguments": { "parent": "disk1",
+                    "child": "new_node" } }
+<- { "return": {} }
+
 EQMP
 
     {
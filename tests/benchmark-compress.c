@@ -0,0 +1,105 @@
+/*
+ * Page compression speed for each method QEMU was built with
+ *
+ * The numbers are for one thread, i.e. per compression thread of a
+ * migration.  The round trip itself is checked by test-page-compress.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page-compress.h"
+#include "benchmark.h"
+
+/* The default of the compress-level parameter */
+#define LEVEL 1
+#define ITERATIONS 100000
+
+/*
+ * Something between a zero page and random data: runs of repeated bytes,
+ * small integers and random bytes, like a page of heap.
+ */
+static void fill_page(uint8_t *page)
+{
+    int i = 0, j, len;
+
+    while (i < BENCH_PAGE_SIZE) {
+        len = MIN(g_test_rand_int_range(1, 64), BENCH_PAGE_SIZE - i);
+        switch (g_test_rand_int_range(0, 3)) {
+        case 0:
+            memset(page + i, 0, len);
+            break;
+        case 1:
+            for (j = 0; j < len; j++) {
+                page[i + j] = j % 8 ? 0 : g_test_rand_int_range(0, 16);
+            }
+            break;
+        default:
+            for (j = 0; j < len; j++) {
+                page[i + j] = g_test_rand_int();
+            }
+            break;
+        }
+        i += len;
+    }
+}
+
+static void bench_method(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    PageCompress *pc = page_compress_new(method);
+    uint8_t *page = g_malloc(BENCH_PAGE_SIZE);
+    uint8_t *dst = g_malloc(BENCH_PAGE_SIZE);
+    uint8_t *out = g_malloc(BENCH_PAGE_SIZE);
+    int i, n = bench_iterations(ITERATIONS);
+    ssize_t len = 0;
+    double mbps;
+
+    fill_page(page);
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        len = page_compress(pc, LEVEL, dst, BENCH_PAGE_SIZE, page,
+                            BENCH_PAGE_SIZE);
+    }
+    mbps = bench_mbps((double)n * BENCH_PAGE_SIZE);
+    g_assert(len > 0);
+    g_test_maximized_result(mbps, "%s compress: %.0f MB/s, ratio %.2f",
+                            MigrationCompressMethod_lookup[method], mbps,
+                            (double)BENCH_PAGE_SIZE / len);
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        page_decompress(pc, method, out, BENCH_PAGE_SIZE, dst, len);
+    }
+    mbps = bench_mbps((double)n * BENCH_PAGE_SIZE);
+    g_test_maximized_result(mbps, "%s decompress: %.0f MB/s",
+                            MigrationCompressMethod_lookup[method], mbps);
+
+    page_compress_free(pc);
+    g_free(page);
+    g_free(dst);
+    g_free(out);
+}
+
+int main(int argc, char **argv)
+{
+    MigrationCompressMethod method;
+    char *path;
+
+    g_test_init(&argc, &argv, NULL);
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD_MAX; method++) {
+        if (!page_compress_available(method)) {
+            continue;
+        }
+        path = g_strdup_printf("/compress/bench/%s",
+                               MigrationCompressMethod_lookup[method]);
+        g_test_add_data_func(path, GINT_TO_POINTER(method), bench_method);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
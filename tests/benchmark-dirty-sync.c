@@ -0,0 +1,113 @@
+/*
+ * Dirty bitmap sync speed, against the size of guest RAM
+ *
+ * With -m perf this goes up to 1TB of guest RAM.  The merge itself is
+ * checked by test-bitmap.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/bitops.h"
+#include "benchmark.h"
+
+/* One page out of DIRTY_RATIO is dirty */
+#define DIRTY_RATIO 64
+
+static long pages_of(uint64_t gb)
+{
+    return (long)((gb << 30) / BENCH_PAGE_SIZE);
+}
+
+/* Dirty one page in DIRTY_RATIO from @start, returns how many */
+static long dirty_pages(unsigned long *src, long start, long nr)
+{
+    long i, count = 0;
+
+    for (i = 0; i < nr; i += DIRTY_RATIO) {
+        set_bit(start + i + (i / DIRTY_RATIO) % 3, src);
+        count++;
+    }
+    return count;
+}
+
+/* What the sync used to do for blocks that don't start on a word */
+static long sync_per_page(unsigned long *dst, unsigned long *src,
+                          long start, long nr)
+{
+    long i, count = 0;
+
+    for (i = start; i < start + nr; i++) {
+        if (bitmap_test_and_clear_atomic(src, i, 1) &&
+            !test_and_set_bit(i, dst)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void bench_sync(const char *what, uint64_t gb, long offset,
+                       bool per_page)
+{
+    long nr = pages_of(gb);
+    unsigned long *src, *dst;
+    long count, dirty;
+    double ms;
+
+    src = bitmap_new(nr + offset);
+    dst = bitmap_new(nr + offset);
+    dirty = dirty_pages(src, offset, nr);
+    g_test_timer_start();
+    if (per_page) {
+        count = sync_per_page(dst, src, offset, nr);
+    } else {
+        count = bitmap_merge_and_clear_atomic(dst, src, NULL, offset, nr);
+    }
+    ms = g_test_timer_elapsed() * 1000;
+    g_test_minimized_result(ms, "%s, %" PRIu64 "GB: %.3f ms",
+                            what, gb, ms);
+    g_assert_cmpint(count, ==, dirty);
+
+    g_free(src);
+    g_free(dst);
+}
+
+static void bench_sizes(const char *what, long offset, bool per_page)
+{
+    uint64_t max = g_test_perf() ? (per_page ? 64 : 1024) : 4;
+    uint64_t gb;
+
+    for (gb = 1; gb <= max; gb *= 4) {
+        bench_sync(what, gb, offset, per_page);
+    }
+}
+
+static void bench_aligned(void)
+{
+    bench_sizes("aligned block", 0, false);
+}
+
+static void bench_unaligned(void)
+{
+    /* e.g. a hotplugged DIMM after an odd-sized block */
+    bench_sizes("unaligned block", 3, false);
+}
+
+static void bench_unaligned_per_page(void)
+{
+    bench_sizes("unaligned block, page at a time", 3, true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/dirty-sync/bench/aligned", bench_aligned);
+    g_test_add_func("/dirty-sync/bench/unaligned", bench_unaligned);
+    g_test_add_func("/dirty-sync/bench/unaligned_per_page",
+                    bench_unaligned_per_page);
+
+    return g_test_run();
+}
@@ -0,0 +1,95 @@
+/*
+ * Zero page detection and XBZRLE encoding speed
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "include/migration/migration.h"
+#include "benchmark.h"
+
+#define ITERATIONS 1000000
+
+static void bench_report(const char *what, int iterations)
+{
+    double mbps = bench_mbps((double)iterations * BENCH_PAGE_SIZE);
+
+    g_test_maximized_result(mbps, "%s: %.0f MB/s", what, mbps);
+}
+
+static void bench_find_nonzero_zero(void)
+{
+    uint8_t *page = qemu_memalign(BENCH_PAGE_SIZE, BENCH_PAGE_SIZE);
+    int i, n = bench_iterations(ITERATIONS);
+    size_t sum = 0;
+
+    memset(page, 0, BENCH_PAGE_SIZE);
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        sum += buffer_find_nonzero_offset(page, BENCH_PAGE_SIZE);
+    }
+    bench_report("zero page check", n);
+    g_assert_cmpuint(sum, ==, (size_t)n * BENCH_PAGE_SIZE);
+
+    qemu_vfree(page);
+}
+
+/* Encode @page against @old, changing every @stride bytes @len bytes */
+static void bench_encode(const char *what, int stride, int len)
+{
+    uint8_t *old = qemu_memalign(BENCH_PAGE_SIZE, BENCH_PAGE_SIZE);
+    uint8_t *page = qemu_memalign(BENCH_PAGE_SIZE, BENCH_PAGE_SIZE);
+    uint8_t *dst = g_malloc(BENCH_PAGE_SIZE);
+    int i, j, rc = 0, n = bench_iterations(ITERATIONS);
+
+    for (i = 0; i < BENCH_PAGE_SIZE; i++) {
+        old[i] = page[i] = g_test_rand_int();
+    }
+    for (i = 0; stride && i < BENCH_PAGE_SIZE; i += stride) {
+        for (j = i; j < i + len && j < BENCH_PAGE_SIZE; j++) {
+            page[j] = ~old[j];
+        }
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        rc = xbzrle_encode_buffer(old, page, BENCH_PAGE_SIZE, dst,
+                                  BENCH_PAGE_SIZE);
+    }
+    bench_report(what, n);
+    g_assert(rc >= 0);
+
+    qemu_vfree(old);
+    qemu_vfree(page);
+    g_free(dst);
+}
+
+static void bench_encode_unchanged(void)
+{
+    bench_encode("xbzrle unchanged page", 0, 0);
+}
+
+static void bench_encode_sparse(void)
+{
+    bench_encode("xbzrle 8 bytes per 256 changed", 256, 8);
+}
+
+static void bench_encode_dense(void)
+{
+    bench_encode("xbzrle 64 bytes per 128 changed", 128, 64);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/bench/find_nonzero_zero",
+                    bench_find_nonzero_zero);
+    g_test_add_func("/xbzrle/bench/encode_unchanged", bench_encode_unchanged);
+    g_test_add_func("/xbzrle/bench/encode_sparse", bench_encode_sparse);
+    g_test_add_func("/xbzrle/bench/encode_dense", bench_encode_dense);
+
+    return g_test_run();
+}
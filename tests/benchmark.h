@@ -0,0 +1,32 @@
+/*
+ * Helpers for the tests/benchmark-* programs
+ *
+ * "make bench" builds them; they are not run by "make check".  Run one
+ * with "-m perf" for meaningful numbers, otherwise only a few iterations
+ * are done.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef TESTS_BENCHMARK_H
+#define TESTS_BENCHMARK_H
+
+#include <glib.h>
+
+/* The page size migration works with on most targets */
+#define BENCH_PAGE_SIZE 4096
+
+/* @perf iterations with -m perf, a thousandth of that otherwise */
+static inline int bench_iterations(int perf)
+{
+    return g_test_perf() ? perf : MAX(perf / 1000, 1);
+}
+
+/* MB/s for @bytes processed since g_test_timer_start() */
+static inline double bench_mbps(double bytes)
+{
+    return bytes / g_test_timer_elapsed() / (1024 * 1024);
+}
+
+#endif
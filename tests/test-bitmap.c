@@ -0,0 +1,109 @@
+/*
+ * Bitmap unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/bitops.h"
+
+#define BITMAP_SIZE 1024
+
+/* The obvious page at a time version of bitmap_merge_and_clear_atomic */
+static long merge_per_bit(unsigned long *dst, unsigned long *src,
+                          long start, long nr)
+{
+    long i, count = 0;
+
+    for (i = start; i < start + nr; i++) {
+        if (bitmap_test_and_clear_atomic(src, i, 1) &&
+            !test_and_set_bit(i, dst)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static void test_merge_and_clear_atomic(void)
+{
+    long start, nr, expected, count, i;
+    unsigned long *src = bitmap_new(BITMAP_SIZE);
+    unsigned long *dst = bitmap_new(BITMAP_SIZE);
+    unsigned long *src2 = bitmap_new(BITMAP_SIZE);
+    unsigned long *dst2 = bitmap_new(BITMAP_SIZE);
+    unsigned long *words = bitmap_new(BITS_TO_LONGS(BITMAP_SIZE));
+    unsigned long *words2 = bitmap_new(BITS_TO_LONGS(BITMAP_SIZE));
+
+    for (start = 0; start < 130; start += 7) {
+        for (nr = 0; nr < 300; nr += 13) {
+            bitmap_zero(src, BITMAP_SIZE);
+            bitmap_zero(dst, BITMAP_SIZE);
+            bitmap_zero(words, BITS_TO_LONGS(BITMAP_SIZE));
+            bitmap_zero(words2, BITS_TO_LONGS(BITMAP_SIZE));
+            for (i = 0; i < BITMAP_SIZE; i++) {
+                if (g_test_rand_int_range(0, 3) == 0) {
+                    set_bit(i, src);
+                }
+                /* some bits are already set in the destination */
+                if (g_test_rand_int_range(0, 4) == 0) {
+                    set_bit(i, dst);
+                }
+            }
+            bitmap_copy(src2, src, BITMAP_SIZE);
+            bitmap_copy(dst2, dst, BITMAP_SIZE);
+
+            /* the words that get bits must be listed */
+            for (i = start; i < start + nr; i++) {
+                if (test_bit(i, src)) {
+                    set_bit(BIT_WORD(i), words2);
+                }
+            }
+
+            expected = merge_per_bit(dst2, src2, start, nr);
+            count = bitmap_merge_and_clear_atomic(dst, src, words, start, nr);
+            g_assert_cmpint(count, ==, expected);
+            g_assert(bitmap_equal(src, src2, BITMAP_SIZE));
+            g_assert(bitmap_equal(dst, dst2, BITMAP_SIZE));
+            g_assert(bitmap_equal(words, words2, BITS_TO_LONGS(BITMAP_SIZE)));
+        }
+    }
+
+    g_free(src);
+    g_free(dst);
+    g_free(src2);
+    g_free(dst2);
+    g_free(words);
+    g_free(words2);
+}
+
+static void test_merge_and_clear_atomic_no_words(void)
+{
+    unsigned long *src = bitmap_new(BITMAP_SIZE);
+    unsigned long *dst = bitmap_new(BITMAP_SIZE);
+
+    bitmap_set(src, 60, 10);
+    set_bit(64, dst);
+    /* @words is optional */
+    g_assert_cmpint(bitmap_merge_and_clear_atomic(dst, src, NULL, 3, 100),
+                    ==, 9);
+    g_assert(bitmap_empty(src, BITMAP_SIZE));
+    g_assert_cmpint(find_first_bit(dst, BITMAP_SIZE), ==, 60);
+    g_assert_cmpint(find_next_zero_bit(dst, BITMAP_SIZE, 60), ==, 70);
+
+    g_free(src);
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/bitmap/merge_and_clear_atomic",
+                    test_merge_and_clear_atomic);
+    g_test_add_func("/bitmap/merge_and_clear_atomic_no_words",
+                    test_merge_and_clear_atomic_no_words);
+
+    return g_test_run();
+}
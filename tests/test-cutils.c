@@ -1432,6 +1432,29 @@ static void test_qemu_strtosz_suffix_unit(void)
     g_assert_cmpint(res, ==, 12345000);
 }
 
+static void test_buffer_find_nonzero_offset(void)
+{
+    /* One length the vector versions can take, one they can't */
+    size_t lens[] = { 4096, 4096 + 128 };
+    static uint8_t buf[4096 + 128] __attribute__((aligned(64)));
+    size_t i, len, pos, ret;
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        len = lens[i];
+        memset(buf, 0, len);
+        g_assert_cmpuint(buffer_find_nonzero_offset(buf, len), ==, len);
+
+        for (pos = 0; pos < len; pos++) {
+            buf[pos] = 1;
+            ret = buffer_find_nonzero_offset(buf, len);
+            /* rounded down, at most to a multiple of 256 bytes */
+            g_assert_cmpuint(ret, <=, pos);
+            g_assert_cmpuint(ret + 256, >, pos);
+            buf[pos] = 0;
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1593,5 +1616,8 @@ int main(int argc, char **argv)
     g_test_add_func("/cutils/strtosz/suffix-unit",
                     test_qemu_strtosz_suffix_unit);
 
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+
     return g_test_run();
 }
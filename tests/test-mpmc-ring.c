@@ -0,0 +1,123 @@
+/*
+ * MPMC ring unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/mpmc-ring.h"
+#include "qemu/thread.h"
+
+typedef struct {
+    uint32_t thread;
+    uint32_t n;
+} Elem;
+
+static void test_fifo(void)
+{
+    MPMCRing ring;
+    Elem e;
+    uint32_t i, lap;
+
+    mpmc_ring_init(&ring, 8, sizeof(Elem));
+    g_assert(mpmc_ring_is_empty(&ring));
+    g_assert(!mpmc_ring_pop(&ring, &e));
+
+    /* go around a few times to exercise the sequence numbers */
+    for (lap = 0; lap < 3; lap++) {
+        for (i = 0; i < 8; i++) {
+            e.thread = lap;
+            e.n = i;
+            g_assert(mpmc_ring_push(&ring, &e));
+        }
+        g_assert(!mpmc_ring_push(&ring, &e));
+        g_assert(!mpmc_ring_is_empty(&ring));
+        for (i = 0; i < 8; i++) {
+            g_assert(mpmc_ring_pop(&ring, &e));
+            g_assert_cmpuint(e.thread, ==, lap);
+            g_assert_cmpuint(e.n, ==, i);
+        }
+        g_assert(!mpmc_ring_pop(&ring, &e));
+        g_assert(mpmc_ring_is_empty(&ring));
+    }
+
+    mpmc_ring_destroy(&ring);
+}
+
+#define THREADS      4
+#define PER_PRODUCER 100000
+
+static MPMCRing ring;
+static int producers_done;
+/* per producer, the next value each consumer expects */
+static uint32_t seen[THREADS][THREADS];
+static uint64_t popped[THREADS];
+
+static void *producer(void *opaque)
+{
+    Elem e = { .thread = (uintptr_t)opaque };
+
+    for (e.n = 0; e.n < PER_PRODUCER; e.n++) {
+        while (!mpmc_ring_push(&ring, &e)) {
+            sched_yield();
+        }
+    }
+    atomic_inc(&producers_done);
+    return NULL;
+}
+
+static void *consumer(void *opaque)
+{
+    int me = (uintptr_t)opaque;
+    Elem e;
+
+    for (;;) {
+        if (!mpmc_ring_pop(&ring, &e)) {
+            if (atomic_mb_read(&producers_done) == THREADS &&
+                mpmc_ring_is_empty(&ring)) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        /* each producer's elements come out in order */
+        g_assert_cmpuint(e.n, >=, seen[me][e.thread]);
+        seen[me][e.thread] = e.n + 1;
+        popped[me]++;
+    }
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    QemuThread threads[THREADS * 2];
+    uint64_t total = 0;
+    int i;
+
+    mpmc_ring_init(&ring, 64, sizeof(Elem));
+    for (i = 0; i < THREADS; i++) {
+        qemu_thread_create(&threads[i], "consumer", consumer,
+                           (void *)(uintptr_t)i, QEMU_THREAD_JOINABLE);
+        qemu_thread_create(&threads[THREADS + i], "producer", producer,
+                           (void *)(uintptr_t)i, QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < THREADS * 2; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    for (i = 0; i < THREADS; i++) {
+        total += popped[i];
+    }
+    g_assert_cmpuint(total, ==, (uint64_t)THREADS * PER_PRODUCER);
+    mpmc_ring_destroy(&ring);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/mpmc-ring/fifo", test_fifo);
+    g_test_add_func("/mpmc-ring/threads", test_threads);
+    return g_test_run();
+}
@@ -0,0 +1,121 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+/* Pages whose address maps to set 0 of a cache of @num_pages */
+static uint64_t set0_addr(int64_t num_pages, int i)
+{
+    return (uint64_t)i * (num_pages / 8) * PAGE_SIZE;
+}
+
+static void fill_page(uint8_t *page, int i)
+{
+    memset(page, i, PAGE_SIZE);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data;
+
+    g_assert(cache);
+    g_assert(!cache_is_cached(cache, 0, 1));
+    g_assert(get_cached_data(cache, 0) == NULL);
+
+    fill_page(page, 0x11);
+    g_assert_cmpint(cache_insert(cache, 0, page, 1), ==, 0);
+    g_assert(cache_is_cached(cache, 0, 1));
+    data = get_cached_data(cache, 0);
+    g_assert(data);
+    g_assert(memcmp(data, page, PAGE_SIZE) == 0);
+
+    /* inserting again updates the data */
+    fill_page(page, 0x22);
+    g_assert_cmpint(cache_insert(cache, 0, page, 1), ==, 0);
+    g_assert(memcmp(get_cached_data(cache, 0), page, PAGE_SIZE) == 0);
+
+    cache_fini(cache);
+}
+
+/* Pages mapping to the same set don't evict each other until it is full */
+static void test_set_associative(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        fill_page(page, i);
+        g_assert_cmpint(cache_insert(cache, set0_addr(64, i), page, 1), ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, set0_addr(64, i), 1));
+        fill_page(page, i);
+        g_assert(memcmp(get_cached_data(cache, set0_addr(64, i)), page,
+                        PAGE_SIZE) == 0);
+    }
+
+    /* the set is full and all of its pages are fresh */
+    g_assert_cmpint(cache_insert(cache, set0_addr(64, 8), page, 2), ==, -1);
+
+    /* refresh all but page 3, which becomes the one replaced */
+    for (i = 0; i < 8; i++) {
+        if (i != 3) {
+            g_assert(cache_is_cached(cache, set0_addr(64, i), 5));
+        }
+    }
+    g_assert_cmpint(cache_insert(cache, set0_addr(64, 8), page, 5), ==, 0);
+    g_assert(!cache_is_cached(cache, set0_addr(64, 3), 5));
+    g_assert(cache_is_cached(cache, set0_addr(64, 8), 5));
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        fill_page(page, i);
+        g_assert_cmpint(cache_insert(cache, i * PAGE_SIZE, page, i), ==, 0);
+    }
+
+    /* growing keeps everything */
+    g_assert_cmpint(cache_resize(cache, 128), ==, 128);
+    for (i = 0; i < 64; i++) {
+        fill_page(page, i);
+        g_assert(memcmp(get_cached_data(cache, i * PAGE_SIZE), page,
+                        PAGE_SIZE) == 0);
+    }
+
+    /* shrinking keeps the most recently used pages */
+    g_assert_cmpint(cache_resize(cache, 32), ==, 32);
+    for (i = 0; i < 64; i++) {
+        g_assert(!get_cached_data(cache, i * PAGE_SIZE) == (i < 32));
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/set_associative", test_set_associative);
+    g_test_add_func("/page_cache/resize", test_resize);
+
+    return g_test_run();
+}
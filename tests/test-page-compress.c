@@ -0,0 +1,111 @@
+/*
+ * Page compression unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page-compress.h"
+
+#define PAGE_SIZE 4096
+#define LEVEL 1
+
+/* Runs of zeroes and small integers with a few random bytes */
+static void fill_page(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        switch (i % 64 / 16) {
+        case 0:
+            page[i] = 0;
+            break;
+        case 1:
+            page[i] = i % 8 ? 0 : g_test_rand_int_range(0, 16);
+            break;
+        default:
+            page[i] = i % 4 ? 0 : g_test_rand_int();
+            break;
+        }
+    }
+}
+
+static void test_roundtrip(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    PageCompress *pc = page_compress_new(method);
+    /* the method of a stream is given on decompression */
+    PageCompress *dpc = page_compress_new(MIGRATION_COMPRESS_METHOD_ZLIB);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    ssize_t len;
+
+    fill_page(page);
+    len = page_compress(pc, LEVEL, dst, PAGE_SIZE, page, PAGE_SIZE);
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(len, <, PAGE_SIZE);
+
+    g_assert_cmpint(page_decompress(dpc, method, out, PAGE_SIZE, dst, len),
+                    ==, PAGE_SIZE);
+    g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+
+    /* doesn't fit */
+    g_assert_cmpint(page_decompress(dpc, method, out, PAGE_SIZE / 2,
+                                    dst, len), ==, -1);
+
+    page_compress_free(pc);
+    page_compress_free(dpc);
+    g_free(page);
+    g_free(dst);
+    g_free(out);
+}
+
+static void test_incompressible(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    PageCompress *pc = page_compress_new(method);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    int i;
+
+    /* a random page doesn't fit in less than its size */
+    for (i = 0; i < PAGE_SIZE; i++) {
+        page[i] = g_test_rand_int();
+    }
+    g_assert_cmpint(page_compress(pc, LEVEL, dst, PAGE_SIZE - PAGE_SIZE / 8,
+                                  page, PAGE_SIZE), ==, -1);
+
+    page_compress_free(pc);
+    g_free(page);
+    g_free(dst);
+}
+
+static void add_test(const char *name, MigrationCompressMethod method,
+                     void (*fn)(gconstpointer))
+{
+    char *path = g_strdup_printf("/page-compress/%s/%s",
+                                 MigrationCompressMethod_lookup[method], name);
+
+    g_test_add_data_func(path, GINT_TO_POINTER(method), fn);
+    g_free(path);
+}
+
+int main(int argc, char **argv)
+{
+    MigrationCompressMethod method;
+
+    g_test_init(&argc, &argv, NULL);
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD_MAX; method++) {
+        if (!page_compress_available(method)) {
+            continue;
+        }
+        add_test("roundtrip", method, test_roundtrip);
+        add_test("incompressible", method, test_incompressible);
+    }
+
+    return g_test_run();
+}
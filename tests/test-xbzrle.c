@@ -177,6 +177,38 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Runs of every length from every offset, so that the word and vector
+ * versions of the run search all get to their unaligned tails.
+ */
+static void test_encode_decode_runs(void)
+{
+    uint8_t *buffer = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc0(PAGE_SIZE);
+    int start, len, dlen, rc;
+
+    for (start = 0; start < 80; start++) {
+        for (len = 1; len < 80; len++) {
+            memset(buffer, 0, PAGE_SIZE);
+            memset(test, 0, PAGE_SIZE);
+            memset(buffer + start, 0xaa, len);
+            memset(buffer + PAGE_SIZE - start - len, 0x55, len);
+
+            dlen = xbzrle_encode_buffer(test, buffer, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            g_assert(dlen > 0);
+            rc = xbzrle_decode_buffer(compressed, dlen, test, PAGE_SIZE);
+            g_assert(rc == PAGE_SIZE - start);
+            g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -189,6 +221,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
 
     return g_test_run();
 }
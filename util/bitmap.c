@@ -12,6 +12,7 @@
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 
 /*
  * bitmaps provide an array of bits, implemented using an
@@ -280,6 +281,54 @@ bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr)
     return dirty != 0;
 }
 
+/*
+ * Clear bits [start, start + nr) of @src atomically, and set the ones that
+ * were set in the same bits of @dst.  A word at a time whatever @start is,
+ * since both bitmaps use the same indexing.  @dst is not updated
+ * atomically; it must not be written by anybody else in the words that
+ * the range covers.
+ *
+ * If @words is not NULL, bit k of it is set, atomically, for each word k
+ * of @dst that bits are merged into.
+ *
+ * Returns the number of bits that were newly set in @dst.
+ */
+long bitmap_merge_and_clear_atomic(unsigned long *dst, unsigned long *src,
+                                   unsigned long *words, long start, long nr)
+{
+    long k = BIT_WORD(start);
+    const long size = start + nr;
+    const long last = BIT_WORD(size - 1);
+    unsigned long mask = BITMAP_FIRST_WORD_MASK(start);
+    unsigned long bits;
+    long count = 0;
+
+    if (nr <= 0) {
+        return 0;
+    }
+
+    for (; k <= last; k++) {
+        if (k == last) {
+            mask &= BITMAP_LAST_WORD_MASK(size);
+        }
+        if (atomic_read(&src[k]) & mask) {
+            if (mask == ~0UL) {
+                bits = atomic_xchg(&src[k], 0);
+            } else {
+                bits = atomic_fetch_and(&src[k], ~mask) & mask;
+            }
+            count += ctpopl(bits & ~dst[k]);
+            dst[k] |= bits;
+            if (words && !test_bit(k, words)) {
+                atomic_or(&words[BIT_WORD(k)], BIT_MASK(k));
+            }
+        }
+        mask = ~0UL;
+    }
+
+    return count;
+}
+
 #define ALIGN_MASK(x,mask)      (((x)+(mask))&~(mask))
 
 /**
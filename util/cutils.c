@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
+#include "qemu/cpuid.h"
 #include <math.h>
 #include <limits.h>
 #include <errno.h>
@@ -181,14 +182,12 @@ int qemu_fdatasync(int fd)
  * If the buffer is all zero the return value is equal to len.
  */
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+static size_t buffer_find_nonzero_offset_inner(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
     if (!len) {
         return 0;
     }
@@ -216,6 +215,85 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define AVX2_VECTYPE        __m256i
+#define AVX2_ALL_EQ(v1, v2) \
+    (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2)) == 0xFFFFFFFF)
+#define AVX2_VEC_OR(v1, v2) (_mm256_or_si256(v1, v2))
+
+static bool
+can_use_buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    return (len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+                   * sizeof(AVX2_VECTYPE)) == 0
+            && ((uintptr_t) buf) % sizeof(AVX2_VECTYPE) == 0);
+}
+
+/* Same as buffer_find_nonzero_offset_inner() on twice as wide vectors */
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const AVX2_VECTYPE *p = buf;
+    const AVX2_VECTYPE zero = (AVX2_VECTYPE){0};
+    size_t i;
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!AVX2_ALL_EQ(p[i], zero)) {
+            return i * sizeof(AVX2_VECTYPE);
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / sizeof(AVX2_VECTYPE);
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        AVX2_VECTYPE tmp0 = AVX2_VEC_OR(p[i + 0], p[i + 1]);
+        AVX2_VECTYPE tmp1 = AVX2_VEC_OR(p[i + 2], p[i + 3]);
+        AVX2_VECTYPE tmp2 = AVX2_VEC_OR(p[i + 4], p[i + 5]);
+        AVX2_VECTYPE tmp3 = AVX2_VEC_OR(p[i + 6], p[i + 7]);
+        AVX2_VECTYPE tmp01 = AVX2_VEC_OR(tmp0, tmp1);
+        AVX2_VECTYPE tmp23 = AVX2_VEC_OR(tmp2, tmp3);
+        if (!AVX2_ALL_EQ(AVX2_VEC_OR(tmp01, tmp23), zero)) {
+            break;
+        }
+    }
+
+    return i * sizeof(AVX2_VECTYPE);
+}
+
+#pragma GCC pop_options
+
+static bool avx2_enabled;
+
+static void __attribute__((constructor)) init_buffer_find_nonzero_offset(void)
+{
+    avx2_enabled = host_cpu_has_avx2();
+}
+#endif
+
+/*
+ * The AVX2 version is used when the CPU has it and the buffer fits its
+ * (twice as large) requirements; the return value is then rounded down to
+ * multiples of sizeof(__m256i) instead.
+ */
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+#ifdef CONFIG_AVX2_OPT
+    if (avx2_enabled && can_use_buffer_find_nonzero_offset_avx2(buf, len)) {
+        return buffer_find_nonzero_offset_avx2(buf, len);
+    }
+#endif
+    return buffer_find_nonzero_offset_inner(buf, len);
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
@@ -0,0 +1,116 @@
+/*
+ * Bounded lock-free multi-producer multi-consumer ring
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/mpmc-ring.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+
+/*
+ * Theory of operation:
+ *
+ * Producers claim a position by incrementing tail with a compare-and-swap,
+ * consumers likewise with head.  Each cell has a sequence number telling
+ * which lap of the ring it is ready for: a cell at position pos can be
+ * written when seq == pos and read when seq == pos + 1.  After writing,
+ * the producer sets seq to pos + 1; after reading, the consumer sets it to
+ * pos + capacity, which is where the next lap's producer will look for it.
+ *
+ * So the two sides only share the cells they hand to each other, and a
+ * thread that is preempted in the middle of a push or pop only holds up the
+ * consumers of that one cell.
+ */
+
+void mpmc_ring_init(MPMCRing *ring, unsigned long capacity, size_t elem_size)
+{
+    unsigned long i;
+
+    assert(is_power_of_2(capacity));
+    ring->seq = g_new(unsigned long, capacity);
+    ring->data = g_malloc(capacity * elem_size);
+    ring->elem_size = elem_size;
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    for (i = 0; i < capacity; i++) {
+        ring->seq[i] = i;
+    }
+}
+
+void mpmc_ring_destroy(MPMCRing *ring)
+{
+    g_free(ring->seq);
+    g_free(ring->data);
+    ring->seq = NULL;
+    ring->data = NULL;
+}
+
+bool mpmc_ring_push(MPMCRing *ring, const void *elem)
+{
+    unsigned long pos = atomic_read(&ring->tail);
+    unsigned long seq, old;
+    long diff;
+
+    for (;;) {
+        seq = atomic_read(&ring->seq[pos & ring->mask]);
+        smp_rmb();
+        diff = (long)(seq - pos);
+        if (diff == 0) {
+            old = atomic_cmpxchg(&ring->tail, pos, pos + 1);
+            if (old == pos) {
+                break;
+            }
+            pos = old;
+        } else if (diff < 0) {
+            /* the consumer of the previous lap hasn't been here yet */
+            return false;
+        } else {
+            pos = atomic_read(&ring->tail);
+        }
+    }
+
+    memcpy(ring->data + (pos & ring->mask) * ring->elem_size, elem,
+           ring->elem_size);
+    smp_wmb();
+    atomic_set(&ring->seq[pos & ring->mask], pos + 1);
+    return true;
+}
+
+bool mpmc_ring_pop(MPMCRing *ring, void *elem)
+{
+    unsigned long pos = atomic_read(&ring->head);
+    unsigned long seq, old;
+    long diff;
+
+    for (;;) {
+        seq = atomic_read(&ring->seq[pos & ring->mask]);
+        smp_rmb();
+        diff = (long)(seq - (pos + 1));
+        if (diff == 0) {
+            old = atomic_cmpxchg(&ring->head, pos, pos + 1);
+            if (old == pos) {
+                break;
+            }
+            pos = old;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_read(&ring->head);
+        }
+    }
+
+    memcpy(elem, ring->data + (pos & ring->mask) * ring->elem_size,
+           ring->elem_size);
+    /* the copy must be done before the producer can reuse the cell */
+    smp_mb();
+    atomic_set(&ring->seq[pos & ring->mask], pos + ring->mask + 1);
+    return true;
+}
+
+bool mpmc_ring_is_empty(MPMCRing *ring)
+{
+    return atomic_read(&ring->head) == atomic_read(&ring->tail);
+}
@@ -1391,6 +1391,13 @@ void xen_modified_memory(ram_addr_t start, ram_addr_t length)
 
 void qmp_xen_set_global_dirty_log(bool enable, Error **errp)
 {
+    static bool enabled;
+
+    /* The dirty log counts its users, this is one of them */
+    if (enable == enabled) {
+        return;
+    }
+    enabled = enable;
     if (enable) {
         memory_global_dirty_log_start();
     } else {